@@ -0,0 +1,76 @@
+#include "audio_monitor.h"
+
+namespace {
+
+const int WarmupCallbacks = 4;
+
+}  // namespace
+
+void AudioMonitor::CallbackStart(int frames, int sample_rate) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (frequency_ == 0) {
+    frequency_ = SDL_GetPerformanceFrequency();
+    warmup_ = WarmupCallbacks;
+  }
+  period_ = (double)frames / sample_rate;
+  buffer_frames_.store(frames, std::memory_order_relaxed);
+  sample_rate_.store(sample_rate, std::memory_order_relaxed);
+
+  if (last_start_ != 0 && warmup_ == 0) {
+    double interval = (double)(now - last_start_) / frequency_;
+    double jitter_ms = (interval - period_) * 1000.0;
+    if (jitter_ms < 0) {
+      jitter_ms = -jitter_ms;
+    }
+    if (jitter_ms > max_jitter_ms_.load(std::memory_order_relaxed)) {
+      max_jitter_ms_.store((float)jitter_ms, std::memory_order_relaxed);
+    }
+    if (interval > 1.5 * period_) {
+      underruns_.fetch_add(1, std::memory_order_relaxed);
+    }
+  } else if (warmup_ > 0) {
+    warmup_--;
+  }
+  last_start_ = now;
+  start_ = now;
+}
+
+void AudioMonitor::CallbackEnd() {
+  if (start_ == 0 || period_ <= 0.0) {
+    return;
+  }
+  double load = (double)(SDL_GetPerformanceCounter() - start_) / frequency_ /
+                period_;
+  start_ = 0;
+  Uint32 callbacks = callbacks_.load(std::memory_order_relaxed) + 1;
+  callbacks_.store(callbacks, std::memory_order_relaxed);
+  if (load > 1.0) {
+    underruns_.fetch_add(1, std::memory_order_relaxed);
+  } else if (load > OverloadLoad) {
+    overloads_.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (load > max_load_.load(std::memory_order_relaxed)) {
+    max_load_.store((float)load, std::memory_order_relaxed);
+  }
+  total_load_ += load;
+  mean_load_.store((float)(total_load_ / callbacks), std::memory_order_relaxed);
+}
+
+void AudioMonitor::Restart() {
+  last_start_ = 0;
+  start_ = 0;
+  warmup_ = WarmupCallbacks;
+}
+
+AudioStats AudioMonitor::GetStats() const {
+  AudioStats stats;
+  stats.callbacks = callbacks_.load(std::memory_order_relaxed);
+  stats.underruns = underruns_.load(std::memory_order_relaxed);
+  stats.overloads = overloads_.load(std::memory_order_relaxed);
+  stats.buffer_frames = buffer_frames_.load(std::memory_order_relaxed);
+  stats.sample_rate = sample_rate_.load(std::memory_order_relaxed);
+  stats.max_load = max_load_.load(std::memory_order_relaxed);
+  stats.mean_load = mean_load_.load(std::memory_order_relaxed);
+  stats.max_jitter_ms = max_jitter_ms_.load(std::memory_order_relaxed);
+  return stats;
+}
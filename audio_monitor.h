@@ -0,0 +1,65 @@
+#ifndef AUDIO_MONITOR_H
+#define AUDIO_MONITOR_H
+
+#include <SDL.h>
+
+#include <atomic>
+
+// Callbacks whose own work takes more than this share of the period count as
+// overloads: they still made it, but not by much.
+const float OverloadLoad = 0.7f;
+
+// Totals since the device was first opened.
+struct AudioStats {
+  Uint32 callbacks;
+  // Callbacks that started more than half a period after they were due, or
+  // whose work took longer than the period, so the device most likely ran
+  // dry.
+  Uint32 underruns;
+  Uint32 overloads;
+  // Frames per callback, the device buffer, and frames per second.
+  int buffer_frames;
+  int sample_rate;
+  // Worst and average work time of a callback over its period.
+  float max_load;
+  float mean_load;
+  // Worst difference between the time between two callbacks and the period.
+  float max_jitter_ms;
+};
+
+// Watches the audio callback from the audio thread: how long it takes
+// against the time the block it renders lasts, and how regularly it is
+// called. Only relaxed atomics, readable from any thread.
+class AudioMonitor {
+ public:
+  // Audio thread, first thing in a callback rendering |frames| frames.
+  void CallbackStart(int frames, int sample_rate);
+  // Audio thread, when the callback is done with all its work.
+  void CallbackEnd();
+  // Forgets when the last callback came, after the device was reopened.
+  // Only while audio is closed.
+  void Restart();
+
+  AudioStats GetStats() const;
+
+ private:
+  Uint64 frequency_ = 0;
+  Uint64 start_ = 0;
+  Uint64 last_start_ = 0;
+  double period_ = 0.0;
+  // Callbacks left before arrival times mean anything, SDL fills its
+  // buffers in a burst when the device starts.
+  int warmup_ = 0;
+  double total_load_ = 0.0;
+
+  std::atomic<Uint32> callbacks_{0};
+  std::atomic<Uint32> underruns_{0};
+  std::atomic<Uint32> overloads_{0};
+  std::atomic<int> buffer_frames_{0};
+  std::atomic<int> sample_rate_{0};
+  std::atomic<float> max_load_{0.0f};
+  std::atomic<float> mean_load_{0.0f};
+  std::atomic<float> max_jitter_ms_{0.0f};
+};
+
+#endif  // AUDIO_MONITOR_H
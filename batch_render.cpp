@@ -0,0 +1,253 @@
+#include "batch_render.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+
+#include "drum_loop.h"
+#include "pattern_bank.h"
+#include "sound_data.h"
+
+namespace {
+
+const int RenderBlockFrames = 1024;
+
+struct RenderJob {
+  const DrumLoop::Pattern* pattern;
+  int bpm;
+  std::string file;
+};
+
+struct RenderQueue {
+  const RenderOptions* options;
+  Kit* kit;
+  std::vector<RenderJob> jobs;
+  std::atomic<int> next{0};
+  std::atomic<int> failed{0};
+  std::atomic<Uint64> frames{0};
+};
+
+void WriteLE16(Uint8* p, Uint16 v) {
+  p[0] = (Uint8)v;
+  p[1] = (Uint8)(v >> 8);
+}
+
+void WriteLE32(Uint8* p, Uint32 v) {
+  WriteLE16(p, (Uint16)v);
+  WriteLE16(p + 2, (Uint16)(v >> 16));
+}
+
+bool RenderPattern(const RenderJob& job, int loops,
+                   const TempoLane* song_tempo, Kit* kit, Uint64* rendered) {
+  FILE* f = fopen(job.file.c_str(), "wb");
+  if (f == nullptr) {
+    printf("Couldn't open %s for writing\n", job.file.c_str());
+    return false;
+  }
+
+  // The length is known up front, so the header can go out first.
+  Uint32 frames = RenderLength(*job.pattern, job.bpm, loops, song_tempo);
+  Uint32 data_bytes = frames * 4;
+  Uint8 header[44];
+  memcpy(header, "RIFF", 4);
+  WriteLE32(header + 4, 36 + data_bytes);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  WriteLE32(header + 16, 16);
+  WriteLE16(header + 20, 1);  // PCM
+  WriteLE16(header + 22, 2);
+  WriteLE32(header + 24, DefaultSampleRate);
+  WriteLE32(header + 28, DefaultSampleRate * 4);
+  WriteLE16(header + 32, 4);
+  WriteLE16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  WriteLE32(header + 40, data_bytes);
+  fwrite(header, 1, sizeof(header), f);
+
+  RenderPatternAudio(*job.pattern, job.bpm, loops, kit, DelaySettings(),
+                     [f](const Sint16* frames, int count) {
+                       fwrite(frames, 4, count, f);
+                       return true;
+                     }, song_tempo);
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    printf("Couldn't write %s\n", job.file.c_str());
+    return false;
+  }
+  *rendered += frames;
+  return true;
+}
+
+int StaticRenderFunc(void* render_queue_object) {
+  RenderQueue* queue = (RenderQueue*)render_queue_object;
+  Uint64 rendered = 0;
+  int job;
+  while ((job = queue->next.fetch_add(1)) < (int)queue->jobs.size()) {
+    if (!RenderPattern(queue->jobs[job], queue->options->loops,
+                       &queue->options->tempo, queue->kit, &rendered)) {
+      queue->failed++;
+    }
+  }
+  queue->frames += rendered;
+  return 0;
+}
+
+}  // namespace
+
+Uint32 RenderLength(const DrumLoop::Pattern& pattern, int bpm, int loops,
+                    const TempoLane* song_tempo) {
+  TempoMap tempo = song_tempo != nullptr && song_tempo->count > 0 ?
+      TempoMap(*song_tempo, 0, bpm, DefaultSampleRate) :
+      TempoMap(pattern.tempo, pattern.length, bpm, DefaultSampleRate);
+  return (Uint32)(tempo.Frames(0, loops * pattern.length) + 0.5);
+}
+
+bool RenderPatternAudio(
+    const DrumLoop::Pattern& pattern, int bpm, int loops, Kit* kit,
+    const DelaySettings& delay,
+    const std::function<bool(const Sint16*, int)>& sink,
+    const TempoLane* song_tempo) {
+  // Big buffers, keep them off the worker's stack.
+  std::unique_ptr<SoundData> sound_data = std::make_unique<SoundData>();
+  sound_data->SetSharedKit(kit);
+  DelayEffect* effect = sound_data->GetDelayEffect();
+  for (int i = 0; i < 9; i++) {
+    effect->EnableChannel(i, (delay.tracks >> i) & 1);
+  }
+  effect->IncreaseTime(delay.milliseconds - effect->GetMilliseconds());
+  effect->IncreaseFeedback(delay.feedback - effect->GetFeedback());
+
+  DrumLoop drum_loop(sound_data.get(), nullptr);
+  drum_loop.LoadPattern(&pattern);
+  drum_loop.SetBPM(bpm);
+  if (song_tempo != nullptr) {
+    drum_loop.SetSongTempo(*song_tempo);
+  }
+  drum_loop.Start();
+
+  Uint32 frames = RenderLength(pattern, bpm, loops, song_tempo);
+  Sint16 buffer[RenderBlockFrames * 2];
+  for (Uint32 done = 0; done < frames;) {
+    int n = frames - done < RenderBlockFrames ? frames - done
+                                              : RenderBlockFrames;
+    sound_data->Mix(buffer, n);
+    effect->ApplyDelay(buffer, n);
+    if (!sink(buffer, n)) {
+      return false;
+    }
+    done += n;
+  }
+  drum_loop.Stop();
+  return true;
+}
+
+bool CollectPatterns(const std::string& path,
+                     std::vector<DrumLoop::Pattern>* patterns,
+                     std::vector<std::string>* names) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  if (fs::is_directory(path, ec)) {
+    std::vector<std::string> files;
+    for (const fs::directory_entry& entry : fs::directory_iterator(path, ec)) {
+      if (entry.is_regular_file(ec)) {
+        files.push_back(entry.path().string());
+      }
+    }
+    std::sort(files.begin(), files.end());
+    for (const std::string& file : files) {
+      DrumLoop::Pattern p;
+      if (IsBankFile(file.c_str())) {
+        CollectPatterns(file, patterns, names);
+      } else if (DrumLoop::ReadPatternFile(file.c_str(), &p)) {
+        patterns->push_back(p);
+        names->push_back(fs::path(file).stem().string());
+      }
+    }
+    return true;
+  }
+
+  std::string stem = fs::path(path).stem().string();
+  if (IsBankFile(path.c_str())) {
+    std::vector<DrumLoop::Pattern> bank;
+    if (!ReadPatternBank(path.c_str(), &bank)) {
+      return false;
+    }
+    for (size_t i = 0; i < bank.size(); i++) {
+      char number[16];
+      snprintf(number, sizeof(number), "_%03i", (int)i + 1);
+      patterns->push_back(bank[i]);
+      names->push_back(stem + number);
+    }
+    return true;
+  }
+  DrumLoop::Pattern p;
+  if (!DrumLoop::ReadPatternFile(path.c_str(), &p)) {
+    printf("%s is not a pattern file\n", path.c_str());
+    return false;
+  }
+  patterns->push_back(p);
+  names->push_back(stem);
+  return true;
+}
+
+bool BatchRender(const RenderOptions& options, Kit* kit) {
+  std::vector<DrumLoop::Pattern> patterns;
+  std::vector<std::string> names;
+  for (const std::string& input : options.inputs) {
+    if (!CollectPatterns(input, &patterns, &names)) {
+      return false;
+    }
+  }
+  if (patterns.empty() || options.bpms.empty()) {
+    printf("Nothing to render\n");
+    return false;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(options.out_dir, ec);
+
+  RenderQueue queue;
+  queue.options = &options;
+  queue.kit = kit;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    for (int bpm : options.bpms) {
+      std::string file = (std::filesystem::path(options.out_dir) /
+                          (names[i] + "_" + std::to_string(bpm) + ".wav"))
+                             .string();
+      queue.jobs.push_back({ &patterns[i], bpm, file });
+    }
+  }
+
+  int threads = options.threads > 0 ? options.threads : SDL_GetCPUCount();
+  if (threads > (int)queue.jobs.size()) {
+    threads = (int)queue.jobs.size();
+  }
+
+  Uint32 start = SDL_GetTicks();
+  std::vector<SDL_Thread*> workers;
+  for (int i = 1; i < threads; i++) {
+    SDL_Thread* thread = SDL_CreateThread(StaticRenderFunc, "Render", &queue);
+    if (thread != nullptr) {
+      workers.push_back(thread);
+    }
+  }
+  // This thread is the last worker, so the work still gets done if no
+  // thread could start.
+  StaticRenderFunc(&queue);
+  for (SDL_Thread* thread : workers) {
+    SDL_WaitThread(thread, NULL);
+  }
+  Uint32 elapsed = SDL_GetTicks() - start;
+
+  double seconds = (double)queue.frames / DefaultSampleRate;
+  printf("Rendered %i files, %.1f s of audio in %.2f s on %i threads "
+         "(%.0fx realtime)\n", (int)queue.jobs.size() - queue.failed,
+         seconds, elapsed / 1000.0, (int)workers.size() + 1,
+         elapsed > 0 ? seconds * 1000.0 / elapsed : 0.0);
+  return queue.failed == 0;
+}
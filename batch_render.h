@@ -0,0 +1,61 @@
+#ifndef BATCH_RENDER_H
+#define BATCH_RENDER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "drum_loop.h"
+#include "voice_pool.h"
+
+struct RenderOptions {
+  // Pattern files, banks and directories holding either.
+  std::vector<std::string> inputs;
+  std::vector<int> bpms;
+  std::string out_dir;
+  int loops = 1;
+  // 0 uses one thread per core.
+  int threads = 0;
+  // Song tempo automation over all the loops, none if empty.
+  TempoLane tempo = {};
+};
+
+// Renders every pattern of |options.inputs| at every tempo to a 16 bit
+// stereo WAV file in |options.out_dir|, named <pattern>_<bpm>.wav. Each
+// render runs its own DrumLoop and SoundData on a pool of worker threads;
+// all of them play from |kit|, which is only read.
+bool BatchRender(const RenderOptions& options, Kit* kit);
+
+// The delay a render goes through, off unless some track is sent to it.
+struct DelaySettings {
+  // Bit i sends track i.
+  Uint16 tracks = 0;
+  int milliseconds = 400;
+  double feedback = 0.8;
+};
+
+// Frames of |loops| loops of |pattern| at |bpm| and DefaultSampleRate,
+// following the tempo automation of the pattern, or of |song_tempo| if it
+// has any.
+Uint32 RenderLength(const DrumLoop::Pattern& pattern, int bpm, int loops,
+                    const TempoLane* song_tempo = nullptr);
+
+// Renders |loops| loops of |pattern| at |bpm| from |kit| through |delay| on
+// the calling thread, with a DrumLoop and SoundData of its own. Hands the
+// output to |sink| block by block as S16 stereo frames at DefaultSampleRate.
+// False if |sink| did, which stops the render. |song_tempo| as for
+// RenderLength().
+bool RenderPatternAudio(
+    const DrumLoop::Pattern& pattern, int bpm, int loops, Kit* kit,
+    const DelaySettings& delay,
+    const std::function<bool(const Sint16*, int)>& sink,
+    const TempoLane* song_tempo = nullptr);
+
+// Adds the patterns of |path|, a pattern file, a bank or a directory of
+// either, to |patterns|, named after the file they came from. Directories
+// are searched one level deep.
+bool CollectPatterns(const std::string& path,
+                     std::vector<DrumLoop::Pattern>* patterns,
+                     std::vector<std::string>* names);
+
+#endif  // BATCH_RENDER_H
@@ -25,17 +25,30 @@ Button::Button(SDL_Surface *screen, SDL_Surface *active, SDL_Surface *inactive,
 
 Button::~Button() {}
 
+int Button::blit_count_ = 0;
+
+int Button::TakeBlitCount() {
+  int count = blit_count_;
+  blit_count_ = 0;
+  return count;
+}
+
+void Button::Blit(SDL_Surface *surface) {
+  SDL_BlitSurface(surface, NULL, screen_, &rect_);
+  blit_count_++;
+}
+
 void Button::SetPosition(int x, int y) {
   rect_.x = x;
   rect_.y = y;
 }
 
 void Button::SetActive() {
-  SDL_BlitSurface(active_, NULL, screen_, &rect_);
+  Blit(active_);
 }
 
 void Button::SetInactive() {
-  SDL_BlitSurface(inactive_, NULL, screen_, &rect_);
+  Blit(inactive_);
 }
 
 void Button::Draw() {
@@ -49,9 +62,9 @@ void Button::Draw() {
 void Button::SetToggled(bool toggled) {
 
   if (toggled) {
-    SDL_BlitSurface(toggled_, NULL, screen_, &rect_);
+    Blit(toggled_);
   } else {
-    SDL_BlitSurface(inactive_, NULL, screen_, &rect_);
+    Blit(inactive_);
   }
   is_toggled_ = toggled;
 }
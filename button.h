@@ -29,7 +29,16 @@ class Button
    virtual void Draw();
    void SetToggled(bool toggled);
 
+   // Blits done by all buttons since the last call.
+   static int TakeBlitCount();
+
+ protected:
+   // Draws |surface| at the button's position.
+   void Blit(SDL_Surface *surface);
+
  private:
+   static int blit_count_;
+
    bool has_error_ = false;
    bool is_active_ = false;
    bool is_toggled_ = false;
@@ -0,0 +1,222 @@
+// Loopback benchmark for the control socket of a running sdl_drums.
+//
+//   control_bench [-n count] [-t track] [-s socket]
+//
+// Sends |count| commands one at a time and times each round trip, from
+// writing the command to reading the reply the server sends once the command
+// is in the engine's queue. Pings by default, -t sends triggers on a track
+// instead. Then sends them all back to back to measure throughput.
+//
+// Last it times how long commands take to reach the audio: it moves the
+// tempo up and down one BPM and polls the stats after each change until the
+// sequencer has played a block at the new tempo, then puts the tempo back.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "control_protocol.h"
+
+// Tempo changes timed, and how long to wait for one to be heard.
+const int EffectChanges = 200;
+const double EffectTimeoutUs = 1e6;
+
+static double NowUs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool WriteAll(int fd, const void* data, size_t len) {
+  const char* p = (const char*)data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, void* data, size_t len) {
+  char* p = (char*)data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Sends |message| and reads its reply, and the stats for CONTROL_GET_STATS.
+static bool Send(int fd, const ControlMessage& message, ControlReply* reply,
+                 ControlStats* stats) {
+  return WriteAll(fd, &message, sizeof(message)) &&
+         ReadAll(fd, reply, sizeof(*reply)) &&
+         (message.op != CONTROL_GET_STATS ||
+          ReadAll(fd, stats, sizeof(*stats)));
+}
+
+int main(int argc, char* argv[]) {
+  int count = 10000;
+  int track = -1;
+  const char* path = CONTROL_SOCKET_FILE;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      track = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else {
+      printf("usage: %s [-n count] [-t track] [-s socket]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (count < 1) {
+    count = 1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    printf("Couldn't connect to %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  ControlMessage message;
+  memset(&message, 0, sizeof(message));
+  message.op = track >= 0 ? CONTROL_TRIGGER : CONTROL_PING;
+  message.track = track >= 0 ? track : 0;
+
+  std::vector<double> latency(count);
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    message.seq = i;
+    ControlReply reply;
+    double start = NowUs();
+    if (!WriteAll(fd, &message, sizeof(message)) ||
+        !ReadAll(fd, &reply, sizeof(reply))) {
+      printf("Connection lost\n");
+      return 1;
+    }
+    latency[i] = NowUs() - start;
+    if (reply.seq != message.seq || reply.status != CONTROL_OK) {
+      failed++;
+    }
+  }
+
+  std::sort(latency.begin(), latency.end());
+  printf("%i round trips, %i not accepted\n", count, failed);
+  printf("  min %.1f us  median %.1f us  p99 %.1f us  max %.1f us\n",
+         latency[0], latency[count / 2], latency[count * 99 / 100],
+         latency[count - 1]);
+
+  // Back to back, in batches the server can buffer without replies piling
+  // up in our socket.
+  const int batch = 32;
+  std::vector<ControlMessage> messages(batch, message);
+  std::vector<ControlReply> replies(batch);
+  double start = NowUs();
+  int sent = 0;
+  while (sent < count) {
+    int n = std::min(batch, count - sent);
+    for (int i = 0; i < n; i++) {
+      messages[i].seq = sent + i;
+    }
+    if (!WriteAll(fd, messages.data(), n * sizeof(ControlMessage)) ||
+        !ReadAll(fd, replies.data(), n * sizeof(ControlReply))) {
+      printf("Connection lost\n");
+      return 1;
+    }
+    sent += n;
+  }
+  double elapsed = NowUs() - start;
+  printf("  %.0f commands/s pipelined\n", count / (elapsed / 1e6));
+
+  // Command to effect, which includes waiting for the next audio block.
+  ControlMessage get_stats;
+  memset(&get_stats, 0, sizeof(get_stats));
+  get_stats.op = CONTROL_GET_STATS;
+  ControlMessage set_bpm = get_stats;
+  set_bpm.op = CONTROL_SET_BPM;
+  ControlReply reply;
+  ControlStats stats;
+  if (!Send(fd, get_stats, &reply, &stats)) {
+    printf("Connection lost\n");
+    return 1;
+  }
+  int bpm = (int)stats.sequencer_bpm;
+  int changes = std::min(count, EffectChanges);
+  std::vector<double> effect;
+  for (int i = 0; i < changes && bpm > 0; i++) {
+    set_bpm.arg = i % 2 == 0 ? (bpm > 100 ? bpm - 1 : bpm + 1) : bpm;
+    double start = NowUs();
+    if (!Send(fd, set_bpm, &reply, &stats)) {
+      printf("Connection lost\n");
+      return 1;
+    }
+    if (reply.status != CONTROL_OK) {
+      continue;
+    }
+    do {
+      if (!Send(fd, get_stats, &reply, &stats)) {
+        printf("Connection lost\n");
+        return 1;
+      }
+    } while ((int)stats.sequencer_bpm != set_bpm.arg &&
+             NowUs() - start < EffectTimeoutUs);
+    if ((int)stats.sequencer_bpm != set_bpm.arg) {
+      // Tempo automation overrides it, or audio isn't running.
+      break;
+    }
+    effect.push_back(NowUs() - start);
+  }
+  if (!effect.empty()) {
+    std::sort(effect.begin(), effect.end());
+    size_t n = effect.size();
+    printf("%zu tempo changes heard by the sequencer, %u frame blocks\n", n,
+           stats.buffer_frames);
+    printf("  min %.1f us  median %.1f us  p99 %.1f us  max %.1f us\n",
+           effect[0], effect[n / 2], effect[n * 99 / 100], effect[n - 1]);
+  } else {
+    printf("The sequencer didn't pick up the tempo change, is audio running "
+           "without tempo automation?\n");
+  }
+
+  // Whether all that traffic got in the way of the audio.
+  if (!Send(fd, get_stats, &reply, &stats)) {
+    printf("Connection lost\n");
+    return 1;
+  }
+  printf("Audio: %u underruns, %u overloads in %u callbacks of %u frames, "
+         "max load %u%%, max jitter %u us\n", stats.underruns,
+         stats.overloads, stats.callbacks, stats.buffer_frames,
+         stats.max_load / 10, stats.max_jitter_us);
+
+  close(fd);
+  return 0;
+}
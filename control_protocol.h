@@ -0,0 +1,84 @@
+#ifndef CONTROL_PROTOCOL_H
+#define CONTROL_PROTOCOL_H
+
+#include <stdint.h>
+
+// Binary protocol of the control socket, shared with clients. Every command
+// is one fixed size ControlMessage in host byte order (the socket is local)
+// and is answered with one ControlReply carrying the same seq, followed by
+// a ControlStats for CONTROL_GET_STATS.
+
+#define CONTROL_SOCKET_FILE "/tmp/sdl_drums.sock"
+
+enum ControlOp {
+  CONTROL_PING = 0,
+  // Plays |track| now.
+  CONTROL_TRIGGER,
+  // Sets |step| of |track| to |value| (0 or 1), as an undoable edit.
+  CONTROL_SET_TRIG,
+  // Sets the tempo to |arg| BPM, MIN_BPM to MAX_BPM. Like TRIGGER and
+  // TRANSPORT, applied to the engine before the reply; it takes effect
+  // from the next block of audio.
+  CONTROL_SET_BPM,
+  // |value| is one of TransportOp.
+  CONTROL_TRANSPORT,
+  // Audio callback counters, see ControlStats.
+  CONTROL_GET_STATS,
+};
+
+enum TransportOp {
+  TRANSPORT_STOP = 0,
+  TRANSPORT_PLAY,
+  TRANSPORT_PAUSE,
+  TRANSPORT_RECORD,
+};
+
+enum ControlStatus {
+  CONTROL_OK = 0,
+  CONTROL_BAD_COMMAND,
+  // The queue to the engine or the UI was full, try again.
+  CONTROL_BUSY,
+};
+
+struct ControlMessage {
+  uint8_t op;
+  uint8_t track;
+  uint8_t step;
+  uint8_t value;
+  uint32_t seq;
+  int32_t arg;
+  uint32_t reserved;
+};
+
+struct ControlReply {
+  uint32_t seq;
+  uint8_t status;
+  uint8_t reserved[3];
+};
+
+// Totals since audio started.
+struct ControlStats {
+  uint32_t callbacks;
+  // Callbacks that came too late or took longer than their period, and ones
+  // that took most of it.
+  uint32_t underruns;
+  uint32_t overloads;
+  uint32_t buffer_frames;
+  uint32_t sample_rate;
+  // Worst callback work time, in thousandths of the period.
+  uint32_t max_load;
+  // Worst deviation of the time between callbacks from the period, in
+  // microseconds.
+  uint32_t max_jitter_us;
+  // Tempo (rounded) and transport the sequencer used for its last block,
+  // so a client can tell when a command has taken effect.
+  uint32_t sequencer_bpm;
+  uint32_t sequencer_playing;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(ControlMessage) == 16, "ControlMessage must be packed");
+static_assert(sizeof(ControlReply) == 8, "ControlReply must be packed");
+static_assert(sizeof(ControlStats) == 40, "ControlStats must be packed");
+
+#endif  // CONTROL_PROTOCOL_H
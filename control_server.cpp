@@ -0,0 +1,300 @@
+#include "control_server.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "drum_loop.h"
+#include "tempo_lane.h"
+
+namespace {
+
+// How often the server thread checks whether it should stop.
+const int PollTimeoutMs = 100;
+const int TRACKS = 9;
+const int STEPS = 32;
+
+}  // namespace
+
+static int StaticServerFunc(void* control_server_object) {
+  return ((ControlServer*)control_server_object)->ServerFunc();
+}
+
+ControlServer::ControlServer() {
+  path_[0] = '\0';
+}
+
+ControlServer::~ControlServer() {
+  Stop();
+}
+
+// Commands are checked here so the UI thread only ever sees valid ones.
+// Tempo and transport are applied here, the UI thread only redraws.
+ControlStatus ControlServer::Dispatch(const ControlMessage& message) {
+  switch (message.op) {
+    case CONTROL_PING:
+    case CONTROL_GET_STATS:
+      return CONTROL_OK;
+    case CONTROL_TRIGGER:
+      if (message.track >= TRACKS) {
+        return CONTROL_BAD_COMMAND;
+      }
+      return sound_data_->PlaySample(message.track) ? CONTROL_OK :
+                                                      CONTROL_BUSY;
+    case CONTROL_SET_TRIG:
+      if (message.track >= TRACKS || message.step >= STEPS ||
+          message.value > 1) {
+        return CONTROL_BAD_COMMAND;
+      }
+      break;
+    case CONTROL_SET_BPM:
+      if (message.arg < MIN_BPM || message.arg > MAX_BPM) {
+        return CONTROL_BAD_COMMAND;
+      }
+      drum_loop_->SetBPM(message.arg);
+      break;
+    case CONTROL_TRANSPORT:
+      if (message.value > TRANSPORT_RECORD) {
+        return CONTROL_BAD_COMMAND;
+      }
+      Transport(message.value);
+      break;
+    default:
+      return CONTROL_BAD_COMMAND;
+  }
+  return commands_.Push(message) ? CONTROL_OK : CONTROL_BUSY;
+}
+
+void ControlServer::Transport(int op) {
+  if (op == TRANSPORT_STOP) {
+    drum_loop_->Stop();
+  } else if (op == TRANSPORT_PAUSE) {
+    if (drum_loop_->Running()) {
+      drum_loop_->Pause();
+    }
+  } else {
+    bool rec = op == TRANSPORT_RECORD;
+    if (drum_loop_->Running()) {
+      drum_loop_->SetRec(rec);
+    } else if (rec) {
+      drum_loop_->StartWithRec();
+    } else {
+      drum_loop_->Start();
+    }
+  }
+}
+
+bool ControlServer::PopCommand(ControlMessage* message) {
+  if (commands_.Pop(message)) {
+    return true;
+  }
+  // Pop again after clearing, for a command pushed by a Wake() that still
+  // saw the flag set.
+  wake_pending_.store(false);
+  return commands_.Pop(message);
+}
+
+void ControlServer::Wake() {
+  if (wake_event_ == (Uint32)-1 || wake_pending_.exchange(true)) {
+    return;
+  }
+  SDL_Event event;
+  memset(&event, 0, sizeof(event));
+  event.type = wake_event_;
+  SDL_PushEvent(&event);
+}
+
+#ifdef _WIN32
+
+bool ControlServer::Start(const char* path, SoundData* sound_data,
+                          DrumLoop* drum_loop) {
+  printf("The control socket is not supported on Windows\n");
+  return false;
+}
+
+void ControlServer::Stop() {}
+
+int ControlServer::ServerFunc() {
+  return 0;
+}
+
+#else
+
+bool ControlServer::Start(const char* path, SoundData* sound_data,
+                          DrumLoop* drum_loop) {
+  sound_data_ = sound_data;
+  drum_loop_ = drum_loop;
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Control socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    printf("Couldn't create control socket: %s\n", strerror(errno));
+    return false;
+  }
+  // A socket file left behind by an earlier run.
+  unlink(path);
+  if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd_, MaxControlClients) != 0) {
+    printf("Couldn't listen on %s: %s\n", path, strerror(errno));
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  fcntl(listen_fd_, F_SETFL, O_NONBLOCK);
+  strcpy(path_, path);
+  if (wake_event_ == (Uint32)-1) {
+    wake_event_ = SDL_RegisterEvents(1);
+  }
+
+  running_ = true;
+  thread_ = SDL_CreateThread(StaticServerFunc, "ControlServer", this);
+  if (thread_ == nullptr) {
+    printf("Couldn't start control server: %s\n", SDL_GetError());
+    running_ = false;
+    Stop();
+    return false;
+  }
+  return true;
+}
+
+void ControlServer::Stop() {
+  running_ = false;
+  if (thread_ != nullptr) {
+    SDL_WaitThread(thread_, NULL);
+    thread_ = nullptr;
+  }
+  while (client_count_ > 0) {
+    CloseClient(client_count_ - 1);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(path_);
+  }
+}
+
+ControlStats ControlServer::GetStats() {
+  AudioStats audio = sound_data_->GetAudioStats();
+  ControlStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.callbacks = audio.callbacks;
+  stats.underruns = audio.underruns;
+  stats.overloads = audio.overloads;
+  stats.buffer_frames = audio.buffer_frames;
+  stats.sample_rate = audio.sample_rate;
+  stats.max_load = (uint32_t)(audio.max_load * 1000.0f);
+  stats.max_jitter_us = (uint32_t)(audio.max_jitter_ms * 1000.0f);
+  stats.sequencer_bpm = (uint32_t)(drum_loop_->SequencerBPM() + 0.5);
+  stats.sequencer_playing = drum_loop_->SequencerPlaying();
+  return stats;
+}
+
+void ControlServer::CloseClient(int index) {
+  close(clients_[index].fd);
+  clients_[index] = clients_[--client_count_];
+}
+
+// Reads whatever the client has sent without waiting for more, handles the
+// complete messages and answers them with a single write. Returns false once
+// the client is gone.
+bool ControlServer::ReadClient(Client* client) {
+  for (;;) {
+    ssize_t n = recv(client->fd, client->buffer + client->used,
+                     sizeof(client->buffer) - client->used, MSG_DONTWAIT);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    client->used += (int)n;
+
+    int count = client->used / (int)sizeof(ControlMessage);
+    Uint8 replies[sizeof(client->buffer) / sizeof(ControlMessage) *
+                  (sizeof(ControlReply) + sizeof(ControlStats))];
+    int reply_bytes = 0;
+    for (int i = 0; i < count; i++) {
+      ControlMessage message;
+      memcpy(&message, client->buffer + i * sizeof(ControlMessage),
+             sizeof(message));
+      ControlReply reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.seq = message.seq;
+      reply.status = Dispatch(message);
+      memcpy(replies + reply_bytes, &reply, sizeof(reply));
+      reply_bytes += sizeof(reply);
+      if (message.op == CONTROL_GET_STATS) {
+        ControlStats stats = GetStats();
+        memcpy(replies + reply_bytes, &stats, sizeof(stats));
+        reply_bytes += sizeof(stats);
+      }
+    }
+    int consumed = count * (int)sizeof(ControlMessage);
+    client->used -= consumed;
+    memmove(client->buffer, client->buffer + consumed, client->used);
+
+    // A client that doesn't read its replies loses them rather than
+    // stalling everyone else.
+    if (count > 0) {
+      Wake();
+      send(client->fd, replies, reply_bytes, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+  }
+}
+
+int ControlServer::ServerFunc() {
+  pollfd fds[MaxControlClients + 1];
+  while (running_) {
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < client_count_; i++) {
+      fds[i + 1].fd = clients_[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    int nfds = client_count_ + 1;
+    if (poll(fds, nfds, PollTimeoutMs) <= 0) {
+      continue;
+    }
+
+    // Back to front, so closing a client doesn't move one not yet handled.
+    for (int i = nfds - 1; i >= 1; i--) {
+      if (fds[i].revents && !ReadClient(&clients_[i - 1])) {
+        CloseClient(i - 1);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+        if (client_count_ == MaxControlClients) {
+          printf("Too many control clients\n");
+          close(fd);
+          continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        clients_[client_count_].fd = fd;
+        clients_[client_count_].used = 0;
+        client_count_++;
+      }
+    }
+  }
+  return 0;
+}
+
+#endif
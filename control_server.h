@@ -0,0 +1,68 @@
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include <SDL.h>
+
+#include <atomic>
+
+#include "control_protocol.h"
+#include "event_queue.h"
+#include "sound_data.h"
+
+class DrumLoop;
+
+const int MaxControlClients = 8;
+
+// Listens on a Unix domain socket for ControlMessages from other local
+// processes. A thread of its own waits on all sockets with poll() and never
+// blocks on any single client. Commands go straight to the engine where
+// they can: triggers into its lock-free trigger queue, tempo and transport
+// into the sequencer's atomics, so they take effect from the next block of
+// audio. Trig edits change the pattern owned by the UI thread, which picks
+// them up with PopCommand(). It gets tempo and transport commands as well,
+// to bring the screen up to date.
+class ControlServer {
+ public:
+  ControlServer();
+  ~ControlServer();
+
+  bool Start(const char* path, SoundData* sound_data, DrumLoop* drum_loop);
+  void Stop();
+
+  // Next command for the UI thread, false when there is none. Accepted
+  // commands also post an SDL event to wake the UI's event loop, at most
+  // one until PopCommand() has come back empty.
+  bool PopCommand(ControlMessage* message);
+
+  int ServerFunc();
+
+ private:
+  struct Client {
+    int fd;
+    int used;
+    Uint8 buffer[sizeof(ControlMessage) * 64];
+  };
+
+  bool ReadClient(Client* client);
+  ControlStatus Dispatch(const ControlMessage& message);
+  void Transport(int op);
+  ControlStats GetStats();
+  void CloseClient(int index);
+  void Wake();
+
+  SoundData* sound_data_ = nullptr;
+  DrumLoop* drum_loop_ = nullptr;
+  SDL_Thread* thread_ = nullptr;
+  std::atomic<bool> running_{false};
+  int listen_fd_ = -1;
+  char path_[108];
+
+  Client clients_[MaxControlClients];
+  int client_count_ = 0;
+
+  EventQueue<ControlMessage, 256> commands_;
+  Uint32 wake_event_ = (Uint32)-1;
+  std::atomic<bool> wake_pending_{false};
+};
+
+#endif  // CONTROL_SERVER_H
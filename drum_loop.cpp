@@ -1,31 +1,76 @@
+#include <algorithm>
 #include <functional>
 #include <fstream>
-#include <thread>
-#include <chrono>
+#include <cmath>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "drum_loop.h"
+#include "pattern_journal.h"
 
 //Redefintion that lets us skip including sdl_drums.h
 // Need to find a better place for this.
 const int SOUND_BUTTONS_TOTAL = 9;
 
-DrumLoop::DrumLoop(SoundData* sound_data) {
+// Fraction of a frame a position may be short of it by rounding.
+static const double FrameSlack = 1e-6;
+
+// Bits of the steps within a pattern of |length| steps.
+static Uint32 StepMask(int length) {
+  return length >= 32 ? 0xffffffffu : (1u << length) - 1;
+}
+
+// Names of the lock parameters in pattern files.
+static const char* LockNames[DrumLoop::LOCK_PARAMS] = {
+  "volume", "pitch", "pan", "cutoff", "send",
+};
+
+// Index of the lowest set bit of |bits|, which isn't 0.
+static int LowestBit(Uint32 bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return (int)index;
+#else
+  return __builtin_ctz(bits);
+#endif
+}
+
+static int StaticProcess(void* drum_loop_object, Uint64 frame, int frames,
+                         Hit* hits, int max_hits) {
+  return ((DrumLoop*)drum_loop_object)->Process(frame, frames, hits, max_hits);
+}
+
+DrumLoop::DrumLoop(SoundData* sound_data, const char* pattern_file) {
   sound_data_ = sound_data;
-  std::fstream stream;
-  stream.open(MAIN_PATTERN_FILE, std::ios_base::in);
-  char arr[100];
-  if (stream.is_open()) {
-    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
-      stream.getline(arr, 100, '\n');
-      arr[32] = '\0';
-      strncpy(main_pattern_.tracks[i], arr, 32);
-      main_pattern_.tracks[i][32] = '\0';
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    skip_step_[i] = -1;
+    lock_cursor_[i] = 0;
+  }
+
+  EmptyPattern(&main_pattern_);
+  if (pattern_file != nullptr) {
+    pattern_file_ = pattern_file;
+    if (!ReadPatternFile(pattern_file, &main_pattern_)) {
+      printf("Couldn't open main pattern file %s\n", pattern_file);
+      EmptyPattern(&main_pattern_);
+    }
+    journal_ = std::make_unique<PatternJournal>();
+    std::string journal_file = pattern_file_ + JOURNAL_EXTENSION;
+    if (!journal_->Open(journal_file.c_str(), pattern_file,
+                        &main_pattern_)) {
+      // Saved only on exit, like before.
+      journal_.reset();
     }
-    stream.close();
-  } else {
-    printf("Couldn't open main pattern file %s\n", MAIN_PATTERN_FILE);
-    ClearPattern();
   }
+  CopyPattern(&journaled_, &main_pattern_);
+  loop_length_ = main_pattern_.length;
+  pattern_tempo_.Store(main_pattern_.tempo);
+  shared_pattern_.Store(main_pattern_);
+  CopyPattern(&playing_pattern_, &main_pattern_);
+  sound_data_->SetSequencer(StaticProcess, this);
   /*for (int i = 0; i < MAX_UNDO; i++) {
     undo_list[i].type = None;
     undo_list[i].data = nullptr;
@@ -36,36 +81,252 @@ DrumLoop::~DrumLoop() {
   if (loop_running_) {
     Stop();
   }
-  WritePatternToFile(MAIN_PATTERN_FILE);
+  sound_data_->SetSequencer(nullptr, nullptr);
+  if (journal_) {
+    journal_->Close(&main_pattern_);
+  } else if (!pattern_file_.empty()) {
+    WritePatternToFile(pattern_file_.c_str());
+  }
   for (int i = 0; i < undo_list.size(); i++) {
-    if (undo_list[i].data != nullptr) {
-      delete undo_list[i].data;
+    FreeUndoData(&undo_list[i]);
+  }
+}
+
+void DrumLoop::WritePatternToFile(const char* filename) {
+  WritePatternFile(filename, &main_pattern_);
+}
+
+void DrumLoop::EmptyPattern(Pattern* p) {
+  memset(p->trigs, 0, sizeof(p->trigs));
+  memset(p->micro, 0, sizeof(p->micro));
+  p->length = MAX_STEPS;
+  ClearTempoLane(&p->tempo);
+  memset(p->track_length, 0, sizeof(p->track_length));
+  memset(p->divisor, 1, sizeof(p->divisor));
+  memset(p->ratchet, 0, sizeof(p->ratchet));
+  memset(p->locks, 0, sizeof(p->locks));
+  memset(p->lock_start, 0, sizeof(p->lock_start));
+}
+
+int DrumLoop::TrackLength(const Pattern* p, int track) {
+  return p->track_length[track] != 0 ? p->track_length[track] : p->length;
+}
+
+// Index of the lock of |param| at |step| of |track| in p->locks, or of
+// where it would go.
+static int FindLock(const DrumLoop::Pattern* p, int track, int step,
+                    int param) {
+  int i = p->lock_start[track];
+  int last = p->lock_start[track + 1];
+  while (i < last && (p->locks[i].step < step ||
+                      (p->locks[i].step == step && p->locks[i].param < param))) {
+    i++;
+  }
+  return i;
+}
+
+int DrumLoop::GetLock(const Pattern* p, int track, int step, int param) {
+  int i = FindLock(p, track, step, param);
+  if (i < p->lock_start[track + 1] && p->locks[i].step == step &&
+      p->locks[i].param == param) {
+    return p->locks[i].value;
+  }
+  return NO_LOCK;
+}
+
+bool DrumLoop::SetLock(Pattern* p, int track, int step, int param,
+                       int value) {
+  int i = FindLock(p, track, step, param);
+  int total = p->lock_start[SOUND_BUTTONS_TOTAL];
+  bool found = i < p->lock_start[track + 1] && p->locks[i].step == step &&
+               p->locks[i].param == param;
+  if (value == NO_LOCK) {
+    if (found) {
+      memmove(&p->locks[i], &p->locks[i + 1],
+              (total - i - 1) * sizeof(ParamLock));
+      for (int t = track + 1; t <= SOUND_BUTTONS_TOTAL; t++) {
+        p->lock_start[t]--;
+      }
     }
+    return true;
+  }
+  value = value < 0 ? 0 : (value > MAX_LOCK_VALUE ? MAX_LOCK_VALUE : value);
+  if (found) {
+    p->locks[i].value = (Uint8)value;
+    return true;
+  }
+  if (total == MAX_LOCKS) {
+    return false;
+  }
+  memmove(&p->locks[i + 1], &p->locks[i], (total - i) * sizeof(ParamLock));
+  p->locks[i].step = (Uint8)step;
+  p->locks[i].param = (Uint8)param;
+  p->locks[i].value = (Uint8)value;
+  for (int t = track + 1; t <= SOUND_BUTTONS_TOTAL; t++) {
+    p->lock_start[t]++;
   }
+  return true;
 }
 
-static int StaticLoopFunc(void* drum_loop_object) {
-  return ((DrumLoop*)drum_loop_object)->LoopFunc(drum_loop_object);
+bool DrumLoop::SetTrackLocks(Pattern* p, int track, const ParamLock* locks,
+                             int count) {
+  int first = p->lock_start[track];
+  int old = LockCount(p, track);
+  int total = p->lock_start[SOUND_BUTTONS_TOTAL];
+  bool fits = count <= MAX_LOCKS - (total - old);
+  if (!fits) {
+    count = MAX_LOCKS - (total - old);
+  }
+  memmove(&p->locks[first + count], &p->locks[first + old],
+          (total - first - old) * sizeof(ParamLock));
+  memcpy(&p->locks[first], locks, count * sizeof(ParamLock));
+  for (int t = track + 1; t <= SOUND_BUTTONS_TOTAL; t++) {
+    p->lock_start[t] = (Uint16)(p->lock_start[t] + count - old);
+  }
+  return fits;
 }
 
-void DrumLoop::WritePatternToFile(const char* filename) {
+static bool SameTrackLocks(const DrumLoop::Pattern* a,
+                           const DrumLoop::Pattern* b, int track) {
+  int count = DrumLoop::LockCount(a, track);
+  return count == DrumLoop::LockCount(b, track) &&
+         memcmp(DrumLoop::TrackLocks(a, track), DrumLoop::TrackLocks(b, track),
+                count * sizeof(DrumLoop::ParamLock)) == 0;
+}
+
+const char* DrumLoop::LockParamName(int param) {
+  return param >= 0 && param < LOCK_PARAMS ? LockNames[param] : "";
+}
+
+bool DrumLoop::ReadPatternFile(const char* filename, Pattern* p) {
+  std::fstream stream;
+  stream.open(filename, std::ios_base::in);
+  if (!stream.is_open()) {
+    return false;
+  }
+  EmptyPattern(p);
+  // Every track line has one '0'/'1' per step, the first line sets the
+  // pattern length.
+  char arr[100];
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    stream.getline(arr, 100, '\n');
+    int length = (int)strspn(arr, "01");
+    if (length > MAX_STEPS) {
+      length = MAX_STEPS;
+    }
+    if (length == 0 || (i > 0 && length != p->length)) {
+      return false;  // Not a pattern file
+    }
+    p->length = length;
+    for (int j = 0; j < length; j++) {
+      p->trigs[i] |= (Uint32)(arr[j] == '1') << j;
+    }
+  }
+  // Optional lines after the tracks: "micro <track> <step> <offset>" and
+  // "tempo <step> <bpm>"
+  while (stream.getline(arr, 100, '\n')) {
+    int track, step, micro, length, divisor, count, ramp, value;
+    float bpm;
+    char name[16];
+    if (sscanf(arr, "micro %i %i %i", &track, &step, &micro) == 3 &&
+        track >= 0 && track < SOUND_BUTTONS_TOTAL && step >= 0 && step < 32) {
+      p->micro[track][step] = (signed char)micro;
+    } else if (sscanf(arr, "tempo %i %f", &step, &bpm) == 2 && step >= 0 &&
+               step < MAX_STEPS) {
+      AddTempoPoint(&p->tempo, step, bpm);
+    } else if (sscanf(arr, "track %i %i %i", &track, &length, &divisor) ==
+                   3 && track >= 0 && track < SOUND_BUTTONS_TOTAL &&
+               length >= 0 && length <= MAX_STEPS && divisor >= 1 &&
+               divisor <= MAX_DIVISOR) {
+      p->track_length[track] = (Uint8)length;
+      p->divisor[track] = (Uint8)divisor;
+    } else if (sscanf(arr, "ratchet %i %i %i %i", &track, &step, &count,
+                      &ramp) == 4 && track >= 0 &&
+               track < SOUND_BUTTONS_TOTAL && step >= 0 && step < 32 &&
+               count >= 1 && count <= MAX_RATCHET && ramp >= 0 &&
+               ramp < RAMP_TYPES) {
+      p->ratchet[track][step] = RatchetByte(count, ramp);
+    } else if (sscanf(arr, "lock %i %i %15s %i", &track, &step, name,
+                      &value) == 4 && track >= 0 &&
+               track < SOUND_BUTTONS_TOTAL && step >= 0 && step < 32) {
+      for (int param = 0; param < LOCK_PARAMS; param++) {
+        if (strcmp(name, LockNames[param]) == 0) {
+          SetLock(p, track, step, param, value);
+        }
+      }
+    }
+  }
+  stream.close();
+  return true;
+}
+
+bool DrumLoop::WritePatternFile(const char* filename, const Pattern* p) {
   std::fstream stream;
   stream.open(filename, std::ios_base::out);
-  if (stream.is_open()) {
-    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
-      stream.write(main_pattern_.tracks[i], 32);
-      stream.write("\n", 1);
+  if (!stream.is_open()) {
+    return false;
+  }
+  char line[100];
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    for (int j = 0; j < p->length; j++) {
+      line[j] = (p->trigs[i] >> j) & 1 ? '1' : '0';
+    }
+    line[p->length] = '\n';
+    stream.write(line, p->length + 1);
+  }
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    for (int j = 0; j < 32; j++) {
+      if ((p->trigs[i] >> j) & 1 && p->micro[i][j]) {
+        int len = snprintf(line, sizeof(line), "micro %i %i %i\n", i, j,
+                           p->micro[i][j]);
+        stream.write(line, len);
+      }
+    }
+  }
+  for (int i = 0; i < p->tempo.count; i++) {
+    int len = snprintf(line, sizeof(line), "tempo %i %g\n",
+                       p->tempo.points[i].step, p->tempo.points[i].bpm);
+    stream.write(line, len);
+  }
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (p->track_length[i] != 0 || p->divisor[i] != 1) {
+      int len = snprintf(line, sizeof(line), "track %i %i %i\n", i,
+                         p->track_length[i], p->divisor[i]);
+      stream.write(line, len);
+    }
+  }
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    for (int j = 0; j < 32; j++) {
+      Uint8 ratchet = p->ratchet[i][j];
+      if ((p->trigs[i] >> j) & 1 && ratchet != 0) {
+        int len = snprintf(line, sizeof(line), "ratchet %i %i %i %i\n", i, j,
+                           RatchetCount(ratchet), RatchetRamp(ratchet));
+        stream.write(line, len);
+      }
+    }
+  }
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    const ParamLock* locks = TrackLocks(p, i);
+    for (int j = 0; j < LockCount(p, i); j++) {
+      if ((p->trigs[i] >> locks[j].step) & 1) {
+        int len = snprintf(line, sizeof(line), "lock %i %i %s %i\n", i,
+                           locks[j].step, LockNames[locks[j].param],
+                           locks[j].value);
+        stream.write(line, len);
+      }
     }
-    stream.close();
   }
+  stream.close();
+  return true;
 }
 
+// Playback picks up at the step after the current one, so from the top when
+// stopped and where it left off when paused.
 void DrumLoop::Start() {
-  loop_running_ = true;
   paused_ = false;
   rec_mode_ = false;
-  //if (!loop_thread_)
-    loop_thread_ = SDL_CreateThread(StaticLoopFunc, "Hello!", this);
+  start_step_ = (current_step_ + 1) % loop_length_;
+  loop_running_ = true;
 }
 
 void DrumLoop::SetRec(bool rec) {
@@ -73,11 +334,10 @@ void DrumLoop::SetRec(bool rec) {
 }
 
 void DrumLoop::StartWithRec() {
-  loop_running_ = true;
   paused_ = false;
   rec_mode_ = true;
-  //if (!loop_thread_)
-    loop_thread_ = SDL_CreateThread(StaticLoopFunc, "Hello!", this);
+  start_step_ = (current_step_ + 1) % loop_length_;
+  loop_running_ = true;
 }
 
 bool DrumLoop::Recording() {
@@ -92,14 +352,13 @@ void DrumLoop::Stop() {
   loop_running_ = false;
   paused_ = false;
   current_step_ = STOPPED;
-  //SDL_WaitThread(loop_thread_, NULL);
 }
 
 void DrumLoop::Pause() {
+  current_step_ = playing_step_.load();
   loop_running_ = false;
   //rec_mode_ = false;
   paused_ = true;
-  SDL_WaitThread(loop_thread_, NULL);
 }
 
 bool DrumLoop::Paused() {
@@ -107,17 +366,108 @@ bool DrumLoop::Paused() {
 }
 
 void DrumLoop::SetBPM(int bpm) {
-  bpm_ = bpm;
+  bpm_ = std::min(std::max(bpm, MIN_BPM), MAX_BPM);
 }
 
 void DrumLoop::SpeedUp(int bpm) {
-  bpm_ += bpm;
+  SetBPM(bpm_ + bpm);
 }
 
 void DrumLoop::SlowDown(int bpm) {
-  if (bpm_ - bpm > 0) {
-    bpm_ -= bpm;
+  SetBPM(bpm_ - bpm);
+}
+
+bool DrumLoop::SetTempoPoint(int step, int bpm) {
+  TempoLane lane = main_pattern_.tempo;
+  if (!AddTempoPoint(&lane, step, (float)bpm)) {
+    return false;
+  }
+  if (SameTempoLane(lane, main_pattern_.tempo)) {
+    return true;
+  }
+  LayoutChange change;
+  BeginLayoutEdit(&change);
+  main_pattern_.tempo = lane;
+  EndLayoutEdit(&change);
+  return true;
+}
+
+bool DrumLoop::ClearTempo() {
+  if (main_pattern_.tempo.count == 0) {
+    return false;
+  }
+  LayoutChange change;
+  BeginLayoutEdit(&change);
+  ClearTempoLane(&main_pattern_.tempo);
+  EndLayoutEdit(&change);
+  return true;
+}
+
+void DrumLoop::SetSongTempo(const TempoLane& lane) {
+  song_tempo_.Store(lane);
+}
+
+bool DrumLoop::SetTrackLength(int track, int length) {
+  if (length < 0 || length > MAX_STEPS) {
+    return false;
+  }
+  if (main_pattern_.track_length[track] == length) {
+    return false;
+  }
+  LayoutChange change;
+  BeginLayoutEdit(&change);
+  main_pattern_.track_length[track] = (Uint8)length;
+  EndLayoutEdit(&change);
+  return true;
+}
+
+bool DrumLoop::SetRatchet(int track, int step, int count, int ramp) {
+  if (count < 1 || count > MAX_RATCHET || ramp < 0 || ramp >= RAMP_TYPES) {
+    return false;
+  }
+  Uint8 ratchet = RatchetByte(count, ramp);
+  if (main_pattern_.ratchet[track][step] == ratchet) {
+    return false;
+  }
+  TrackChange t;
+  BeginTrackEdit(track, &t);
+  main_pattern_.ratchet[track][step] = ratchet;
+  EndTrackEdit(&t);
+  return true;
+}
+
+bool DrumLoop::SetParamLock(int track, int step, int param, int value) {
+  if (step < 0 || step >= MAX_STEPS || param < 0 || param >= LOCK_PARAMS) {
+    return false;
+  }
+  if (value != NO_LOCK) {
+    value = value < 0 ? 0 : (value > MAX_LOCK_VALUE ? MAX_LOCK_VALUE : value);
+  }
+  if (GetLock(&main_pattern_, track, step, param) == value) {
+    return false;
+  }
+  TrackChange t;
+  BeginTrackEdit(track, &t);
+  // Leaves the pattern as it was when there's no room.
+  if (!SetLock(&main_pattern_, track, step, param, value)) {
+    return false;
+  }
+  EndTrackEdit(&t);
+  return true;
+}
+
+bool DrumLoop::SetTrackDivisor(int track, int divisor) {
+  if (divisor < 1 || divisor > MAX_DIVISOR) {
+    return false;
   }
+  if (main_pattern_.divisor[track] == divisor) {
+    return false;
+  }
+  LayoutChange change;
+  BeginLayoutEdit(&change);
+  main_pattern_.divisor[track] = (Uint8)divisor;
+  EndLayoutEdit(&change);
+  return true;
 }
 
 void DrumLoop::NextStep() {
@@ -132,32 +482,204 @@ void DrumLoop::PrevStep() {
 }
 
 char DrumLoop::GetTrig(int track, int step) {
-  return main_pattern_.tracks[track][step];
+  return (main_pattern_.trigs[track] >> step) & 1 ? '1' : '0';
 }
 
-void DrumLoop::SetTrig(int track, int step, char data, bool undoable) {
+void DrumLoop::SetTrig(int track, int step, char data, bool undoable,
+                       signed char micro) {
   if (undoable) {
-    TrigEntry *entry = new TrigEntry { track, step, data };
+    TrigEntry *entry = new TrigEntry {
+      track, step, GetTrig(track, step) != '0', data != '0',
+      main_pattern_.micro[track][step], micro };
     UndoAction action;
     action.type = TrigEdit;
     action.data = entry;
     ShrinkUndoListIfNeeded();
     undo_list.push_back(action);
     current_undo++;
+    main_pattern_.micro[track][step] = micro;
+  }
+  Uint32 trigs = data == '0' ? main_pattern_.trigs[track] & ~(1u << step)
+                             : main_pattern_.trigs[track] | 1u << step;
+  if (!undoable && trigs == main_pattern_.trigs[track]) {
+    return;
+  }
+  main_pattern_.trigs[track] = trigs;
+  PatternChanged(track);
+}
+
+void DrumLoop::SetMicro(int track, int step, signed char micro) {
+  if (main_pattern_.micro[track][step] == micro) {
+    return;
+  }
+  main_pattern_.micro[track][step] = micro;
+  PatternChanged(track);
+}
+
+void DrumLoop::PatternChanged(int track) {
+  loop_length_ = main_pattern_.length;
+  pattern_tempo_.Store(main_pattern_.tempo);
+  shared_pattern_.Store(main_pattern_);
+  pattern_version_.fetch_add(1, std::memory_order_release);
+  JournalChanges(track);
+}
+
+// Every edit, undo and redo ends up in PatternChanged(), so comparing with
+// what was journaled last catches all of them without each one having to
+// say what it touched. Edits of a single track only compare that track, and
+// edits of the tempo lane and layout no track.
+// A track the journal had no room for still differs and goes in with the
+// next edit of the whole pattern, or with the save on exit.
+void DrumLoop::JournalChanges(int track) {
+  if (!journal_) {
+    return;
+  }
+  bool wrote = false;
+  bool length_changed = journaled_.length != main_pattern_.length;
+  int first = track >= 0 ? track : 0;
+  int last = track >= 0 ? track
+                        : (track == ALL_TRACKS ? SOUND_BUTTONS_TOTAL - 1 : -1);
+  for (int i = first; i <= last; i++) {
+    bool changed = main_pattern_.trigs[i] != journaled_.trigs[i] ||
+                   memcmp(main_pattern_.micro[i], journaled_.micro[i],
+                          MAX_STEPS) != 0;
+    if (memcmp(main_pattern_.ratchet[i], journaled_.ratchet[i],
+               MAX_STEPS) != 0 &&
+        journal_->AppendRatchets(i, main_pattern_)) {
+      memcpy(journaled_.ratchet[i], main_pattern_.ratchet[i], MAX_STEPS);
+      journaled_.length = main_pattern_.length;
+      wrote = true;
+    }
+    if (!SameTrackLocks(&main_pattern_, &journaled_, i)) {
+      bool appended = true;
+      for (int param = 0; param < LOCK_PARAMS && appended; param++) {
+        appended = journal_->AppendLocks(i, param, main_pattern_);
+        wrote |= appended;
+      }
+      if (appended) {
+        SetTrackLocks(&journaled_, i, TrackLocks(&main_pattern_, i),
+                      LockCount(&main_pattern_, i));
+        journaled_.length = main_pattern_.length;
+      }
+    }
+    // Any record carries the length, track 0 stands in when only that
+    // changed.
+    if (!changed && !(length_changed && i == 0)) {
+      continue;
+    }
+    if (journal_->Append(i, main_pattern_)) {
+      journaled_.trigs[i] = main_pattern_.trigs[i];
+      memcpy(journaled_.micro[i], main_pattern_.micro[i], MAX_STEPS);
+      journaled_.length = main_pattern_.length;
+      wrote = true;
+    }
+  }
+  if (track == ALL_TRACKS || track == NO_TRACKS) {
+    if (!SameTempoLane(main_pattern_.tempo, journaled_.tempo) &&
+        journal_->AppendTempo(main_pattern_)) {
+      journaled_.tempo = main_pattern_.tempo;
+      journaled_.length = main_pattern_.length;
+      wrote = true;
+    }
+    bool layout_changed =
+        memcmp(main_pattern_.track_length, journaled_.track_length,
+               sizeof(main_pattern_.track_length)) != 0 ||
+        memcmp(main_pattern_.divisor, journaled_.divisor,
+               sizeof(main_pattern_.divisor)) != 0;
+    if (layout_changed && journal_->AppendLayout(main_pattern_)) {
+      memcpy(journaled_.track_length, main_pattern_.track_length,
+             sizeof(main_pattern_.track_length));
+      memcpy(journaled_.divisor, main_pattern_.divisor,
+             sizeof(main_pattern_.divisor));
+      journaled_.length = main_pattern_.length;
+      wrote = true;
+    }
+  }
+  // Replay only applies the records of an edit once it has all of them.
+  if (wrote) {
+    journal_->EndEdit();
+  }
+}
+
+void DrumLoop::SetQuantizeStrength(float strength) {
+  if (strength < 0.0f) {
+    strength = 0.0f;
+  } else if (strength > 1.0f) {
+    strength = 1.0f;
   }
-  main_pattern_.tracks[track][step] = data;
+  quantize_strength_ = strength;
+}
+
+// Unwrapped step position at |ticks|, extrapolated from the last block the
+// sequencer processed.
+double DrumLoop::PositionAtTicks(Uint32 ticks) {
+  Position p = position_.Load();
+  if (p.frames_per_step <= 0) {
+    return p.pos;
+  }
+  Sint64 frame = sound_data_->FrameAtTicks(ticks);
+  return p.pos + (frame - (Sint64)p.frame) / p.frames_per_step;
+}
+
+double DrumLoop::SequencerBPM() {
+  Position p = position_.Load();
+  if (p.frames_per_step <= 0) {
+    return 0;
+  }
+  return sound_data_->GetSampleRate() * 60.0 / (p.frames_per_step * 4.0);
+}
+
+bool DrumLoop::SequencerPlaying() {
+  return position_.Load().playing;
+}
+
+double DrumLoop::HeardPosition(Uint32 ticks) {
+  if (!loop_running_) {
+    return STOPPED;
+  }
+  double pos = std::fmod(PositionAtTicks(ticks), (double)loop_length_);
+  return pos < 0 ? pos + loop_length_ : pos;
+}
+
+// In the track's own steps, which can be longer than the pattern's.
+DrumLoop::RecordedHit DrumLoop::QuantizeHit(int track, Uint32 ticks) {
+  double pos = PositionAtTicks(ticks) / main_pattern_.divisor[track];
+  int length = TrackLength(&main_pattern_, track);
+
+  Sint64 step = (Sint64)std::floor(pos + 0.5);
+  int micro = (int)std::lround((pos - step) * (1.0f - quantize_strength_) *
+                               MICRO_STEPS);
+  if (micro < -MICRO_STEPS / 2) {
+    micro = -MICRO_STEPS / 2;
+  } else if (micro > MICRO_STEPS / 2 - 1) {
+    micro = MICRO_STEPS / 2 - 1;
+  }
+
+  // The pad already sounded, don't play it again when the loop gets there.
+  skip_step_[track] = step;
+
+  RecordedHit hit;
+  hit.step = (int)(((step % length) + length) % length);
+  hit.micro = (signed char)micro;
+  return hit;
 }
 
 void DrumLoop::PrintUndoEntries() {
   for (int i = 0; i < current_undo; i++) {
     if (undo_list[i].type == TrigEdit) {
       TrigEntry* entry = (TrigEntry*)(undo_list[i].data);
-      printf("Entry %i = [%i %i %i]\n", i,
-          entry->track, entry->step, entry->data);
+      printf("Entry %i = [%i %i %i -> %i]\n", i,
+          entry->track, entry->step, entry->before, entry->after);
     } else if (undo_list[i].type == ClearAll) {
       Pattern* p = (Pattern*)(undo_list[i].data);
       for (int i = 0; i < 9; i++) {
-        printf("%s\n", p->tracks[i]);
+        printf("%08x\n", p->trigs[i]);
+      }
+    } else if (undo_list[i].type == BulkEdit) {
+      BulkChange* change = (BulkChange*)(undo_list[i].data);
+      for (const TrackChange& t : change->tracks) {
+        printf("Entry %i = track %i %08x -> %08x\n", i, t.track, t.before,
+               t.after);
       }
     }
   }
@@ -170,7 +692,7 @@ DrumLoop::UndoAction DrumLoop::Undo() {
     return action;
   }
   current_undo--;
-  return ApplyUndoAction();
+  return ApplyUndoAction(true);
 }
 
 DrumLoop::UndoAction DrumLoop::Redo() {
@@ -179,25 +701,66 @@ DrumLoop::UndoAction DrumLoop::Redo() {
     return action;
   }
   PrintUndoEntries();
-  UndoAction apply = ApplyUndoAction();
+  UndoAction apply = ApplyUndoAction(false);
   current_undo++;
   return apply;
 }
 
 // Used for both Undo and Redo. It's those function's responsibility to
 // advance the current_undo value and then call this.
-DrumLoop::UndoAction DrumLoop::ApplyUndoAction() {
+DrumLoop::UndoAction DrumLoop::ApplyUndoAction(bool undo) {
   UndoAction action = undo_list[current_undo];
+  int changed_track = ALL_TRACKS;
   if (action.type == TrigEdit) {
     TrigEntry* entry = (TrigEntry*)(action.data);
     int track = entry->track;
+    changed_track = track;
     int step = entry->step;
-    char data = entry->data;
-    main_pattern_.tracks[track][step] = data;
+    if (undo ? entry->before : entry->after) {
+      main_pattern_.trigs[track] |= 1u << step;
+    } else {
+      main_pattern_.trigs[track] &= ~(1u << step);
+    }
+    main_pattern_.micro[track][step] = undo ? entry->micro_before
+                                            : entry->micro_after;
   } else if (action.type == ClearAll) {
-    Pattern* p = (Pattern*)(action.data);
-    CopyPattern(&main_pattern_, p);
+    if (undo) {
+      CopyPattern(&main_pattern_, (Pattern*)(action.data));
+    } else {
+      EmptyPattern(&main_pattern_);
+    }
+  } else if (action.type == BulkEdit) {
+    BulkChange* change = (BulkChange*)(action.data);
+    for (const TrackChange& t : change->tracks) {
+      main_pattern_.trigs[t.track] = undo ? t.before : t.after;
+      memcpy(main_pattern_.micro[t.track],
+             undo ? t.micro_before : t.micro_after, 32);
+      memcpy(main_pattern_.ratchet[t.track],
+             undo ? t.ratchet_before : t.ratchet_after, 32);
+      const std::vector<ParamLock>& locks = undo ? t.locks_before
+                                                 : t.locks_after;
+      SetTrackLocks(&main_pattern_, t.track, locks.data(),
+                    (int)locks.size());
+    }
+    main_pattern_.length = undo ? change->length_before : change->length_after;
+    if (change->tracks.size() == 1 &&
+        change->length_before == change->length_after) {
+      changed_track = change->tracks[0].track;
+    }
+  } else if (action.type == LayoutEdit) {
+    LayoutChange* change = (LayoutChange*)(action.data);
+    const LayoutState& layout = undo ? change->before : change->after;
+    main_pattern_.tempo = layout.tempo;
+    memcpy(main_pattern_.track_length, layout.track_length,
+           sizeof(main_pattern_.track_length));
+    memcpy(main_pattern_.divisor, layout.divisor,
+           sizeof(main_pattern_.divisor));
+    changed_track = NO_TRACKS;
+  } else if (action.type == LoadAll) {
+    PatternChange* change = (PatternChange*)(action.data);
+    CopyPattern(&main_pattern_, undo ? &change->before : &change->after);
   }
+  PatternChanged(changed_track);
   return action;
 }
 
@@ -211,19 +774,27 @@ void DrumLoop::Init() {
 }
 
 int DrumLoop::CurrentStep() {
-  return current_step_;
+  return loop_running_ ? playing_step_.load() : current_step_.load();
+}
+
+void DrumLoop::FreeUndoData(UndoAction* action) {
+  if (action->type == TrigEdit) {
+    delete (TrigEntry*)action->data;
+  } else if (action->type == ClearAll) {
+    delete (Pattern*)action->data;
+  } else if (action->type == LoadAll) {
+    delete (PatternChange*)action->data;
+  } else if (action->type == BulkEdit) {
+    delete (BulkChange*)action->data;
+  } else if (action->type == LayoutEdit) {
+    delete (LayoutChange*)action->data;
+  }
+  action->data = nullptr;
 }
 
 void DrumLoop::ShrinkUndoListIfNeeded() {
   while (undo_list.size() > current_undo) {
-    UndoAction* action = &undo_list.back();
-    if (action->type == TrigEdit) {
-      TrigEntry* e = (TrigEntry*)action->data;
-      delete e;
-    } else if (action->type == ClearAll) {
-      Pattern* p = (Pattern*)action->data;
-      delete p;
-    }
+    FreeUndoData(&undo_list.back());
     undo_list.pop_back();
   }
 }
@@ -248,81 +819,568 @@ void DrumLoop::ClearPattern() {
   ShrinkUndoListIfNeeded();
   undo_list.push_back(action);
 
-  for (int i = 0; i < 9; i++) {
-    strncpy(main_pattern_.tracks[i], "00000000000000000000000000000000", 33);
+  EmptyPattern(&main_pattern_);
+  current_undo++;
+  PatternChanged();
+}
+
+void DrumLoop::LoadPattern(const Pattern* p) {
+  UndoAction action;
+  action.type = LoadAll;
+
+  PatternChange* change = new PatternChange;
+  CopyPattern(&change->before, &main_pattern_);
+  CopyPattern(&change->after, p);
+  action.data = change;
+
+  ShrinkUndoListIfNeeded();
+  undo_list.push_back(action);
+
+  CopyPattern(&main_pattern_, p);
+  current_undo++;
+  PatternChanged();
+}
+
+// Replaces the pattern with |edited| and keeps the tracks that differ as
+// one undo step.
+bool DrumLoop::ApplyBulkEdit(const Pattern* edited) {
+  BulkChange* change = new BulkChange;
+  change->length_before = main_pattern_.length;
+  change->length_after = edited->length;
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (main_pattern_.trigs[i] == edited->trigs[i] &&
+        memcmp(main_pattern_.micro[i], edited->micro[i], 32) == 0 &&
+        memcmp(main_pattern_.ratchet[i], edited->ratchet[i], 32) == 0 &&
+        SameTrackLocks(&main_pattern_, edited, i)) {
+      continue;
+    }
+    TrackChange t;
+    t.track = i;
+    t.before = main_pattern_.trigs[i];
+    t.after = edited->trigs[i];
+    memcpy(t.micro_before, main_pattern_.micro[i], 32);
+    memcpy(t.micro_after, edited->micro[i], 32);
+    memcpy(t.ratchet_before, main_pattern_.ratchet[i], 32);
+    memcpy(t.ratchet_after, edited->ratchet[i], 32);
+    t.locks_before.assign(TrackLocks(&main_pattern_, i),
+                          TrackLocks(&main_pattern_, i) +
+                              LockCount(&main_pattern_, i));
+    t.locks_after.assign(TrackLocks(edited, i),
+                         TrackLocks(edited, i) + LockCount(edited, i));
+    change->tracks.push_back(t);
   }
+  if (change->tracks.empty() &&
+      change->length_before == change->length_after) {
+    delete change;
+    return false;
+  }
+
+  UndoAction action;
+  action.type = BulkEdit;
+  action.data = change;
+  ShrinkUndoListIfNeeded();
+  undo_list.push_back(action);
   current_undo++;
+
+  CopyPattern(&main_pattern_, edited);
+  PatternChanged();
+  return true;
 }
 
-void DrumLoop::CopyPattern(Pattern* to, Pattern* from) {
-  for (int i = 0; i < 9; i++) {
-    strncpy(to->tracks[i], from->tracks[i], 33);
+void DrumLoop::BeginTrackEdit(int track, TrackChange* t) {
+  t->track = track;
+  t->before = main_pattern_.trigs[track];
+  memcpy(t->micro_before, main_pattern_.micro[track], 32);
+  memcpy(t->ratchet_before, main_pattern_.ratchet[track], 32);
+  t->locks_before.assign(TrackLocks(&main_pattern_, track),
+                         TrackLocks(&main_pattern_, track) +
+                             LockCount(&main_pattern_, track));
+}
+
+void DrumLoop::EndTrackEdit(TrackChange* t) {
+  int track = t->track;
+  t->after = main_pattern_.trigs[track];
+  memcpy(t->micro_after, main_pattern_.micro[track], 32);
+  memcpy(t->ratchet_after, main_pattern_.ratchet[track], 32);
+  t->locks_after.assign(TrackLocks(&main_pattern_, track),
+                        TrackLocks(&main_pattern_, track) +
+                            LockCount(&main_pattern_, track));
+  BulkChange* change = new BulkChange;
+  change->length_before = main_pattern_.length;
+  change->length_after = main_pattern_.length;
+  change->tracks.push_back(*t);
+
+  UndoAction action;
+  action.type = BulkEdit;
+  action.data = change;
+  ShrinkUndoListIfNeeded();
+  undo_list.push_back(action);
+  current_undo++;
+  PatternChanged(track);
+}
+
+static void SaveLayout(const DrumLoop::Pattern* p,
+                       DrumLoop::LayoutState* layout) {
+  layout->tempo = p->tempo;
+  memcpy(layout->track_length, p->track_length, sizeof(p->track_length));
+  memcpy(layout->divisor, p->divisor, sizeof(p->divisor));
+}
+
+void DrumLoop::BeginLayoutEdit(LayoutChange* change) {
+  SaveLayout(&main_pattern_, &change->before);
+}
+
+void DrumLoop::EndLayoutEdit(LayoutChange* change) {
+  SaveLayout(&main_pattern_, &change->after);
+
+  UndoAction action;
+  action.type = LayoutEdit;
+  action.data = new LayoutChange(*change);
+  ShrinkUndoListIfNeeded();
+  undo_list.push_back(action);
+  current_undo++;
+  PatternChanged(NO_TRACKS);
+}
+
+// MapLocks() step that keeps its own locks.
+static const int KeepLocks = -2;
+
+// Rebuilds the locks of |track| of |to| a step at a time, the way bulk
+// edits move trigs: step s gets those of step map[s] of track |src| of
+// |from|, none for -1, or keeps its own for KeepLocks.
+static void MapLocks(DrumLoop::Pattern* to, int track,
+                     const DrumLoop::Pattern* from, int src, const int* map) {
+  const int StepLocks = DrumLoop::MAX_STEPS * DrumLoop::LOCK_PARAMS;
+  DrumLoop::ParamLock own[StepLocks];
+  DrumLoop::ParamLock theirs[StepLocks];
+  DrumLoop::ParamLock locks[StepLocks];
+  int owned = DrumLoop::LockCount(to, track);
+  int their = DrumLoop::LockCount(from, src);
+  memcpy(own, DrumLoop::TrackLocks(to, track),
+         owned * sizeof(DrumLoop::ParamLock));
+  memcpy(theirs, DrumLoop::TrackLocks(from, src),
+         their * sizeof(DrumLoop::ParamLock));
+  int count = 0;
+  for (int s = 0; s < DrumLoop::MAX_STEPS; s++) {
+    const DrumLoop::ParamLock* list = map[s] == KeepLocks ? own : theirs;
+    int n = map[s] == KeepLocks ? owned : their;
+    int step = map[s] == KeepLocks ? s : map[s];
+    for (int i = 0; i < n && step >= 0; i++) {
+      if (list[i].step == step) {
+        locks[count] = list[i];
+        locks[count].step = (Uint8)s;
+        count++;
+      }
+    }
   }
+  DrumLoop::SetTrackLocks(to, track, locks, count);
 }
 
-bool DrumLoop::IsPatternEmpty(Pattern *p) {
-  for (int i = 0; i < 9; i++) {
-    for (int j = 0; j < 32; j++) {
-        if (p->tracks[i][j] != '0')
-            return false;
+// Micro offsets, ratchets and locks of steps without a trig only matter to
+// undo, which keeps its own copy, so bulk edits start every empty step back
+// on the grid as a plain hit.
+static void ClearEmptySteps(DrumLoop::Pattern* p, int track) {
+  int map[DrumLoop::MAX_STEPS];
+  for (int j = 0; j < DrumLoop::MAX_STEPS; j++) {
+    map[j] = KeepLocks;
+    if (!((p->trigs[track] >> j) & 1)) {
+      p->micro[track][j] = 0;
+      p->ratchet[track][j] = 0;
+      map[j] = -1;
     }
   }
-  return true;
+  MapLocks(p, track, p, track, map);
 }
 
-int DrumLoop::LoopFunc(void* thread_data) {
-  int step_length = (int)(60000.0 / (bpm_ * 4.0));
-  int nsamples = step_length*SampleRate * 2 / 1000;
-  int channel = -1;
-  int delay;
-  int loop_length = 32;
-  int tick = 10;
+void DrumLoop::Copy(int track, int first, int steps) {
+  first = std::max(0, std::min(first, MAX_STEPS - 1));
+  CopyPattern(&clipboard_.pattern, &main_pattern_);
+  clipboard_.track = track;
+  clipboard_.first = first;
+  clipboard_.steps = std::max(0, std::min(steps, MAX_STEPS - first));
+}
 
-  Uint32 now = SDL_GetTicks();
-  Uint32 next_time = now;
+bool DrumLoop::Paste(int track, int step) {
+  if (clipboard_.steps == 0 || step < 0 || step >= MAX_STEPS) {
+    return false;
+  }
+  const Pattern* from = &clipboard_.pattern;
+  int steps = std::min(clipboard_.steps, MAX_STEPS - step);
+  Uint32 mask = StepMask(steps);
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    int src = i;
+    if (clipboard_.track != ALL_TRACKS) {
+      if (i != track) {
+        continue;
+      }
+      src = clipboard_.track;
+    }
+    Uint32 bits = (from->trigs[src] >> clipboard_.first) & mask;
+    edited.trigs[i] = (edited.trigs[i] & ~(mask << step)) | (bits << step);
+    memcpy(&edited.micro[i][step], &from->micro[src][clipboard_.first], steps);
+    memcpy(&edited.ratchet[i][step], &from->ratchet[src][clipboard_.first],
+           steps);
+    int map[MAX_STEPS];
+    for (int j = 0; j < MAX_STEPS; j++) {
+      map[j] = j >= step && j < step + steps ? clipboard_.first + j - step
+                                             : KeepLocks;
+    }
+    MapLocks(&edited, i, from, src, map);
+  }
+  return ApplyBulkEdit(&edited);
+}
+
+bool DrumLoop::Rotate(int track, int amount) {
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (track != ALL_TRACKS && i != track) {
+      continue;
+    }
+    int length = TrackLength(&main_pattern_, i);
+    int shift = ((amount % length) + length) % length;
+    if (shift == 0) {
+      continue;
+    }
+    Uint32 mask = StepMask(length);
+    Uint32 bits = edited.trigs[i] & mask;
+    bits = ((bits << shift) | (bits >> (length - shift))) & mask;
+    edited.trigs[i] = (edited.trigs[i] & ~mask) | bits;
+    int map[MAX_STEPS];
+    for (int j = 0; j < MAX_STEPS; j++) {
+      map[j] = KeepLocks;
+    }
+    for (int j = 0; j < length; j++) {
+      edited.micro[i][(j + shift) % length] = main_pattern_.micro[i][j];
+      edited.ratchet[i][(j + shift) % length] = main_pattern_.ratchet[i][j];
+      map[(j + shift) % length] = j;
+    }
+    MapLocks(&edited, i, &main_pattern_, i, map);
+  }
+  return ApplyBulkEdit(&edited);
+}
 
-  // This needs to be accessed from outside the loop.
-  int* step = &(((DrumLoop*)thread_data)->current_step_);
-  //*step = -1;
-  int last_bpm = bpm_;
-  //while (true)
-  while (loop_running_) {
-    if (last_bpm != bpm_) {
-      step_length = (int)(60000.0 / (bpm_* 4.0));
-      nsamples = step_length * SampleRate * 2 / 1000;
-      last_bpm = bpm_;
+bool DrumLoop::Shift(int track, int amount) {
+  if (amount == 0) {
+    return false;
+  }
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (track != ALL_TRACKS && i != track) {
+      continue;
+    }
+    int length = TrackLength(&main_pattern_, i);
+    Uint32 mask = StepMask(length);
+    Uint32 bits = edited.trigs[i] & mask;
+    if (amount >= length || -amount >= length) {
+      bits = 0;
+    } else {
+      bits = (amount > 0 ? bits << amount : bits >> -amount) & mask;
+    }
+    edited.trigs[i] = (edited.trigs[i] & ~mask) | bits;
+    int map[MAX_STEPS];
+    for (int j = 0; j < MAX_STEPS; j++) {
+      map[j] = KeepLocks;
     }
+    for (int j = 0; j < length; j++) {
+      int from = j - amount;
+      edited.micro[i][j] = from >= 0 && from < length ?
+                           main_pattern_.micro[i][from] : 0;
+      edited.ratchet[i][j] = from >= 0 && from < length ?
+                             main_pattern_.ratchet[i][from] : 0;
+      map[j] = from >= 0 && from < length ? from : -1;
+    }
+    MapLocks(&edited, i, &main_pattern_, i, map);
+    ClearEmptySteps(&edited, i);
+  }
+  return ApplyBulkEdit(&edited);
+}
+
+bool DrumLoop::Invert(int track) {
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (track != ALL_TRACKS && i != track) {
+      continue;
+    }
+    edited.trigs[i] ^= StepMask(TrackLength(&main_pattern_, i));
+    ClearEmptySteps(&edited, i);
+  }
+  return ApplyBulkEdit(&edited);
+}
 
-    next_time += step_length;
-    (*step)++;
-    if (*step >= loop_length) {
-      *step = 0;
+bool DrumLoop::DoubleLength() {
+  int length = main_pattern_.length;
+  if (length * 2 > MAX_STEPS) {
+    printf("Pattern is already longer than %i steps\n", MAX_STEPS / 2);
+    return false;
+  }
+  Uint32 mask = StepMask(length);
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    Uint32 bits = edited.trigs[i] & mask;
+    edited.trigs[i] = (edited.trigs[i] & ~StepMask(length * 2)) | bits |
+                      (bits << length);
+    memcpy(&edited.micro[i][length], edited.micro[i], length);
+    memcpy(&edited.ratchet[i][length], edited.ratchet[i], length);
+    int map[MAX_STEPS];
+    for (int j = 0; j < MAX_STEPS; j++) {
+      map[j] = j >= length && j < length * 2 ? j - length : KeepLocks;
     }
+    MapLocks(&edited, i, &main_pattern_, i, map);
+  }
+  edited.length = length * 2;
+  return ApplyBulkEdit(&edited);
+}
 
-    if (!loop_running_) {
-      return 0;
+// Step i gets a hit where i * hits / steps passes a whole number, the same
+// rhythms as Bjorklund's algorithm up to rotation, e.g. 3 over 8 is
+// x..x..x. for a tresillo.
+bool DrumLoop::Euclid(int track, int hits, int steps) {
+  Pattern edited;
+  CopyPattern(&edited, &main_pattern_);
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (track != ALL_TRACKS && i != track) {
+      continue;
     }
-    for (int i = 0; i < 9; i++) {
-      if (main_pattern_.tracks[i][*step] != '0') {
-        SoundData* sd = ((DrumLoop*)thread_data)->sound_data_;
-        sd->PlaySample(i);
+    int length = TrackLength(&main_pattern_, i);
+    int span = steps < 1 || steps > length ? length : steps;
+    int n = std::max(0, std::min(hits, span));
+    Uint32 rhythm = 0;
+    for (int j = 0; j < span; j++) {
+      if ((j * n) % span < n) {
+        rhythm |= 1u << j;
       }
     }
-    
-    if (!loop_running_) {
-      return 0;
+    Uint32 bits = 0;
+    for (int j = 0; j < length; j += span) {
+      bits |= rhythm << j;
+    }
+    Uint32 mask = StepMask(length);
+    edited.trigs[i] = (edited.trigs[i] & ~mask) | (bits & mask);
+    memset(edited.micro[i], 0, length);
+    memset(edited.ratchet[i], 0, length);
+    int map[MAX_STEPS];
+    for (int j = 0; j < MAX_STEPS; j++) {
+      map[j] = j < length ? -1 : KeepLocks;
     }
+    MapLocks(&edited, i, &main_pattern_, i, map);
+  }
+  return ApplyBulkEdit(&edited);
+}
+
+int DrumLoop::CountTrigs(int track) {
+  Uint32 bits = main_pattern_.trigs[track] &
+                StepMask(TrackLength(&main_pattern_, track));
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1) {
+    count++;
+  }
+  return count;
+}
+
+void DrumLoop::CopyPattern(Pattern* to, const Pattern* from) {
+  memcpy(to, from, sizeof(Pattern));
+}
 
-    Uint32 now = SDL_GetTicks();
-    delay = next_time - now;
+bool DrumLoop::IsPatternEmpty(Pattern *p) {
+  for (int i = 0; i < 9; i++) {
+    if (p->trigs[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
-    /*if (loop_running_) {
-      SoundData** sd = &(((DrumLoop*)thread_data)->sound_data_);
-      (*sd)->AdvanceDelayBuffer(nsamples);
-      
-    }*/
-    if(delay > 0)
-      SDL_Delay(delay);
+// The song lane while it has points, the pattern's otherwise.
+TempoMap DrumLoop::Tempo() {
+  int rate = sound_data_->GetSampleRate();
+  TempoLane song = song_tempo_.Load();
+  if (song.count > 0) {
+    return TempoMap(song, 0, bpm_, rate);
   }
-  return 0;
+  return TempoMap(pattern_tempo_.Load(), loop_length_, bpm_, rate);
+}
+
+// First trig of |track| at track step |from| or later, counting the
+// track's own steps since playback started, with a retrigger that isn't
+// placed before |min_pos|. Returns where that retrigger is and sets
+// next_step_[track] and the trig_ state to it, or returns a position past
+// anything reachable if the track is empty. Jumps from trig to trig with
+// bit scans rather than walking the steps in between.
+double DrumLoop::NextTrig(int track, Sint64 from, double min_pos) {
+  const Pattern* p = &playing_pattern_;
+  int length = TrackLength(p, track);
+  int divisor = p->divisor[track];
+  Uint32 bits = p->trigs[track] & StepMask(length);
+  if (bits == 0) {
+    return 1e300;
+  }
+  int step = (int)(((from % length) + length) % length);
+  Sint64 k = from;
+  while (k < from + length + 2) {
+    Uint32 ahead = bits >> step;
+    if (ahead == 0) {
+      k += length - step;
+      step = 0;
+      continue;
+    }
+    int skip = LowestBit(ahead);
+    k += skip;
+    step += skip;
+    double pos = (k + p->micro[track][step] / (double)MICRO_STEPS) * divisor;
+    Uint8 ratchet = p->ratchet[track][step];
+    int count = RatchetCount(ratchet);
+    double spacing = (double)divisor / count;
+    int retrig = 0;
+    if (pos < min_pos) {
+      retrig = (int)std::ceil((min_pos - pos) / spacing);
+      if (pos + retrig * spacing < min_pos) {
+        retrig++;
+      }
+    }
+    if (retrig < count) {
+      next_step_[track] = k;
+      trig_pos_[track] = pos;
+      trig_ratchet_[track] = ratchet;
+      retrig_[track] = retrig;
+      StepParams(track, step, &trig_params_[track]);
+      return pos + retrig * spacing;
+    }
+    k++;
+    step = step + 1 < length ? step + 1 : 0;
+  }
+  return 1e300;
+}
+
+// Velocity of the retrigger due on |track|, along its ratchet's ramp.
+int DrumLoop::RetrigGain(int track) {
+  int count = RatchetCount(trig_ratchet_[track]);
+  int index = retrig_[track];
+  switch (RatchetRamp(trig_ratchet_[track])) {
+    case RampUp:
+      return UnityGain * (index + 1) / count;
+    case RampDown:
+      return UnityGain * (count - index) / count;
+  }
+  return UnityGain;
+}
+
+// Parameter locks of |step| of |track|. Trigs come in step order apart
+// from wrapping around, so the track's locks are walked on from where the
+// last trig's left off rather than searched.
+void DrumLoop::StepParams(int track, int step, HitParams* params) {
+  const Pattern* p = &playing_pattern_;
+  int first = p->lock_start[track];
+  int last = p->lock_start[track + 1];
+  int i = lock_cursor_[track];
+  if (i < first || i > last || (i > first && p->locks[i - 1].step >= step)) {
+    i = first;
+  }
+  while (i < last && p->locks[i].step < step) {
+    i++;
+  }
+  *params = HitParams();
+  for (; i < last && p->locks[i].step == step; i++) {
+    int value = p->locks[i].value;
+    switch (p->locks[i].param) {
+      case LockVolume:
+        params->gain = UnityGain * value / MAX_LOCK_VALUE;
+        break;
+      case LockPitch:
+        params->pitch = value - LOCK_CENTER;
+        break;
+      case LockPan:
+        params->pan = value - LOCK_CENTER;
+        break;
+      case LockCutoff:
+        params->cutoff = value;
+        break;
+      case LockSend:
+        params->send = value;
+        break;
+    }
+  }
+  lock_cursor_[track] = i;
+}
+
+// Runs on the audio thread. Steps are placed on the sample clock, so timing
+// doesn't depend on when any thread wakes up. Each track keeps the position
+// of its next trig and only looks at the pattern again after firing it or
+// when the pattern was edited. Under tempo automation positions and frames
+// are converted through the tempo map rather than at a fixed rate.
+int DrumLoop::Process(Uint64 frame, int frames, Hit* hits, int max_hits) {
+  int start = start_step_.exchange(STOPPED);
+  if (start != STOPPED) {
+    playing_ = true;
+    pos_ = start;
+    seen_pattern_version_ = pattern_version_.load() - 1;
+    // Positions count again from here, a hit recorded in an earlier run
+    // would mute a trig of this one.
+    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+      skip_step_[i].store(-1, std::memory_order_relaxed);
+    }
+  }
+  if (!loop_running_) {
+    playing_ = false;
+  }
+  TempoMap tempo = Tempo();
+  position_.Store({ frame, pos_, tempo.FramesPerStep(pos_), playing_ });
+  if (!playing_) {
+    return 0;
+  }
+
+  unsigned version = pattern_version_.load(std::memory_order_acquire);
+  if (version != seen_pattern_version_) {
+    // The UI thread keeps editing main_pattern_ in place, so only ever
+    // play from a whole copy of it.
+    playing_pattern_ = shared_pattern_.Load();
+    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+      Sint64 from = (Sint64)std::floor(pos_ / playing_pattern_.divisor[i]);
+      next_trig_[i] = NextTrig(i, from - 1, pos_);
+    }
+    seen_pattern_version_ = version;
+  }
+
+  double end = tempo.Advance(pos_, frames);
+  int nhits = 0;
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    while (next_trig_[i] < end) {
+      // Hits go on the frame they fall in, allowing for rounding in the
+      // positions, which add up differently with other block sizes. One
+      // that lands in the next block is left for it, so where a hit lands
+      // doesn't depend on the block size.
+      int offset = (int)std::floor(tempo.Frames(pos_, next_trig_[i]) +
+                                   FrameSlack);
+      if (offset >= frames) {
+        break;
+      }
+      Sint64 step = next_step_[i];
+      if (step != skip_step_[i].load(std::memory_order_relaxed) &&
+          nhits < max_hits) {
+        hits[nhits].track = i;
+        hits[nhits].offset = offset < 0 ? 0 : offset;
+        hits[nhits].params = trig_params_[i];
+        hits[nhits].params.gain = trig_params_[i].gain * RetrigGain(i) /
+                                  UnityGain;
+        nhits++;
+      }
+      // Retriggers are just more events on the same clock, however fast.
+      int count = RatchetCount(trig_ratchet_[i]);
+      if (++retrig_[i] < count) {
+        next_trig_[i] = trig_pos_[i] +
+                        retrig_[i] * (double)playing_pattern_.divisor[i] / count;
+      } else {
+        next_trig_[i] = NextTrig(i, step + 1, 0);
+      }
+    }
+  }
+
+  pos_ = end;
+  playing_step_ = (int)((Sint64)std::floor(pos_) % loop_length_);
+  return nhits;
 }
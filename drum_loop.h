@@ -1,19 +1,30 @@
 #ifndef DRUM_LOOP_H
 #define DRUM_LOOP_H
 
+#include <atomic>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "seq_lock.h"
 #include "sound_data.h"
+#include "tempo_lane.h"
 
 #define TRACK_MAX 1000
 
 #define MAIN_PATTERN_FILE "./patterns/main.txt"
 #define MAX_UNDO 1000
 
+class PatternJournal;
+
 class DrumLoop
 {
  public:
-  DrumLoop(SoundData* sound_data);
+  // Loads |pattern_file| and replays the edits journaled next to it, then
+  // journals every change and saves the pattern back to the file when done.
+  // With no file the loop starts out empty and nothing is saved.
+  DrumLoop(SoundData* sound_data,
+           const char* pattern_file = MAIN_PATTERN_FILE);
   ~DrumLoop();
 
   static const int STOPPED = -1;
@@ -22,12 +33,20 @@ class DrumLoop
     None = 0,
     TrigEdit,
     ClearAll,
+    LoadAll,
+    BulkEdit,
+    LayoutEdit,
   };
 
+  // Undo data of TrigEdit: one step of one track as it was and as the
+  // edit left it.
   struct TrigEntry {
     int track;
     int step;
-    char data;
+    bool before;
+    bool after;
+    signed char micro_before;
+    signed char micro_after;
   };
 
   struct UndoAction {
@@ -35,11 +54,152 @@ class DrumLoop
     void* data;
   };
 
+  static const int MAX_STEPS = 32;
+
+  // Parameters a step can lock for the hits of its trig, see HitParams.
+  // Values run from 0 to MAX_LOCK_VALUE: volume and cutoff up to full,
+  // pitch (in semitones) and pan centred on LOCK_CENTER, send up to
+  // MaxSend.
+  enum LockParam {
+    LockVolume = 0,
+    LockPitch,
+    LockPan,
+    LockCutoff,
+    LockSend,
+    LOCK_PARAMS,
+  };
+  struct ParamLock {
+    Uint8 step;
+    Uint8 param;
+    Uint8 value;
+  };
+  static const int MAX_LOCKS = 256;
+  static const int MAX_LOCK_VALUE = 127;
+  static const int LOCK_CENTER = 64;
+  static const int NO_LOCK = -1;
+
   struct Pattern {
-    char tracks[9][33];
+    // Bit s of trigs[t] is step s of track t.
+    Uint32 trigs[9];
+    // Offset of each trig from its step in 1/MICRO_STEPS of a step, kept by
+    // recording with a quantize strength below 1.
+    signed char micro[9][32];
+    // Steps played before the pattern loops, 1 to MAX_STEPS. Trigs past it
+    // are kept but not played.
+    int length;
+    // Tempo automation, played again every time round the loop.
+    TempoLane tempo;
+    // Polymeter: steps each track plays before it wraps, 1 to MAX_STEPS, or
+    // 0 to wrap with the pattern. Trigs past it are kept but not played.
+    Uint8 track_length[9];
+    // Polyrhythm: pattern steps each step of a track lasts, 1 to
+    // MAX_DIVISOR. Micro offsets are in the track's own steps.
+    Uint8 divisor[9];
+    // Ratchets: each trig retriggered evenly across its step. The count is
+    // in the low four bits, 0 or 1 plays the trig once, and a Ramp in the
+    // high ones. See RatchetByte().
+    Uint8 ratchet[9][32];
+    // Parameter locks of all tracks in one array, sorted by track, step and
+    // parameter. Track t's run from lock_start[t] up to lock_start[t + 1],
+    // so playback walks them in step order without searching. See
+    // SetLock().
+    ParamLock locks[MAX_LOCKS];
+    Uint16 lock_start[10];
+  };
+
+  static const int MAX_RATCHET = 8;
+  enum Ramp {
+    RampFlat = 0,
+    // Quiet to full velocity over the retriggers
+    RampUp,
+    RampDown,
+    RAMP_TYPES,
+  };
+  static Uint8 RatchetByte(int count, int ramp) {
+    return (Uint8)((count <= 1 ? 0 : count) | ramp << 4);
+  }
+  static int RatchetCount(Uint8 ratchet) {
+    return (ratchet & 0x0f) < 2 ? 1 : ratchet & 0x0f;
+  }
+  static int RatchetRamp(Uint8 ratchet) { return ratchet >> 4; }
+
+  static const int MICRO_STEPS = 128;
+  static const int MAX_DIVISOR = 8;
+  // Track argument of the bulk edits that means every track.
+  static const int ALL_TRACKS = -1;
+
+  // Undo data of LoadAll
+  struct PatternChange {
+    Pattern before;
+    Pattern after;
+  };
+
+  // Undo data of BulkEdit: only the tracks the edit changed.
+  struct TrackChange {
+    int track;
+    Uint32 before;
+    Uint32 after;
+    signed char micro_before[32];
+    signed char micro_after[32];
+    Uint8 ratchet_before[32];
+    Uint8 ratchet_after[32];
+    std::vector<ParamLock> locks_before;
+    std::vector<ParamLock> locks_after;
+  };
+  struct BulkChange {
+    int length_before;
+    int length_after;
+    std::vector<TrackChange> tracks;
+  };
+
+  // Undo data of LayoutEdit: the pattern's tempo lane and the lengths and
+  // divisors of its tracks.
+  struct LayoutState {
+    TempoLane tempo;
+    Uint8 track_length[9];
+    Uint8 divisor[9];
+  };
+  struct LayoutChange {
+    LayoutState before;
+    LayoutState after;
+  };
+
+  static void EmptyPattern(Pattern* p);
+  // Steps |track| of |p| plays before it wraps.
+  static int TrackLength(const Pattern* p, int track);
+  // Value of lock |param| at |step| of |track|, or NO_LOCK.
+  static int GetLock(const Pattern* p, int track, int step, int param);
+  // Sets it, clamped to MAX_LOCK_VALUE, or removes it for NO_LOCK. False
+  // if the pattern has MAX_LOCKS locks already.
+  static bool SetLock(Pattern* p, int track, int step, int param, int value);
+  static int LockCount(const Pattern* p, int track) {
+    return p->lock_start[track + 1] - p->lock_start[track];
+  }
+  static const ParamLock* TrackLocks(const Pattern* p, int track) {
+    return &p->locks[p->lock_start[track]];
+  }
+  // Replaces the locks of |track| with |count| |locks| sorted by step and
+  // parameter, which aren't |p|'s own. False if only the first ones fit.
+  static bool SetTrackLocks(Pattern* p, int track, const ParamLock* locks,
+                            int count);
+  static const char* LockParamName(int param);
+  // Pattern text files: one line of 32 '0'/'1' per track, optionally
+  // followed by "micro <track> <step> <offset>", "tempo <step> <bpm>",
+  // "track <track> <length> <divisor>",
+  // "ratchet <track> <step> <count> <ramp>" and
+  // "lock <track> <step> <param name> <value>" lines.
+  static bool ReadPatternFile(const char* file, Pattern* p);
+  static bool WritePatternFile(const char* file, const Pattern* p);
+
+  // Where a live hit lands in the pattern
+  struct RecordedHit {
+    int step;
+    signed char micro;
   };
 
   void WritePatternToFile(const char* file);
+  // Transport, from any thread. The sequencer picks it up at its next
+  // block of audio.
   void Start();
   void StartWithRec();
   void SetRec(bool rec);
@@ -49,44 +209,188 @@ class DrumLoop
   void Pause();
   bool Paused();
   int GetBPM() { return bpm_; } 
+  // Clamped to MIN_BPM..MAX_BPM. Picked up from the next block of audio.
   void SetBPM(int bpm);
   void SpeedUp(int bpm);
   void SlowDown(int bpm);
+  // Tempo automation of the pattern, one undo step per change. Sets the
+  // tempo at |step|, the tempo ramps from each point to the next. False if
+  // the lane is full or, for ClearTempo(), already empty.
+  bool SetTempoPoint(int step, int bpm);
+  bool ClearTempo();
+  // Tempo automation of the whole song, by steps since playback started
+  // from the top. While it has points it overrides the pattern's.
+  void SetSongTempo(const TempoLane& lane);
+  // Gives |track| a length of its own, or 0 to follow the pattern's, and
+  // a step divisor. Each track wraps around on its own, so tracks of
+  // different lengths drift against each other (polymeter) and tracks of
+  // different divisors play at different rates (polyrhythm). One undo step
+  // each, false if nothing changed.
+  bool SetTrackLength(int track, int length);
+  bool SetTrackDivisor(int track, int divisor);
+  // Retriggers |step| of |track| |count| times, 1 to MAX_RATCHET, evenly
+  // across the step, with velocities along |ramp|. One undo step, false if
+  // nothing changed.
+  bool SetRatchet(int track, int step, int count, int ramp);
+  // Locks |param| of |step| of |track| to |value|, or unlocks it for
+  // NO_LOCK. One undo step, false if nothing changed or there is no room.
+  bool SetParamLock(int track, int step, int param, int value);
   void NextStep();
   void PrevStep();
   char GetTrig(int track, int step);
-  void SetTrig(int track, int step, char data, bool undoable = true);
+  // Undoable edits also set the trig's micro offset, other writes only
+  // change the trig and keep it.
+  void SetTrig(int track, int step, char data, bool undoable = true,
+               signed char micro = 0);
+  void SetMicro(int track, int step, signed char micro);
+
+  // Maps the time of a pad hit (an SDL_Event timestamp) onto the step that
+  // was playing when it was heard, quantized with the current strength. The
+  // sequencer won't also play that trig if it hasn't reached it yet.
+  RecordedHit QuantizeHit(int track, Uint32 ticks);
+  // Where in the loop playback is at |ticks| as heard through the output
+  // latency, in steps from 0 up to the loop length. -1 while stopped.
+  double HeardPosition(Uint32 ticks);
+  // 1 snaps hits onto the nearest step, 0 keeps their exact timing.
+  void SetQuantizeStrength(float strength);
+  float GetQuantizeStrength() { return quantize_strength_; }
   UndoAction Undo();
   UndoAction Redo();
   int CurrentStep();
   void ClearPattern();
+  // Replaces the whole pattern, as one undo step.
+  void LoadPattern(const Pattern* p);
+
+  // Bulk edits, done with word operations on the tracks' trig bits. Each is
+  // one BulkEdit undo step holding only the tracks it changed, and returns
+  // false if nothing changed. |track| can be ALL_TRACKS. Micro offsets move
+  // with their trigs; new trigs start on the grid.
+  //
+  // Copy() keeps |steps| steps from |first| of one or all tracks. Paste()
+  // writes them at |step|, into |track| if a single track was copied.
+  void Copy(int track, int first, int steps);
+  bool Paste(int track, int step);
+  // Within each track's length, positive amounts move later. Rotate wraps
+  // around, Shift drops what falls off and leaves empty steps behind.
+  bool Rotate(int track, int amount);
+  bool Shift(int track, int amount);
+  bool Invert(int track);
+  // Appends a copy of the pattern to itself, up to MAX_STEPS.
+  bool DoubleLength();
+  // |hits| spread as evenly as possible over |steps| steps, repeated to
+  // the track's length.
+  bool Euclid(int track, int hits, int steps);
+  int Length() { return loop_length_; }
+  int CountTrigs(int track);
+  const Pattern* GetPattern() { return &main_pattern_; }
   void Init();
   void SetEditMode(bool edit);
   
   bool Running() { return loop_running_; }
-  
-  int LoopFunc(void* thread_data);
+  // Tempo and transport the audio thread used for its last block, to tell
+  // when a change has taken effect.
+  double SequencerBPM();
+  bool SequencerPlaying();
+
+  // Schedules the hits of one block of audio, see SequencerFunc.
+  int Process(Uint64 frame, int frames, Hit* hits, int max_hits);
 
   void PrintUndoEntries();
 
  private:
-  void CopyPattern(Pattern *to, Pattern *from);
+  static void CopyPattern(Pattern *to, const Pattern *from);
   bool IsPatternEmpty(Pattern *p);
   void ShrinkUndoListIfNeeded();
-  UndoAction ApplyUndoAction();
+  UndoAction ApplyUndoAction(bool undo);
+  bool ApplyBulkEdit(const Pattern* edited);
+  // Single step edits of one track, kept as a BulkEdit of just that track,
+  // and edits of the tempo lane and track layout, kept as a LayoutEdit.
+  // Begin before changing main_pattern_, End after.
+  void BeginTrackEdit(int track, TrackChange* t);
+  void EndTrackEdit(TrackChange* t);
+  void BeginLayoutEdit(LayoutChange* change);
+  void EndLayoutEdit(LayoutChange* change);
+  static void FreeUndoData(UndoAction* action);
+  // PatternChanged() track of edits that only touched the tempo lane and
+  // track layout.
+  static const int NO_TRACKS = -2;
+  // |track| is the only track the edit could have touched, ALL_TRACKS or
+  // NO_TRACKS.
+  void PatternChanged(int track = ALL_TRACKS);
+  void JournalChanges(int track);
+  double NextTrig(int track, Sint64 from, double min_pos);
+  int RetrigGain(int track);
+  void StepParams(int track, int step, HitParams* params);
+  double PositionAtTicks(Uint32 ticks);
+  TempoMap Tempo();
 
   std::vector<UndoAction> undo_list;
   int current_undo = 0;
 
   SoundData* sound_data_;
-  SDL_Thread* loop_thread_ = nullptr;
+  std::string pattern_file_;
+  std::unique_ptr<PatternJournal> journal_;
+  // The pattern as far as it has been handed to the journal.
+  Pattern journaled_;
+
+  // Transport state. Atomic as the control server thread starts and stops
+  // playback too.
+  std::atomic<bool> loop_running_{false};
+  // Step shown while stopped or paused, and where playback resumes.
+  std::atomic<int> current_step_{STOPPED};
+  std::atomic<bool> rec_mode_{false};
+  std::atomic<bool> paused_{false};
+  float quantize_strength_ = 1.0f;
+  // main_pattern_.length, for the audio thread.
+  std::atomic<int> loop_length_{MAX_STEPS};
+
+  struct Clipboard {
+    Pattern pattern;
+    int track = ALL_TRACKS;
+    int first = 0;
+    int steps = 0;
+  };
+  Clipboard clipboard_;
 
-  bool loop_running_ = false;
-  int current_step_ = STOPPED;
-  bool rec_mode_ = false;
-  bool paused_ = false;
+  std::atomic<int> bpm_{120};
+  // main_pattern_.tempo and the song lane, for the audio thread.
+  SeqLock<TempoLane> pattern_tempo_;
+  SeqLock<TempoLane> song_tempo_;
 
-  int bpm_ = 120;
+  // Written by the UI thread, picked up by the audio thread at the next block.
+  std::atomic<int> start_step_{STOPPED};
+  std::atomic<unsigned> pattern_version_{0};
+  // main_pattern_ as of the last PatternChanged(). The audio thread copies
+  // it into playing_pattern_ when pattern_version_ moves on.
+  SeqLock<Pattern> shared_pattern_;
+  std::atomic<Sint64> skip_step_[9];
+
+  // Audio thread state. Positions count steps since playback started,
+  // without wrapping at the loop length. next_step_ counts in each track's
+  // own steps.
+  bool playing_ = false;
+  Pattern playing_pattern_;
+  double pos_ = 0;
+  double next_trig_[9];
+  Sint64 next_step_[9];
+  // The trig next_trig_ belongs to: where it is placed, its ratchet byte
+  // and which of its retriggers is next.
+  double trig_pos_[9];
+  Uint8 trig_ratchet_[9];
+  int retrig_[9];
+  // Its parameter locks, and where in the track's locks StepParams() got to.
+  HitParams trig_params_[9];
+  int lock_cursor_[9];
+  unsigned seen_pattern_version_ = 0;
+  std::atomic<int> playing_step_{STOPPED};
+
+  struct Position {
+    Uint64 frame;
+    double pos;
+    double frames_per_step;
+    bool playing;
+  };
+  SeqLock<Position> position_;
 
   Pattern main_pattern_;
 };
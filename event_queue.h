@@ -0,0 +1,65 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <atomic>
+
+// Bounded lock-free queue with any number of producers and a single consumer.
+// Used to hand events to the audio callback: Push() never blocks (it fails
+// when the queue is full) and Pop() never blocks or allocates.
+// |N| must be a power of two.
+template <typename T, int N>
+class EventQueue {
+ public:
+  EventQueue() {
+    for (int i = 0; i < N; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool Push(const T& value) {
+    unsigned pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell* cell = &cells_[pos & (N - 1)];
+      unsigned seq = cell->sequence.load(std::memory_order_acquire);
+      int diff = (int)(seq - pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell->value = value;
+          cell->sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // Full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool Pop(T* value) {
+    Cell* cell = &cells_[head_ & (N - 1)];
+    unsigned seq = cell->sequence.load(std::memory_order_acquire);
+    if ((int)(seq - (head_ + 1)) < 0) {
+      return false;  // Empty
+    }
+    *value = cell->value;
+    cell->sequence.store(head_ + N, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<unsigned> sequence;
+    T value;
+  };
+
+  static_assert((N & (N - 1)) == 0, "EventQueue size must be a power of two");
+
+  Cell cells_[N];
+  alignas(64) std::atomic<unsigned> tail_{0};
+  alignas(64) unsigned head_ = 0;
+};
+
+#endif  // EVENT_QUEUE_H
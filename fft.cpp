@@ -0,0 +1,111 @@
+#include "fft.h"
+
+#include <math.h>
+#include <stdio.h>
+
+bool RealFFT::Init(int size) {
+  if (size < MinFFTSize || size > MaxFFTSize || (size & (size - 1)) != 0) {
+    printf("Unsupported FFT size: %i\n", size);
+    return false;
+  }
+  size_ = size;
+  int half_size = size / 2;
+  const double pi = 3.14159265358979323846;
+
+  // Periodic Hann window. Its sum is size / 2, so a sine's peak bin comes
+  // out at amplitude * size / 4 and scale_ brings that back to 1.
+  window_.resize(size);
+  for (int i = 0; i < size; i++) {
+    window_[i] = (float)(0.5 - 0.5 * cos(2.0 * pi * i / size));
+  }
+  scale_ = 16.0f / ((float)size * size);
+
+  int bits = 0;
+  while ((1 << bits) < half_size) {
+    bits++;
+  }
+  bit_reverse_.resize(half_size);
+  for (int i = 0; i < half_size; i++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    bit_reverse_[i] = r;
+  }
+
+  twiddle_re_.resize(half_size);
+  twiddle_im_.resize(half_size);
+  for (int half = 1; half < half_size; half *= 2) {
+    for (int j = 0; j < half; j++) {
+      twiddle_re_[half - 1 + j] = (float)cos(pi * j / half);
+      twiddle_im_[half - 1 + j] = (float)-sin(pi * j / half);
+    }
+  }
+
+  split_re_.resize(half_size);
+  split_im_.resize(half_size);
+  for (int k = 0; k < half_size; k++) {
+    split_re_[k] = (float)cos(2.0 * pi * k / size);
+    split_im_[k] = (float)-sin(2.0 * pi * k / size);
+  }
+
+  re_.resize(half_size);
+  im_.resize(half_size);
+  return true;
+}
+
+// In place complex FFT of re_/im_, which are already in bit reversed order.
+void RealFFT::Transform() {
+  int n = size_ / 2;
+  float* re = re_.data();
+  float* im = im_.data();
+  for (int half = 1; half < n; half *= 2) {
+    const float* wr = &twiddle_re_[half - 1];
+    const float* wi = &twiddle_im_[half - 1];
+    for (int i = 0; i < n; i += 2 * half) {
+      float* ar = re + i;
+      float* ai = im + i;
+      float* br = re + i + half;
+      float* bi = im + i + half;
+      for (int j = 0; j < half; j++) {
+        float tr = br[j] * wr[j] - bi[j] * wi[j];
+        float ti = br[j] * wi[j] + bi[j] * wr[j];
+        br[j] = ar[j] - tr;
+        bi[j] = ai[j] - ti;
+        ar[j] += tr;
+        ai[j] += ti;
+      }
+    }
+  }
+}
+
+void RealFFT::PowerSpectrum(const float* input, float* power) {
+  int n = size_ / 2;
+
+  // Even samples become the real parts, odd ones the imaginary parts.
+  for (int i = 0; i < n; i++) {
+    int r = bit_reverse_[i];
+    re_[r] = input[2 * i] * window_[2 * i];
+    im_[r] = input[2 * i + 1] * window_[2 * i + 1];
+  }
+  Transform();
+
+  // With Z the half length result, bin k of the real transform is
+  // E + W^k * O where E = (Z[k] + conj(Z[n - k])) / 2 is the spectrum of the
+  // even samples and O = (Z[k] - conj(Z[n - k])) / 2i the odd ones.
+  power[0] = (re_[0] + im_[0]) * (re_[0] + im_[0]) * scale_;
+  power[n] = (re_[0] - im_[0]) * (re_[0] - im_[0]) * scale_;
+  for (int k = 1; k < n; k++) {
+    float ar = re_[k];
+    float ai = im_[k];
+    float br = re_[n - k];
+    float bi = im_[n - k];
+    float er = 0.5f * (ar + br);
+    float ei = 0.5f * (ai - bi);
+    float or_ = 0.5f * (ai + bi);
+    float oi = -0.5f * (ar - br);
+    float xr = er + split_re_[k] * or_ - split_im_[k] * oi;
+    float xi = ei + split_re_[k] * oi + split_im_[k] * or_;
+    power[k] = (xr * xr + xi * xi) * scale_;
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <vector>
+
+const int MinFFTSize = 1024;
+const int MaxFFTSize = 4096;
+
+// Power spectrum of a block of real samples, for the spectrum analyzer.
+// The |size| real samples are packed into size/2 complex ones and run
+// through a radix-2 FFT of half the length, then split back into the bins of
+// the real transform. Everything that depends only on the size (window,
+// bit reversal, twiddles for every stage) is computed once by Init(), so
+// PowerSpectrum() does no trigonometry and never allocates.
+class RealFFT {
+ public:
+  // |size| must be a power of two from MinFFTSize to MaxFFTSize.
+  bool Init(int size);
+  int Size() const { return size_; }
+
+  // Applies a Hann window to |input| (Size() samples) and writes the power
+  // of bins 0 to Size() / 2 to |power|. A full scale sine on a bin reads 1.
+  void PowerSpectrum(const float* input, float* power);
+
+ private:
+  void Transform();
+
+  int size_ = 0;
+  float scale_ = 0.0f;
+  std::vector<float> window_;
+  std::vector<int> bit_reverse_;
+  // Twiddles of the complex FFT, stage by stage: the stage combining blocks
+  // of |half| uses the |half| entries starting at |half| - 1.
+  std::vector<float> twiddle_re_;
+  std::vector<float> twiddle_im_;
+  // Twiddles for splitting the half length result into the real spectrum.
+  std::vector<float> split_re_;
+  std::vector<float> split_im_;
+  std::vector<float> re_;
+  std::vector<float> im_;
+};
+
+#endif  // FFT_H
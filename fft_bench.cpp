@@ -0,0 +1,60 @@
+// Times RealFFT::PowerSpectrum at every size the spectrum analyzer can use.
+//
+//   fft_bench [-n count]
+//
+// Each size runs |count| transforms of the same block of noise and reports
+// the median and the slowest one, to compare against a 16 ms UI frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fft.h"
+
+static double NowUs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char* argv[]) {
+  int count = 2000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    } else {
+      printf("usage: %s [-n count]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (count < 1) {
+    count = 1;
+  }
+
+  std::vector<float> input(MaxFFTSize);
+  for (int i = 0; i < MaxFFTSize; i++) {
+    input[i] = rand() / (float)RAND_MAX * 2.0f - 1.0f;
+  }
+  std::vector<float> power(MaxFFTSize / 2 + 1);
+  std::vector<double> times(count);
+
+  for (int size = MinFFTSize; size <= MaxFFTSize; size *= 2) {
+    RealFFT fft;
+    fft.Init(size);
+    // Once to get the tables into the cache.
+    fft.PowerSpectrum(input.data(), power.data());
+    for (int i = 0; i < count; i++) {
+      double start = NowUs();
+      fft.PowerSpectrum(input.data(), power.data());
+      times[i] = NowUs() - start;
+    }
+    std::sort(times.begin(), times.end());
+    printf("%4i points: median %.1f us  max %.1f us\n", size,
+           times[count / 2], times[count - 1]);
+  }
+  return 0;
+}
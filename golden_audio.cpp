@@ -0,0 +1,332 @@
+#include "golden_audio.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "batch_render.h"
+#include "drum_loop.h"
+
+namespace {
+
+const int GoldenBpms[] = { 90, 120, 174 };
+// Two loops, so the delay tail of the first runs into the second.
+const int GoldenLoops = 2;
+
+// The onset detector looks at the mean square of the mono mix in blocks of
+// OnsetBlock frames. A block starts an onset when it has OnsetRise times
+// the energy of the loudest of the OnsetHistory blocks before it (6 dB
+// more), long enough to span a period of a kick drum, and is above
+// OnsetFloor (-40 dBFS). The onset is the first frame in the block that
+// reaches the block's RMS. The attack of a hit can take a few blocks, the
+// OnsetHold blocks after an onset can't start another.
+const int OnsetBlock = 64;
+const int OnsetHistory = 16;
+const double OnsetRise = 4.0;
+const double OnsetFloor = 328.0 * 328.0;
+const int OnsetHold = 8;
+// Onsets further apart than this are not the same onset moved.
+const int OnsetMatchFrames = 2048;
+
+struct GoldenRender {
+  // "<pattern> <bpm> <dry|delay>"
+  std::string key;
+  Uint32 pattern_hash;
+  Uint32 frames;
+  Uint64 checksum;
+  double rms_db;
+  std::vector<int> onsets;
+};
+
+Uint32 HashPattern(const DrumLoop::Pattern& pattern) {
+  Uint32 hash = 2166136261u;
+  auto add = [&hash](Uint32 value) {
+    for (int i = 0; i < 4; i++) {
+      hash = (hash ^ ((value >> (8 * i)) & 0xff)) * 16777619u;
+    }
+  };
+  for (int track = 0; track < 9; track++) {
+    add(pattern.trigs[track]);
+    for (int step = 0; step < 32; step++) {
+      add((Uint8)pattern.micro[track][step]);
+    }
+  }
+  add(pattern.length);
+  // Tempo automation, track lengths and rates, ratchets and parameter
+  // locks only add to the hash where a pattern has them, so older hashes
+  // stay valid.
+  for (int i = 0; i < pattern.tempo.count; i++) {
+    add(pattern.tempo.points[i].step);
+    add((Uint32)(pattern.tempo.points[i].bpm * 10.0f + 0.5f));
+  }
+  for (int track = 0; track < 9; track++) {
+    if (pattern.track_length[track] != 0 || pattern.divisor[track] != 1) {
+      add(track);
+      add(pattern.track_length[track]);
+      add(pattern.divisor[track]);
+    }
+    for (int step = 0; step < 32; step++) {
+      if (pattern.ratchet[track][step] != 0) {
+        add(track << 8 | step);
+        add(pattern.ratchet[track][step]);
+      }
+    }
+    const DrumLoop::ParamLock* locks = DrumLoop::TrackLocks(&pattern, track);
+    for (int i = 0; i < DrumLoop::LockCount(&pattern, track); i++) {
+      add(track << 16 | locks[i].step << 8 | locks[i].param);
+      add(locks[i].value);
+    }
+  }
+  return hash;
+}
+
+void Analyse(const std::vector<Sint16>& audio, GoldenRender* render) {
+  int frames = (int)audio.size() / 2;
+  render->frames = frames;
+
+  Uint64 checksum = 14695981039346656037ull;
+  double sum = 0.0;
+  for (Sint16 sample : audio) {
+    Uint16 bits = (Uint16)sample;
+    checksum = (checksum ^ (bits & 0xff)) * 1099511628211ull;
+    checksum = (checksum ^ (bits >> 8)) * 1099511628211ull;
+    sum += (double)sample * sample;
+  }
+  render->checksum = checksum;
+  double rms = frames > 0 ? sqrt(sum / audio.size()) / 32768.0 : 0.0;
+  render->rms_db = rms > 1e-6 ? 20.0 * log10(rms) : -120.0;
+
+  render->onsets.clear();
+  double history[OnsetHistory] = {};
+  int hold = 0;
+  for (int block = 0; block + OnsetBlock <= frames; block += OnsetBlock) {
+    double energy = 0.0;
+    for (int i = block; i < block + OnsetBlock; i++) {
+      double mono = (audio[2 * i] + audio[2 * i + 1]) * 0.5;
+      energy += mono * mono;
+    }
+    energy /= OnsetBlock;
+    double recent = 0.0;
+    for (double e : history) {
+      recent = e > recent ? e : recent;
+    }
+    if (hold > 0) {
+      hold--;
+    } else if (energy > OnsetFloor && energy > OnsetRise * recent) {
+      int onset = block;
+      for (int i = block; i < block + OnsetBlock; i++) {
+        double mono = (audio[2 * i] + audio[2 * i + 1]) * 0.5;
+        if (mono * mono >= energy) {
+          onset = i;
+          break;
+        }
+      }
+      render->onsets.push_back(onset);
+      hold = OnsetHold;
+    }
+    history[(block / OnsetBlock) % OnsetHistory] = energy;
+  }
+}
+
+bool ReadGoldenFile(const char* file,
+                    std::map<std::string, GoldenRender>* out) {
+  std::ifstream in(file);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name, bpm, delay;
+    GoldenRender render;
+    int onsets = 0;
+    fields >> name >> bpm >> delay >> std::hex >> render.pattern_hash >>
+      std::dec >> render.frames >> std::hex >> render.checksum >> std::dec >>
+      render.rms_db >> onsets;
+    for (int i = 0; i < onsets && fields; i++) {
+      int onset;
+      fields >> onset;
+      render.onsets.push_back(onset);
+    }
+    if (!fields || (int)render.onsets.size() != onsets) {
+      printf("Bad line in %s: %s\n", file, line.c_str());
+      return false;
+    }
+    render.key = name + " " + bpm + " " + delay;
+    (*out)[render.key] = render;
+  }
+  return true;
+}
+
+bool WriteGoldenFile(const char* file,
+                     const std::vector<GoldenRender>& renders) {
+  std::error_code ec;
+  std::filesystem::path parent = std::filesystem::path(file).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent, ec);
+  }
+  FILE* f = fopen(file, "w");
+  if (f == nullptr) {
+    printf("Couldn't open %s for writing\n", file);
+    return false;
+  }
+  fprintf(f, "# Written by sdl_drums --verify-golden --update.\n"
+             "# pattern bpm delay pattern_hash frames checksum rms_db "
+             "onset_count onsets...\n");
+  for (const GoldenRender& render : renders) {
+    fprintf(f, "%s %08x %u %016llx %.2f %i", render.key.c_str(),
+            render.pattern_hash, render.frames,
+            (unsigned long long)render.checksum, render.rms_db,
+            (int)render.onsets.size());
+    for (int onset : render.onsets) {
+      fprintf(f, " %i", onset);
+    }
+    fprintf(f, "\n");
+  }
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    printf("Couldn't write %s\n", file);
+    return false;
+  }
+  return true;
+}
+
+// Prints how far |render| is from |golden|: level, length and onsets. Each
+// golden onset is paired with the nearest rendered one.
+void ReportDifference(const GoldenRender& render, const GoldenRender& golden) {
+  printf("FAIL %s: RMS %.2f dB (golden %.2f dB, %+.2f dB)",
+         render.key.c_str(), render.rms_db, golden.rms_db,
+         render.rms_db - golden.rms_db);
+  if (render.frames != golden.frames) {
+    printf(", %u frames (golden %u)", render.frames, golden.frames);
+  }
+  printf("\n");
+
+  int missing = 0;
+  int max_shift = 0;
+  int max_shift_at = -1;
+  std::vector<bool> matched(render.onsets.size(), false);
+  for (int onset : golden.onsets) {
+    int best = -1;
+    for (int i = 0; i < (int)render.onsets.size(); i++) {
+      if (best < 0 || abs(render.onsets[i] - onset) <
+                      abs(render.onsets[best] - onset)) {
+        best = i;
+      }
+    }
+    if (best < 0 || abs(render.onsets[best] - onset) > OnsetMatchFrames) {
+      missing++;
+      continue;
+    }
+    matched[best] = true;
+    int shift = render.onsets[best] - onset;
+    if (abs(shift) > abs(max_shift)) {
+      max_shift = shift;
+      max_shift_at = onset;
+    }
+  }
+  int extra = 0;
+  for (bool m : matched) {
+    extra += m ? 0 : 1;
+  }
+  printf("  %i onsets (golden %i), %i missing, %i extra",
+         (int)render.onsets.size(), (int)golden.onsets.size(), missing, extra);
+  if (max_shift_at >= 0) {
+    printf(", largest shift %+i frames at frame %i", max_shift,
+           max_shift_at);
+  }
+  printf("\n");
+}
+
+}  // namespace
+
+bool VerifyGolden(const char* pattern_dir, const char* golden_file, Kit* kit,
+                  bool update) {
+  std::vector<DrumLoop::Pattern> patterns;
+  std::vector<std::string> names;
+  if (!CollectPatterns(pattern_dir, &patterns, &names) || patterns.empty()) {
+    printf("No patterns in %s\n", pattern_dir);
+    return false;
+  }
+
+  DelaySettings dry;
+  DelaySettings wet;
+  wet.tracks = 0x1ff;
+  wet.milliseconds = 300;
+  wet.feedback = 0.5;
+
+  Uint32 start = SDL_GetTicks();
+  std::vector<GoldenRender> renders;
+  std::vector<Sint16> audio;
+  for (size_t p = 0; p < patterns.size(); p++) {
+    for (int bpm : GoldenBpms) {
+      for (int with_delay = 0; with_delay < 2; with_delay++) {
+        audio.clear();
+        RenderPatternAudio(patterns[p], bpm, GoldenLoops, kit,
+                           with_delay ? wet : dry,
+                           [&audio](const Sint16* frames, int count) {
+                             audio.insert(audio.end(), frames,
+                                          frames + count * 2);
+                             return true;
+                           });
+        GoldenRender render;
+        render.key = names[p] + " " + std::to_string(bpm) +
+                     (with_delay ? " delay" : " dry");
+        render.pattern_hash = HashPattern(patterns[p]);
+        Analyse(audio, &render);
+        renders.push_back(render);
+      }
+    }
+  }
+  double seconds = (SDL_GetTicks() - start) / 1000.0;
+
+  if (update) {
+    if (!WriteGoldenFile(golden_file, renders)) {
+      return false;
+    }
+    printf("Wrote %i renders to %s\n", (int)renders.size(), golden_file);
+    return true;
+  }
+
+  std::map<std::string, GoldenRender> golden;
+  if (!ReadGoldenFile(golden_file, &golden)) {
+    printf("Couldn't read %s, run with --update to write it\n", golden_file);
+    return false;
+  }
+  int passed = 0;
+  for (const GoldenRender& render : renders) {
+    auto it = golden.find(render.key);
+    if (it == golden.end()) {
+      printf("NEW  %s: not in the golden file\n", render.key.c_str());
+      continue;
+    }
+    GoldenRender expected = it->second;
+    golden.erase(it);
+    if (render.pattern_hash != expected.pattern_hash) {
+      printf("CHANGED %s: the pattern was edited since the golden file "
+             "was written\n", render.key.c_str());
+    } else if (render.frames == expected.frames &&
+               render.checksum == expected.checksum) {
+      passed++;
+    } else {
+      ReportDifference(render, expected);
+    }
+  }
+  for (const auto& entry : golden) {
+    printf("GONE %s: no such pattern anymore\n", entry.first.c_str());
+  }
+  printf("%i of %i renders match %s (rendered in %.2f s)\n", passed,
+         (int)renders.size(), golden_file, seconds);
+  return passed == (int)renders.size();
+}
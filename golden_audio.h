@@ -0,0 +1,24 @@
+#ifndef GOLDEN_AUDIO_H
+#define GOLDEN_AUDIO_H
+
+#include "voice_pool.h"
+
+#define GOLDEN_FILE "golden/renders.txt"
+// Fixture patterns the golden renders are made from. Copies kept apart from
+// ./patterns, which the app rewrites as it's played.
+#define GOLDEN_PATTERN_DIR "golden/patterns"
+
+// Regression check of what the engine sounds like. Every pattern under
+// |pattern_dir| is rendered offline from |kit| at each of a few tempos, dry
+// and through the delay, and compared with |golden_file|, which holds a
+// checksum of every render, its RMS level and where its onsets are. A render
+// that doesn't match exactly is reported with how far its level and onsets
+// moved. Renders of patterns that changed since the golden file was written
+// are reported as such rather than as failures of the engine.
+//
+// With |update| the golden file is written from the current renders instead.
+// True if everything matched, or the file was written.
+bool VerifyGolden(const char* pattern_dir, const char* golden_file, Kit* kit,
+                  bool update);
+
+#endif  // GOLDEN_AUDIO_H
@@ -0,0 +1,566 @@
+#include "midi_file.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+const int SOUND_BUTTONS_TOTAL = 9;
+const int STEPS_TOTAL = 32;
+const int TicksPerStep = MidiDivision / 4;
+const int NoteLength = TicksPerStep / 2;
+const int NoteVelocity = 100;
+const Uint8 DrumChannel = 9;
+const int StepsPerBar = 16;
+// 10,000 bars
+const int MaxImportPatterns = 5000;
+// Notes further than this from a step are reported when imported.
+const int GridTolerance = TicksPerStep / 16;
+const int MaxReportedNotes = 10;
+
+const char* TrackNames[9] = {
+  "Bass Drum", "Snare", "Crash", "Crash 2", "Claves", "Ride", "High Tom",
+  "Low Tom", "Hand Clap",
+};
+
+// Other GM drum notes that are close enough to one of the tracks.
+struct NoteAlias {
+  int note;
+  int track;
+};
+const NoteAlias NoteAliases[] = {
+  { 35, 0 },  // Acoustic Bass Drum
+  { 40, 1 },  // Electric Snare
+  { 37, 1 },  // Side Stick
+  { 52, 2 },  // Chinese Cymbal
+  { 55, 3 },  // Splash Cymbal
+  { 42, 5 },  // Closed Hi-Hat
+  { 44, 5 },  // Pedal Hi-Hat
+  { 46, 5 },  // Open Hi-Hat
+  { 53, 5 },  // Ride Bell
+  { 59, 5 },  // Ride Cymbal 2
+  { 76, 4 },  // Hi Wood Block
+  { 48, 6 },  // Hi-Mid Tom
+  { 47, 6 },  // Low-Mid Tom
+  { 43, 7 },  // High Floor Tom
+  { 41, 7 },  // Low Floor Tom
+};
+
+int TrackForNote(int note) {
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    if (MidiDrumNotes[i] == note) {
+      return i;
+    }
+  }
+  for (const NoteAlias& alias : NoteAliases) {
+    if (alias.note == note) {
+      return alias.track;
+    }
+  }
+  return -1;
+}
+
+// Buffered big endian writer for one file. Track chunks are written with a
+// placeholder length that is patched once the track is done.
+class MidiWriter {
+ public:
+  ~MidiWriter() {
+    if (file_ != nullptr) {
+      fclose(file_);
+    }
+  }
+
+  bool Open(const char* file) {
+    file_ = fopen(file, "wb");
+    return file_ != nullptr;
+  }
+
+  bool Close() {
+    Flush();
+    bool ok = !failed_ && fclose(file_) == 0;
+    file_ = nullptr;
+    return ok;
+  }
+
+  void Byte(Uint8 b) {
+    if (used_ == sizeof(buffer_)) {
+      Flush();
+    }
+    buffer_[used_++] = b;
+    written_++;
+  }
+
+  void Bytes(const void* data, int len) {
+    for (int i = 0; i < len; i++) {
+      Byte(((const Uint8*)data)[i]);
+    }
+  }
+
+  void BE16(Uint16 v) {
+    Byte((Uint8)(v >> 8));
+    Byte((Uint8)v);
+  }
+
+  void BE32(Uint32 v) {
+    BE16((Uint16)(v >> 16));
+    BE16((Uint16)v);
+  }
+
+  void VarLen(Uint32 v) {
+    Uint8 bytes[5];
+    int n = 0;
+    do {
+      bytes[n++] = v & 0x7f;
+      v >>= 7;
+    } while (v);
+    while (n > 1) {
+      Byte(bytes[--n] | 0x80);
+    }
+    Byte(bytes[0]);
+  }
+
+  void BeginTrack() {
+    Bytes("MTrk", 4);
+    track_start_ = written_;
+    BE32(0);
+    tick_ = 0;
+    status_ = 0;
+  }
+
+  void EndTrack(Uint32 tick) {
+    Meta(tick, 0x2f, nullptr, 0);
+    Flush();
+    Uint32 len = (Uint32)(written_ - track_start_ - 4);
+    Uint8 be[4] = { (Uint8)(len >> 24), (Uint8)(len >> 16), (Uint8)(len >> 8),
+                    (Uint8)len };
+    if (fseek(file_, (long)track_start_, SEEK_SET) != 0 ||
+        fwrite(be, 1, 4, file_) != 4 || fseek(file_, 0, SEEK_END) != 0) {
+      failed_ = true;
+    }
+  }
+
+  // Channel message, using running status where it can.
+  void Event(Uint32 tick, Uint8 status, Uint8 a, Uint8 b) {
+    Delta(tick);
+    if (status != status_) {
+      Byte(status);
+      status_ = status;
+    }
+    Byte(a);
+    Byte(b);
+  }
+
+  void Meta(Uint32 tick, Uint8 type, const void* data, int len) {
+    Delta(tick);
+    Byte(0xff);
+    Byte(type);
+    VarLen(len);
+    Bytes(data, len);
+    status_ = 0;
+  }
+
+ private:
+  void Delta(Uint32 tick) {
+    if (tick < tick_) {
+      tick = tick_;
+    }
+    VarLen(tick - tick_);
+    tick_ = tick;
+  }
+
+  void Flush() {
+    if (used_ > 0 && fwrite(buffer_, 1, used_, file_) != (size_t)used_) {
+      failed_ = true;
+    }
+    used_ = 0;
+  }
+
+  FILE* file_ = nullptr;
+  Uint8 buffer_[1 << 16];
+  int used_ = 0;
+  size_t written_ = 0;
+  size_t track_start_ = 0;
+  Uint32 tick_ = 0;
+  Uint8 status_ = 0;
+  bool failed_ = false;
+};
+
+void WriteTempoMap(MidiWriter* w, int bpm) {
+  const char* name = "SDL Drums";
+  w->Meta(0, 0x03, name, (int)strlen(name));
+  const Uint8 time_signature[4] = { 4, 2, 24, 8 };  // 4/4
+  w->Meta(0, 0x58, time_signature, 4);
+  Uint32 us = 60000000 / bpm;
+  const Uint8 tempo[3] = { (Uint8)(us >> 16), (Uint8)(us >> 8), (Uint8)us };
+  w->Meta(0, 0x51, tempo, 3);
+}
+
+// Writes the notes of the tracks in |mask| for the whole song. Trigs are
+// walked step by step; micro offsets stay within half a step, so only the
+// trigs of one step have to be put in order. Tracks with a length of their
+// own wrap on their own and tracks with a divisor play every few steps, as
+// in the sequencer, counting from the start of the song; their offsets are
+// kept within half a pattern step too. Note offs wait in |off_tick| until
+// the next note on or the end.
+Uint32 WriteNotes(MidiWriter* w, const SongPart* parts, int count, int mask) {
+  Uint32 off_tick[9];
+  bool pending[9] = {};
+
+  auto flush_offs = [&](Uint32 until, bool all) {
+    for (;;) {
+      int first = -1;
+      for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+        if (pending[i] && (all || off_tick[i] <= until) &&
+            (first < 0 || off_tick[i] < off_tick[first])) {
+          first = i;
+        }
+      }
+      if (first < 0) {
+        return;
+      }
+      w->Event(off_tick[first], 0x90 | DrumChannel, MidiDrumNotes[first], 0);
+      pending[first] = false;
+    }
+  };
+
+  Uint32 base = 0;
+  Uint64 song_step = 0;
+  for (int p = 0; p < count; p++) {
+    const DrumLoop::Pattern* pattern = parts[p].pattern;
+    for (int r = 0; r < parts[p].repeats; r++) {
+      for (int step = 0; step < pattern->length; step++, song_step++) {
+        int tracks[9];
+        Uint32 ticks[9];
+        int n = 0;
+        for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+          int divisor = pattern->divisor[i];
+          if (!(mask & (1 << i)) || song_step % divisor != 0) {
+            continue;
+          }
+          int length = DrumLoop::TrackLength(pattern, i);
+          int track_step = (int)((song_step / divisor) % length);
+          if (!((pattern->trigs[i] >> track_step) & 1)) {
+            continue;
+          }
+          int micro = pattern->micro[i][track_step] * divisor;
+          micro = std::max(-DrumLoop::MICRO_STEPS / 2,
+                           std::min(micro, DrumLoop::MICRO_STEPS / 2 - 1));
+          Sint64 tick = (Sint64)base + step * TicksPerStep +
+                        micro * TicksPerStep / DrumLoop::MICRO_STEPS;
+          Uint32 t = tick < 0 ? 0 : (Uint32)tick;
+          int j = n++;
+          for (; j > 0 && ticks[j - 1] > t; j--) {
+            tracks[j] = tracks[j - 1];
+            ticks[j] = ticks[j - 1];
+          }
+          tracks[j] = i;
+          ticks[j] = t;
+        }
+        for (int j = 0; j < n; j++) {
+          int track = tracks[j];
+          flush_offs(ticks[j], false);
+          if (pending[track]) {
+            // Still ringing from the trig before, cut it here.
+            w->Event(ticks[j], 0x90 | DrumChannel, MidiDrumNotes[track], 0);
+          }
+          w->Event(ticks[j], 0x90 | DrumChannel, MidiDrumNotes[track],
+                   NoteVelocity);
+          off_tick[track] = ticks[j] + NoteLength;
+          pending[track] = true;
+        }
+      }
+      base += pattern->length * TicksPerStep;
+    }
+  }
+  flush_offs(0, true);
+  return base;
+}
+
+bool ReadVarLen(const Uint8** p, const Uint8* end, Uint32* value) {
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    if (*p >= end) {
+      return false;
+    }
+    Uint8 b = *(*p)++;
+    *value = (*value << 7) | (b & 0x7f);
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Uint32 ReadBE32(const Uint8* p) {
+  return ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) |
+         p[3];
+}
+
+}  // namespace
+
+bool WriteMidiFile(const char* file, const SongPart* parts, int count, int bpm,
+                   int format) {
+  if (format != 0 && format != 1) {
+    printf("Can only write MIDI file types 0 and 1, not %i\n", format);
+    return false;
+  }
+  if (bpm <= 0) {
+    printf("Bad tempo for MIDI file: %i\n", bpm);
+    return false;
+  }
+  // Tick positions have to fit in 32 bits.
+  Uint64 total_steps = 0;
+  int used = 0;
+  for (int p = 0; p < count; p++) {
+    const DrumLoop::Pattern* pattern = parts[p].pattern;
+    total_steps += (Uint64)parts[p].repeats * pattern->length;
+    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+      int length = DrumLoop::TrackLength(pattern, i);
+      Uint32 played = length >= 32 ? 0xffffffffu : (1u << length) - 1;
+      if (pattern->trigs[i] & played) {
+        used |= 1 << i;
+      }
+    }
+  }
+  if (total_steps * TicksPerStep >= 0xffffffffu) {
+    printf("Song too long for a MIDI file\n");
+    return false;
+  }
+
+  MidiWriter w;
+  if (!w.Open(file)) {
+    printf("Couldn't open %s for writing\n", file);
+    return false;
+  }
+
+  int tracks = 1;
+  for (int i = 0; format == 1 && i < SOUND_BUTTONS_TOTAL; i++) {
+    if (used & (1 << i)) {
+      tracks++;
+    }
+  }
+  w.Bytes("MThd", 4);
+  w.BE32(6);
+  w.BE16(format);
+  w.BE16(tracks);
+  w.BE16(MidiDivision);
+
+  if (format == 0) {
+    w.BeginTrack();
+    WriteTempoMap(&w, bpm);
+    w.EndTrack(WriteNotes(&w, parts, count, used));
+  } else {
+    w.BeginTrack();
+    WriteTempoMap(&w, bpm);
+    w.EndTrack((Uint32)(total_steps * TicksPerStep));
+    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+      if (!(used & (1 << i))) {
+        continue;
+      }
+      w.BeginTrack();
+      w.Meta(0, 0x03, TrackNames[i], (int)strlen(TrackNames[i]));
+      w.EndTrack(WriteNotes(&w, parts, count, 1 << i));
+    }
+  }
+
+  if (!w.Close()) {
+    printf("Couldn't write %s\n", file);
+    return false;
+  }
+  return true;
+}
+
+bool ReadMidiFile(const char* file, std::vector<DrumLoop::Pattern>* patterns,
+                  int* bpm) {
+  FILE* f = fopen(file, "rb");
+  if (f == nullptr) {
+    printf("Couldn't open %s\n", file);
+    return false;
+  }
+  std::vector<Uint8> data;
+  Uint8 chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(f);
+
+  const Uint8* p = data.data();
+  const Uint8* end = p + data.size();
+  if (data.size() < 14 || memcmp(p, "MThd", 4) != 0 || ReadBE32(p + 4) < 6) {
+    printf("%s is not a MIDI file\n", file);
+    return false;
+  }
+  int format = (p[8] << 8) | p[9];
+  int division = (p[12] << 8) | p[13];
+  if (format > 1) {
+    printf("Can only read MIDI file types 0 and 1, %s is type %i\n", file,
+           format);
+    return false;
+  }
+  if (division == 0 || (division & 0x8000)) {
+    printf("%s uses SMPTE timing, which isn't supported\n", file);
+    return false;
+  }
+  Uint32 header_len = ReadBE32(p + 4);
+  if (header_len > (Uint32)(end - p - 8)) {
+    printf("%s is truncated\n", file);
+    return false;
+  }
+  p += 8 + header_len;
+
+  patterns->clear();
+  bool have_tempo = false;
+  int notes = 0;
+  int off_grid = 0;
+  int dropped = 0;
+  int unmapped[128] = {};
+  // Notes on other channels, the melodic parts of a song
+  int other_channels[16] = {};
+
+  while (end - p >= 8) {
+    Uint32 len = ReadBE32(p + 4);
+    const Uint8* track_end = p + 8 + len;
+    if (len > (Uint32)(end - p - 8)) {
+      track_end = end;  // Truncated, read what is there.
+    }
+    bool is_track = memcmp(p, "MTrk", 4) == 0;
+    p += 8;
+    if (!is_track) {
+      p = track_end;
+      continue;
+    }
+
+    Uint64 tick = 0;
+    Uint8 status = 0;
+    while (p < track_end) {
+      Uint32 delta;
+      if (!ReadVarLen(&p, track_end, &delta) || p >= track_end) {
+        break;
+      }
+      tick += delta;
+
+      Uint8 b = *p;
+      if (b & 0x80) {
+        p++;
+        if (b < 0xf0) {
+          status = b;
+        }
+      } else if (status != 0) {
+        b = status;
+      } else {
+        break;  // Data byte without a status.
+      }
+
+      if (b == 0xff) {
+        if (p >= track_end) {
+          break;
+        }
+        Uint8 type = *p++;
+        Uint32 meta_len;
+        if (!ReadVarLen(&p, track_end, &meta_len) ||
+            meta_len > (Uint32)(track_end - p)) {
+          break;
+        }
+        if (type == 0x51 && meta_len == 3 && !have_tempo) {
+          Uint32 us = (p[0] << 16) | (p[1] << 8) | p[2];
+          if (us > 0) {
+            *bpm = (int)((60000000.0 / us) + 0.5);
+            have_tempo = true;
+          }
+        }
+        p += meta_len;
+        if (type == 0x2f) {
+          break;
+        }
+        continue;
+      }
+      if (b == 0xf0 || b == 0xf7) {
+        Uint32 sysex_len;
+        if (!ReadVarLen(&p, track_end, &sysex_len) ||
+            sysex_len > (Uint32)(track_end - p)) {
+          break;
+        }
+        p += sysex_len;
+        continue;
+      }
+
+      int data_bytes = (b & 0xf0) == 0xc0 || (b & 0xf0) == 0xd0 ? 1 : 2;
+      if (track_end - p < data_bytes) {
+        break;
+      }
+      int note = p[0] & 0x7f;
+      int velocity = data_bytes == 2 ? p[1] : 0;
+      p += data_bytes;
+      if ((b & 0xf0) != 0x90 || velocity == 0) {
+        continue;
+      }
+      if ((b & 0x0f) != DrumChannel) {
+        other_channels[b & 0x0f]++;
+        continue;
+      }
+
+      int track = TrackForNote(note);
+      if (track < 0) {
+        unmapped[note]++;
+        continue;
+      }
+      Uint64 step = (tick * 4 + division / 2) / division;
+      Sint64 offset = (Sint64)(tick * 4) - (Sint64)(step * division);
+      if ((offset < 0 ? -offset : offset) > GridTolerance * division * 4 /
+                                               MidiDivision) {
+        if (off_grid < MaxReportedNotes) {
+          printf("Note %i at bar %i, step %i is off the grid, moved to step "
+                 "%i\n", note, (int)(tick * 4 / division / StepsPerBar) + 1,
+                 (int)(tick * 4 / division % StepsPerBar) + 1,
+                 (int)(step % StepsPerBar) + 1);
+        }
+        off_grid++;
+      }
+      Uint64 index = step / STEPS_TOTAL;
+      if (index >= MaxImportPatterns) {
+        dropped++;
+        continue;
+      }
+      while (patterns->size() <= index) {
+        DrumLoop::Pattern empty;
+        DrumLoop::EmptyPattern(&empty);
+        patterns->push_back(empty);
+      }
+      (*patterns)[index].trigs[track] |= 1u << (step % STEPS_TOTAL);
+      notes++;
+    }
+    p = track_end;
+  }
+
+  if (off_grid > MaxReportedNotes) {
+    printf("...and %i more\n", off_grid - MaxReportedNotes);
+  }
+  if (off_grid > 0) {
+    printf("%i of %i notes were off the step grid\n", off_grid,
+           notes + dropped);
+  }
+  for (int i = 0; i < 128; i++) {
+    if (unmapped[i] > 0) {
+      printf("Note %i isn't played by any track, skipped it %i times\n", i,
+             unmapped[i]);
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    if (other_channels[i] > 0) {
+      printf("Skipped %i notes on channel %i, only channel %i is drums\n",
+             other_channels[i], i + 1, DrumChannel + 1);
+    }
+  }
+  if (dropped > 0) {
+    printf("Skipped %i notes after bar %i\n", dropped,
+           MaxImportPatterns * STEPS_TOTAL / StepsPerBar);
+  }
+  if (patterns->empty()) {
+    printf("No drum notes in %s\n", file);
+    return false;
+  }
+  return true;
+}
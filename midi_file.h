@@ -0,0 +1,43 @@
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+#include <vector>
+
+#include "drum_loop.h"
+
+// Standard MIDI File import and export. Tracks map to General MIDI drum notes
+// on channel 10, a step is a sixteenth note and a pattern is two bars.
+
+const int MidiDivision = 480;  // Ticks per quarter note
+const int MidiDrumNotes[9] = {
+  36,  // Bass Drum 1
+  38,  // Acoustic Snare
+  49,  // Crash Cymbal 1
+  57,  // Crash Cymbal 2
+  75,  // Claves
+  51,  // Ride Cymbal 1
+  50,  // High Tom
+  45,  // Low Tom
+  39,  // Hand Clap
+};
+
+// A stretch of an arrangement: |pattern| played |repeats| times in a row.
+struct SongPart {
+  const DrumLoop::Pattern* pattern;
+  int repeats;
+};
+
+// Writes |parts| as a type 0 (one track) or type 1 (a tempo track plus one
+// track per drum track) file. Events go out through a fixed size buffer
+// while the song is walked, so memory use doesn't grow with its length.
+bool WriteMidiFile(const char* file, const SongPart* parts, int count, int bpm,
+                   int format);
+
+// Reads the drum notes (those on channel 10) of a type 0 or 1 file into
+// consecutive patterns, snapping each note to the nearest step. Notes that
+// were off the grid, that no track plays or on other channels are reported. |bpm| is set from the first tempo event,
+// if there is one.
+bool ReadMidiFile(const char* file, std::vector<DrumLoop::Pattern>* patterns,
+                  int* bpm);
+
+#endif  // MIDI_FILE_H
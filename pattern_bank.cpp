@@ -0,0 +1,194 @@
+#include "pattern_bank.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+// "SDBK", version, pattern count, then per pattern its length in steps, the
+// 9 tracks' trig bits as 32 bit words and their 9 x 32 micro offsets. Little
+// endian. Version 1 banks had no length and 32 '0'/'1' characters per track
+// instead of the words, they are still read.
+//
+// Since version 3 each pattern goes on with the 9 track lengths, the 9
+// divisors, the 9 x 32 ratchets, the number of tempo points and each as its
+// step and its tempo in tenths of a BPM (16 bits), then the number of
+// parameter locks of each track and each lock as its step, parameter and
+// value.
+const char BankMagic[4] = { 'S', 'D', 'B', 'K' };
+const Uint32 BankVersion = 3;
+const int TRACKS = 9;
+const int STEPS = 32;
+
+void WriteExtras(FILE* f, const DrumLoop::Pattern& p) {
+  fwrite(p.track_length, 1, TRACKS, f);
+  fwrite(p.divisor, 1, TRACKS, f);
+  fwrite(p.ratchet, 1, sizeof(p.ratchet), f);
+  Uint8 count = (Uint8)p.tempo.count;
+  fwrite(&count, 1, 1, f);
+  for (int i = 0; i < p.tempo.count; i++) {
+    int tenths = (int)(p.tempo.points[i].bpm * 10.0f + 0.5f);
+    Uint8 b[3] = { (Uint8)p.tempo.points[i].step, (Uint8)tenths,
+                   (Uint8)(tenths >> 8) };
+    fwrite(b, 1, 3, f);
+  }
+  for (int t = 0; t < TRACKS; t++) {
+    count = (Uint8)DrumLoop::LockCount(&p, t);
+    fwrite(&count, 1, 1, f);
+  }
+  for (int t = 0; t < TRACKS; t++) {
+    const DrumLoop::ParamLock* locks = DrumLoop::TrackLocks(&p, t);
+    for (int i = 0; i < DrumLoop::LockCount(&p, t); i++) {
+      Uint8 b[3] = { locks[i].step, locks[i].param, locks[i].value };
+      fwrite(b, 1, 3, f);
+    }
+  }
+}
+
+// Out of range values are dropped rather than failing the whole bank.
+bool ReadExtras(FILE* f, DrumLoop::Pattern* p) {
+  Uint8 lengths[TRACKS];
+  Uint8 divisors[TRACKS];
+  Uint8 count;
+  if (fread(lengths, 1, TRACKS, f) != TRACKS ||
+      fread(divisors, 1, TRACKS, f) != TRACKS ||
+      fread(p->ratchet, 1, sizeof(p->ratchet), f) != sizeof(p->ratchet) ||
+      fread(&count, 1, 1, f) != 1) {
+    return false;
+  }
+  for (int t = 0; t < TRACKS; t++) {
+    p->track_length[t] = lengths[t] <= STEPS ? lengths[t] : 0;
+    p->divisor[t] = divisors[t] >= 1 && divisors[t] <= DrumLoop::MAX_DIVISOR
+                    ? divisors[t] : 1;
+  }
+  for (int i = 0; i < count; i++) {
+    Uint8 b[3];
+    if (fread(b, 1, 3, f) != 3) {
+      return false;
+    }
+    if (b[0] < STEPS) {
+      AddTempoPoint(&p->tempo, b[0], (b[1] | (b[2] << 8)) / 10.0f);
+    }
+  }
+  Uint8 locks[TRACKS];
+  if (fread(locks, 1, TRACKS, f) != TRACKS) {
+    return false;
+  }
+  for (int t = 0; t < TRACKS; t++) {
+    for (int i = 0; i < locks[t]; i++) {
+      Uint8 b[3];
+      if (fread(b, 1, 3, f) != 3) {
+        return false;
+      }
+      if (b[0] < STEPS && b[1] < DrumLoop::LOCK_PARAMS) {
+        DrumLoop::SetLock(p, t, b[0], b[1], b[2]);
+      }
+    }
+  }
+  return true;
+}
+
+void WriteLE32(FILE* f, Uint32 v) {
+  Uint8 b[4] = { (Uint8)v, (Uint8)(v >> 8), (Uint8)(v >> 16), (Uint8)(v >> 24) };
+  fwrite(b, 1, 4, f);
+}
+
+bool ReadLE32(FILE* f, Uint32* v) {
+  Uint8 b[4];
+  if (fread(b, 1, 4, f) != 4) {
+    return false;
+  }
+  *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((Uint32)b[3] << 24);
+  return true;
+}
+
+}  // namespace
+
+bool IsBankFile(const char* file) {
+  size_t len = strlen(file);
+  size_t ext = strlen(BANK_EXTENSION);
+  return len > ext && strcmp(file + len - ext, BANK_EXTENSION) == 0;
+}
+
+bool ReadPatternBank(const char* file,
+                     std::vector<DrumLoop::Pattern>* patterns) {
+  FILE* f = fopen(file, "rb");
+  if (f == nullptr) {
+    printf("Couldn't open bank %s\n", file);
+    return false;
+  }
+  char magic[4];
+  Uint32 version = 0;
+  Uint32 count = 0;
+  if (fread(magic, 1, 4, f) != 4 || memcmp(magic, BankMagic, 4) != 0 ||
+      !ReadLE32(f, &version) || !ReadLE32(f, &count)) {
+    printf("%s is not a pattern bank\n", file);
+    fclose(f);
+    return false;
+  }
+  if (version < 1 || version > BankVersion) {
+    printf("Bank %s has unknown version %u\n", file, version);
+    fclose(f);
+    return false;
+  }
+
+  patterns->clear();
+  for (Uint32 i = 0; i < count; i++) {
+    DrumLoop::Pattern p;
+    DrumLoop::EmptyPattern(&p);
+    bool ok = true;
+    if (version == 1) {
+      char line[STEPS + 1] = {};
+      for (int t = 0; t < TRACKS && ok; t++) {
+        ok = fread(line, 1, STEPS, f) == STEPS && strspn(line, "01") == STEPS;
+        for (int j = 0; j < STEPS && ok; j++) {
+          p.trigs[t] |= (Uint32)(line[j] == '1') << j;
+        }
+      }
+    } else {
+      Uint8 length = 0;
+      ok = fread(&length, 1, 1, f) == 1 && length >= 1 && length <= STEPS;
+      p.length = length;
+      for (int t = 0; t < TRACKS && ok; t++) {
+        ok = ReadLE32(f, &p.trigs[t]);
+      }
+    }
+    ok = ok && fread(p.micro, 1, sizeof(p.micro), f) == sizeof(p.micro);
+    ok = ok && (version < 3 || ReadExtras(f, &p));
+    if (!ok) {
+      printf("Bank %s is damaged at pattern %u\n", file, i + 1);
+      fclose(f);
+      return false;
+    }
+    patterns->push_back(p);
+  }
+  fclose(f);
+  return true;
+}
+
+bool WritePatternBank(const char* file,
+                      const std::vector<DrumLoop::Pattern>& patterns) {
+  FILE* f = fopen(file, "wb");
+  if (f == nullptr) {
+    printf("Couldn't open %s for writing\n", file);
+    return false;
+  }
+  fwrite(BankMagic, 1, 4, f);
+  WriteLE32(f, BankVersion);
+  WriteLE32(f, (Uint32)patterns.size());
+  for (const DrumLoop::Pattern& p : patterns) {
+    Uint8 length = (Uint8)p.length;
+    fwrite(&length, 1, 1, f);
+    for (int t = 0; t < TRACKS; t++) {
+      WriteLE32(f, p.trigs[t]);
+    }
+    fwrite(p.micro, 1, sizeof(p.micro), f);
+    WriteExtras(f, p);
+  }
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    printf("Couldn't write %s\n", file);
+    return false;
+  }
+  return true;
+}
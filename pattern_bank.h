@@ -0,0 +1,18 @@
+#ifndef PATTERN_BANK_H
+#define PATTERN_BANK_H
+
+#include <vector>
+
+#include "drum_loop.h"
+
+// A bank is one binary file holding any number of patterns in order, e.g. all
+// the two bar parts of an imported song. Files ending in BANK_EXTENSION are
+// banks, anything else is a single pattern text file.
+#define BANK_EXTENSION ".bank"
+
+bool IsBankFile(const char* file);
+bool ReadPatternBank(const char* file, std::vector<DrumLoop::Pattern>* patterns);
+bool WritePatternBank(const char* file,
+                      const std::vector<DrumLoop::Pattern>& patterns);
+
+#endif  // PATTERN_BANK_H
@@ -0,0 +1,451 @@
+#include "pattern_journal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// "SDJL" and the version, then records of: track, pattern length, the
+// track's trig bits as a little endian 32 bit word, its 32 micro offsets and
+// a checksum of those 38 bytes.
+//
+// Since version 2 track TempoTrack holds the tempo lane instead: the number
+// of points in place of the trig bits and each point as its step and its
+// tempo in tenths of a BPM, little endian 16 bit, in place of the offsets.
+// Since version 3 track LayoutTrack holds the length of every track and
+// then the divisor of every track in place of the offsets. Since version 4
+// track RatchetTracks + t holds the ratchets of track t in place of its
+// offsets. Since version 5 track LockTracks + t * LOCK_PARAMS + p holds
+// the value of lock p at every step of track t, -1 for none. Since version
+// 6 track EditEndTrack, with a length of 0 and nothing else, closes the
+// records of an edit; earlier every record was an edit of its own.
+const char JournalMagic[4] = { 'S', 'D', 'J', 'L' };
+const Uint32 JournalVersion = 6;
+const Uint32 FirstGroupedVersion = 6;
+const int HeaderBytes = 8;
+const int RecordBytes = 2 + 4 + 32 + 4;
+const int TRACKS = 9;
+const int STEPS = 32;
+const int TempoTrack = 0xff;
+const int LayoutTrack = 0xfe;
+const int EditEndTrack = 0xfd;
+const int RatchetTracks = 0x80;
+const int LockTracks = 0xa0;
+const int LockRecords = TRACKS * DrumLoop::LOCK_PARAMS;
+const int TempoPointBytes = 3;
+// How long the writer waits after the first record of a batch for more.
+const int BatchDelayMs = 50;
+const int CompactRecords = 1000;
+
+void PutLE32(Uint8* b, Uint32 v) {
+  b[0] = (Uint8)v;
+  b[1] = (Uint8)(v >> 8);
+  b[2] = (Uint8)(v >> 16);
+  b[3] = (Uint8)(v >> 24);
+}
+
+Uint32 GetLE32(const Uint8* b) {
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((Uint32)b[3] << 24);
+}
+
+// FNV-1a, enough to tell a record that was only partly written.
+Uint32 Checksum(const Uint8* data, int size) {
+  Uint32 hash = 2166136261u;
+  for (int i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Flushes |f| through to the disk.
+bool SyncFile(FILE* f) {
+  if (fflush(f) != 0) {
+    return false;
+  }
+#ifdef _WIN32
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+bool SyncPath(const char* path) {
+  FILE* f = fopen(path, "r+b");
+  if (f == nullptr) {
+    return false;
+  }
+  bool synced = SyncFile(f);
+  fclose(f);
+  return synced;
+}
+
+// Makes a rename into the directory of |file| durable. Windows does that
+// with MOVEFILE_WRITE_THROUGH instead.
+void SyncDirectory(const std::string& file) {
+#ifndef _WIN32
+  size_t slash = file.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : file.substr(0, slash);
+  int fd = open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+void PackTempo(const TempoLane& lane, Uint32* count, signed char* bytes) {
+  *count = lane.count;
+  memset(bytes, 0, STEPS);
+  for (int i = 0; i < lane.count; i++) {
+    Uint8* b = (Uint8*)bytes + i * TempoPointBytes;
+    int tenths = (int)(lane.points[i].bpm * 10.0f + 0.5f);
+    b[0] = (Uint8)lane.points[i].step;
+    b[1] = (Uint8)tenths;
+    b[2] = (Uint8)(tenths >> 8);
+  }
+}
+
+void UnpackTempo(Uint32 count, const signed char* bytes, TempoLane* lane) {
+  ClearTempoLane(lane);
+  for (Uint32 i = 0; i < count && i < MAX_TEMPO_POINTS; i++) {
+    const Uint8* b = (const Uint8*)bytes + i * TempoPointBytes;
+    if (b[0] < STEPS) {
+      AddTempoPoint(lane, b[0], (b[1] | (b[2] << 8)) / 10.0f);
+    }
+  }
+}
+
+bool RenameOver(const char* from, const char* to) {
+#ifdef _WIN32
+  return MoveFileExA(from, to,
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  return rename(from, to) == 0;
+#endif
+}
+
+}  // namespace
+
+static int StaticWriterFunc(void* journal_object) {
+  return ((PatternJournal*)journal_object)->WriterFunc();
+}
+
+PatternJournal::~PatternJournal() {
+  StopWriter();
+  if (wake_ != nullptr) {
+    SDL_DestroySemaphore(wake_);
+  }
+  if (stream_ != nullptr) {
+    fclose(stream_);
+  }
+}
+
+bool PatternJournal::Open(const char* file, const char* pattern_file,
+                          DrumLoop::Pattern* pattern) {
+  file_ = file;
+  pattern_file_ = pattern_file;
+
+  int edits = 0;
+  bool intact = false;
+  FILE* f = fopen(file, "rb");
+  if (f != nullptr) {
+    intact = Replay(f, pattern, &edits);
+    fclose(f);
+    if (edits > 0) {
+      printf("Recovered %i edits from %s\n", edits, file);
+    }
+    if (!intact) {
+      printf("Dropped an incomplete edit at the end of %s\n", file);
+    }
+  }
+  state_ = *pattern;
+
+  bool opened;
+  if (edits > 0) {
+    opened = Compact(pattern);
+  } else if (!intact) {
+    opened = Restart();
+  } else {
+    stream_ = fopen(file, "ab");
+    opened = stream_ != nullptr;
+  }
+  if (!opened) {
+    printf("Couldn't open journal %s\n", file);
+    return false;
+  }
+
+  wake_ = SDL_CreateSemaphore(0);
+  if (wake_ == nullptr) {
+    printf("Couldn't start journal writer: %s\n", SDL_GetError());
+    return false;
+  }
+  running_ = true;
+  thread_ = SDL_CreateThread(StaticWriterFunc, "Journal", this);
+  if (thread_ == nullptr) {
+    printf("Couldn't start journal writer: %s\n", SDL_GetError());
+    running_ = false;
+    return false;
+  }
+  return true;
+}
+
+// Applies the edits in |f| until its end or the first record that is cut
+// off or damaged, leaving out the records of an edit that wasn't closed.
+// True if the file was whole.
+bool PatternJournal::Replay(FILE* f, DrumLoop::Pattern* pattern,
+                            int* edits) {
+  Uint8 header[HeaderBytes];
+  if (fread(header, 1, HeaderBytes, f) != HeaderBytes ||
+      memcmp(header, JournalMagic, 4) != 0 ||
+      GetLE32(header + 4) < 1 || GetLE32(header + 4) > JournalVersion) {
+    return false;
+  }
+  bool grouped = GetLE32(header + 4) >= FirstGroupedVersion;
+  // The open edit, only copied to |pattern| once it is closed.
+  DrumLoop::Pattern edit = *pattern;
+  bool in_edit = false;
+  for (;;) {
+    Uint8 b[RecordBytes];
+    size_t n = fread(b, 1, RecordBytes, f);
+    if (n == 0) {
+      return !in_edit;
+    }
+    if (n != RecordBytes ||
+        GetLE32(b + RecordBytes - 4) != Checksum(b, RecordBytes - 4)) {
+      return false;
+    }
+    if (grouped && b[0] == EditEndTrack) {
+      if (in_edit) {
+        *pattern = edit;
+        (*edits)++;
+      }
+      in_edit = false;
+      continue;
+    }
+    if ((b[0] >= TRACKS && b[0] != TempoTrack && b[0] != LayoutTrack &&
+         (b[0] < RatchetTracks || b[0] >= RatchetTracks + TRACKS) &&
+         (b[0] < LockTracks || b[0] >= LockTracks + LockRecords)) ||
+        b[1] < 1 || b[1] > STEPS) {
+      return false;
+    }
+    Record record;
+    record.track = b[0];
+    record.length = b[1];
+    record.trigs = GetLE32(b + 2);
+    memcpy(record.micro, b + 6, STEPS);
+    Apply(record, &edit);
+    if (grouped) {
+      in_edit = true;
+    } else {
+      *pattern = edit;
+      (*edits)++;
+    }
+  }
+}
+
+void PatternJournal::Apply(const Record& record, DrumLoop::Pattern* pattern) {
+  if (record.track == TempoTrack) {
+    UnpackTempo(record.trigs, record.micro, &pattern->tempo);
+  } else if (record.track == LayoutTrack) {
+    for (int i = 0; i < TRACKS; i++) {
+      Uint8 length = (Uint8)record.micro[i];
+      Uint8 divisor = (Uint8)record.micro[TRACKS + i];
+      pattern->track_length[i] = length <= STEPS ? length : 0;
+      pattern->divisor[i] =
+          divisor >= 1 && divisor <= DrumLoop::MAX_DIVISOR ? divisor : 1;
+    }
+  } else if (record.track >= LockTracks) {
+    int track = (record.track - LockTracks) / DrumLoop::LOCK_PARAMS;
+    int param = (record.track - LockTracks) % DrumLoop::LOCK_PARAMS;
+    for (int j = 0; j < STEPS; j++) {
+      DrumLoop::SetLock(pattern, track, j, param,
+                        record.micro[j] < 0 ? DrumLoop::NO_LOCK
+                                            : record.micro[j]);
+    }
+  } else if (record.track >= RatchetTracks) {
+    memcpy(pattern->ratchet[record.track - RatchetTracks], record.micro,
+           STEPS);
+  } else {
+    pattern->trigs[record.track] = record.trigs;
+    memcpy(pattern->micro[record.track], record.micro, STEPS);
+  }
+  pattern->length = record.length;
+}
+
+bool PatternJournal::Append(int track, const DrumLoop::Pattern& pattern) {
+  Record record;
+  record.track = (Uint8)track;
+  record.length = (Uint8)pattern.length;
+  record.trigs = pattern.trigs[track];
+  memcpy(record.micro, pattern.micro[track], STEPS);
+  return Push(record);
+}
+
+bool PatternJournal::AppendTempo(const DrumLoop::Pattern& pattern) {
+  Record record;
+  record.track = TempoTrack;
+  record.length = (Uint8)pattern.length;
+  PackTempo(pattern.tempo, &record.trigs, record.micro);
+  return Push(record);
+}
+
+bool PatternJournal::AppendRatchets(int track,
+                                    const DrumLoop::Pattern& pattern) {
+  Record record;
+  record.track = (Uint8)(RatchetTracks + track);
+  record.length = (Uint8)pattern.length;
+  record.trigs = 0;
+  memcpy(record.micro, pattern.ratchet[track], STEPS);
+  return Push(record);
+}
+
+bool PatternJournal::AppendLocks(int track, int param,
+                                 const DrumLoop::Pattern& pattern) {
+  Record record;
+  record.track = (Uint8)(LockTracks + track * DrumLoop::LOCK_PARAMS + param);
+  record.length = (Uint8)pattern.length;
+  record.trigs = 0;
+  for (int j = 0; j < STEPS; j++) {
+    record.micro[j] = (signed char)DrumLoop::GetLock(&pattern, track, j,
+                                                     param);
+  }
+  return Push(record);
+}
+
+bool PatternJournal::AppendLayout(const DrumLoop::Pattern& pattern) {
+  Record record;
+  record.track = LayoutTrack;
+  record.length = (Uint8)pattern.length;
+  record.trigs = 0;
+  memset(record.micro, 0, STEPS);
+  memcpy(record.micro, pattern.track_length, TRACKS);
+  memcpy(record.micro + TRACKS, pattern.divisor, TRACKS);
+  return Push(record);
+}
+
+bool PatternJournal::EndEdit() {
+  Record record;
+  record.track = EditEndTrack;
+  record.length = 0;
+  record.trigs = 0;
+  memset(record.micro, 0, STEPS);
+  return Push(record);
+}
+
+bool PatternJournal::Push(const Record& record) {
+  if (!records_.Push(record)) {
+    return false;
+  }
+  SDL_SemPost(wake_);
+  return true;
+}
+
+void PatternJournal::Close(const DrumLoop::Pattern* pattern) {
+  if (stream_ == nullptr) {
+    return;
+  }
+  StopWriter();
+  Compact(pattern);
+  if (stream_ != nullptr) {
+    fclose(stream_);
+    stream_ = nullptr;
+  }
+}
+
+// Lets the writer finish what's queued and waits for it.
+void PatternJournal::StopWriter() {
+  running_ = false;
+  if (thread_ != nullptr) {
+    SDL_SemPost(wake_);
+    SDL_WaitThread(thread_, NULL);
+    thread_ = nullptr;
+  }
+}
+
+int PatternJournal::WriterFunc() {
+  while (running_) {
+    SDL_SemWait(wake_);
+    if (running_) {
+      SDL_Delay(BatchDelayMs);
+    }
+    while (SDL_SemTryWait(wake_) == 0) {}
+    Drain();
+    // Not in the middle of an edit, the rest of its records would go into
+    // the new journal without the ones before them.
+    if (since_compact_ >= CompactRecords && !in_edit_) {
+      Compact(&state_);
+    }
+  }
+  Drain();
+  return 0;
+}
+
+// Writes every queued record and syncs once. Returns how many there were.
+int PatternJournal::Drain() {
+  int count = 0;
+  Record record;
+  while (records_.Pop(&record)) {
+    Uint8 b[RecordBytes];
+    b[0] = record.track;
+    b[1] = record.length;
+    PutLE32(b + 2, record.trigs);
+    memcpy(b + 6, record.micro, STEPS);
+    PutLE32(b + RecordBytes - 4, Checksum(b, RecordBytes - 4));
+    if (stream_ == nullptr ||
+        fwrite(b, 1, RecordBytes, stream_) != RecordBytes) {
+      printf("Couldn't write to journal %s\n", file_.c_str());
+    }
+    if (record.track == EditEndTrack) {
+      in_edit_ = false;
+    } else {
+      Apply(record, &state_);
+      in_edit_ = true;
+    }
+    count++;
+  }
+  if (count > 0 && stream_ != nullptr && !SyncFile(stream_)) {
+    printf("Couldn't sync journal %s\n", file_.c_str());
+  }
+  since_compact_ += count;
+  return count;
+}
+
+// Saves |pattern| to the pattern file and starts the journal over. The
+// journal is only emptied once the new pattern file is safely in place, a
+// crash in between replays records the file already has, which is harmless.
+bool PatternJournal::Compact(const DrumLoop::Pattern* pattern) {
+  std::string temp = pattern_file_ + ".tmp";
+  if (!DrumLoop::WritePatternFile(temp.c_str(), pattern) ||
+      !SyncPath(temp.c_str()) ||
+      !RenameOver(temp.c_str(), pattern_file_.c_str())) {
+    printf("Couldn't save pattern to %s\n", pattern_file_.c_str());
+    return false;
+  }
+  SyncDirectory(pattern_file_);
+  return Restart();
+}
+
+// Truncates the journal to just its header.
+bool PatternJournal::Restart() {
+  if (stream_ != nullptr) {
+    fclose(stream_);
+  }
+  since_compact_ = 0;
+  stream_ = fopen(file_.c_str(), "wb");
+  if (stream_ == nullptr) {
+    return false;
+  }
+  Uint8 header[HeaderBytes];
+  memcpy(header, JournalMagic, 4);
+  PutLE32(header + 4, JournalVersion);
+  return fwrite(header, 1, HeaderBytes, stream_) == HeaderBytes &&
+         SyncFile(stream_);
+}
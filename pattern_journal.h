@@ -0,0 +1,88 @@
+#ifndef PATTERN_JOURNAL_H
+#define PATTERN_JOURNAL_H
+
+#include <SDL.h>
+
+#include <atomic>
+#include <string>
+
+#include "drum_loop.h"
+#include "event_queue.h"
+
+// The journal of a pattern file is kept next to it with this appended.
+#define JOURNAL_EXTENSION ".journal"
+
+// Append-only log of pattern edits, so a crash loses at most the last
+// fraction of a second instead of the whole session. Every record holds the
+// full state of one track plus the pattern length, so replaying a record
+// twice does no harm and the journal only ever has to be cut off at the
+// first record that didn't make it to disk whole. An edit that spans several
+// records is closed by an end of edit record, and replay drops the records
+// of an edit that wasn't closed, so a crash never leaves half of one.
+//
+// The UI thread hands records to a writer thread through a lock-free queue
+// and never touches the disk itself. The writer waits a little after the
+// first record to batch the ones that follow and syncs once per batch.
+// Every CompactRecords records, between edits, and on Close(), it writes the
+// whole pattern to the pattern file (a temporary file renamed over it) and
+// starts the journal over.
+class PatternJournal {
+ public:
+  ~PatternJournal();
+
+  // Applies the intact records in |file| to |pattern|, which holds what was
+  // read from |pattern_file|, and starts the writer. If anything was
+  // recovered it is compacted into |pattern_file| straight away.
+  bool Open(const char* file, const char* pattern_file,
+            DrumLoop::Pattern* pattern);
+  // UI thread. Queues |track| of |pattern| and the pattern length. False if
+  // the queue is full, the caller should try again with a later change.
+  bool Append(int track, const DrumLoop::Pattern& pattern);
+  // Queue the tempo lane of |pattern|, the lengths and divisors of its
+  // tracks, the ratchets of |track| or its locks of |param|, and its
+  // length, the same way.
+  bool AppendTempo(const DrumLoop::Pattern& pattern);
+  bool AppendLayout(const DrumLoop::Pattern& pattern);
+  bool AppendRatchets(int track, const DrumLoop::Pattern& pattern);
+  bool AppendLocks(int track, int param, const DrumLoop::Pattern& pattern);
+  // Closes the edit the records queued since the last call belong to. If
+  // it doesn't fit the edit carries on into the next one.
+  bool EndEdit();
+  // Writes what's queued, saves |pattern| to the pattern file and empties
+  // the journal.
+  void Close(const DrumLoop::Pattern* pattern);
+
+  int WriterFunc();
+
+ private:
+  struct Record {
+    Uint8 track;
+    Uint8 length;
+    Uint32 trigs;
+    signed char micro[32];
+  };
+
+  static bool Replay(FILE* f, DrumLoop::Pattern* pattern, int* edits);
+  static void Apply(const Record& record, DrumLoop::Pattern* pattern);
+  bool Push(const Record& record);
+  void StopWriter();
+  int Drain();
+  bool Compact(const DrumLoop::Pattern* pattern);
+  bool Restart();
+
+  std::string file_;
+  std::string pattern_file_;
+  FILE* stream_ = nullptr;
+  SDL_Thread* thread_ = nullptr;
+  SDL_sem* wake_ = nullptr;
+  std::atomic<bool> running_{false};
+
+  EventQueue<Record, 1024> records_;
+  // Writer thread: the pattern as of the last record written, and whether
+  // that record's edit is still open.
+  DrumLoop::Pattern state_;
+  bool in_edit_ = false;
+  int since_compact_ = 0;
+};
+
+#endif  // PATTERN_JOURNAL_H
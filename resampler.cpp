@@ -0,0 +1,114 @@
+#include "resampler.h"
+
+#include <math.h>
+
+namespace {
+
+// Kernel length in input frames when the output has the higher rate,
+// otherwise it is scaled by the ratio. A multiple of 4 for the tap loop.
+const int ResampleTaps = 32;
+const int ResamplePhases = 256;
+
+// Rows 0 to ResamplePhases of |taps| coefficients each: row j is the kernel
+// for an output frame j / ResamplePhases of a source frame past the one at
+// tap |taps| / 2 - 1.
+void BuildKernel(int taps, double cutoff, std::vector<float>* table) {
+  const double pi = 3.14159265358979323846;
+  int half = taps / 2;
+  table->resize((ResamplePhases + 1) * taps);
+  for (int j = 0; j <= ResamplePhases; j++) {
+    double frac = (double)j / ResamplePhases;
+    float* row = table->data() + j * taps;
+    double sum = 0.0;
+    for (int k = 0; k < taps; k++) {
+      // Distance from the output position to tap k, in source frames.
+      double d = k - (half - 1) - frac;
+      double x = pi * cutoff * d;
+      double sinc = x == 0.0 ? 1.0 : sin(x) / x;
+      double w = 0.42 + 0.5 * cos(pi * d / half) +
+                 0.08 * cos(2 * pi * d / half);
+      if (d <= -half || d >= half) {
+        w = 0.0;
+      }
+      row[k] = (float)(sinc * w);
+      sum += row[k];
+    }
+    // Unity gain at DC for every phase.
+    for (int k = 0; k < taps; k++) {
+      row[k] = (float)(row[k] / sum);
+    }
+  }
+}
+
+inline Sint16 ToS16(float s) {
+  s = s < 0 ? s - 0.5f : s + 0.5f;
+  return s >= 32767.0f ? 32767 : (s <= -32768.0f ? -32768 : (Sint16)s);
+}
+
+}  // namespace
+
+void ResampleStereo(const Sint16* in, int frames, double ratio,
+                    std::vector<Sint16>* out) {
+  out->clear();
+  if (frames <= 0) {
+    return;
+  }
+  int taps = ResampleTaps;
+  if (ratio > 1.0) {
+    taps = ((int)ceil(ResampleTaps * ratio) + 3) & ~3;
+  }
+  int half = taps / 2;
+  std::vector<float> kernel;
+  BuildKernel(taps, ratio > 1.0 ? 1.0 / ratio : 1.0, &kernel);
+
+  // Frame m of the input is at m + half, with silence around it.
+  int padded = frames + 2 * half + 1;
+  std::vector<float> left(padded, 0.0f);
+  std::vector<float> right(padded, 0.0f);
+  for (int i = 0; i < frames; i++) {
+    left[half + i] = in[2 * i];
+    right[half + i] = in[2 * i + 1];
+  }
+
+  int out_frames = (int)ceil(frames / ratio);
+  out->resize((size_t)out_frames * 2);
+  Sint16* dst = out->data();
+  for (int i = 0; i < out_frames; i++) {
+    double p = i * ratio;
+    int n = (int)p;
+    double table_pos = (p - n) * ResamplePhases;
+    int phase = (int)table_pos;
+    float t = (float)(table_pos - phase);
+    const float* c0 = kernel.data() + phase * taps;
+    const float* c1 = c0 + taps;
+    // Taps start at input frame n - half + 1.
+    const float* l = left.data() + n + 1;
+    const float* r = right.data() + n + 1;
+    float sum_l[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float sum_r[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int k = 0; k < taps; k += 4) {
+      for (int q = 0; q < 4; q++) {
+        float c = c0[k + q] + t * (c1[k + q] - c0[k + q]);
+        sum_l[q] += c * l[k + q];
+        sum_r[q] += c * r[k + q];
+      }
+    }
+    dst[2 * i] = ToS16((sum_l[0] + sum_l[1]) + (sum_l[2] + sum_l[3]));
+    dst[2 * i + 1] = ToS16((sum_r[0] + sum_r[1]) + (sum_r[2] + sum_r[3]));
+  }
+}
+
+void TuneSample(const SampleSource& source, int cents,
+                std::vector<Sint16>* out) {
+  std::vector<Sint16> frames((size_t)source.Frames() * 2);
+  int read = 0;
+  while (read < source.Frames()) {
+    int n = source.Read(read, frames.data() + read * 2,
+                        source.Frames() - read);
+    if (n <= 0) {
+      break;
+    }
+    read += n;
+  }
+  ResampleStereo(frames.data(), read, pow(2.0, cents / 1200.0), out);
+}
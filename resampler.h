@@ -0,0 +1,33 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <SDL.h>
+
+#include <vector>
+
+#include "sample_source.h"
+
+// Tune range of a track, an octave either way.
+const int MaxTuneCents = 1200;
+
+// Resamples |frames| interleaved S16 stereo frames of |in| into |out|, taking
+// |ratio| input frames per output frame.
+//
+// Windowed-sinc interpolation: a Blackman windowed sinc is tabulated at
+// ResamplePhases fractional offsets and each output frame interpolates
+// between the two nearest rows. Going up in pitch (or down in rate) lowers
+// the cutoff to the new Nyquist frequency and widens the kernel to match, so
+// nothing folds back.
+// The source is first converted to one contiguous float array per channel,
+// padded so the kernel never needs bounds checks, and the tap loop keeps
+// four independent sums the compiler can put in one SIMD register.
+void ResampleStereo(const Sint16* in, int frames, double ratio,
+                    std::vector<Sint16>* out);
+
+// Plays |source| back |cents| higher or lower by resampling it into |out|,
+// for the track tune control. Done once when the tune changes, so tuned
+// voices cost the same to play as untuned ones.
+void TuneSample(const SampleSource& source, int cents,
+                std::vector<Sint16>* out);
+
+#endif  // RESAMPLER_H
@@ -0,0 +1,333 @@
+#include "rt_check.h"
+
+#ifdef SDL_DRUMS_RT_CHECK
+
+#include <SDL.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#ifndef __GLIBC__
+#error "The realtime check needs glibc"
+#endif
+
+// glibc's own allocator, what the replacements below pass on to.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void __libc_free(void* p);
+}
+
+namespace {
+
+// Violations past this many are counted but not traced.
+const int MaxReports = 20;
+const int MaxTraceDepth = 32;
+
+// RTScopes the thread is in.
+thread_local int rt_depth = 0;
+// Wrapped calls the thread is in. Whatever a wrapped function calls on its
+// way is its own business and isn't reported again.
+thread_local int wrapped_depth = 0;
+std::atomic<int> violations{0};
+
+// Functions passed on to with dlsym(RTLD_NEXT). Looked up in RTCheckInit(),
+// or on first use for calls made before main(); all lookups find the same
+// address, so racing on them is harmless.
+struct RealFunctions {
+  int (*pthread_mutex_lock)(pthread_mutex_t*);
+  int (*pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+  int (*pthread_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*,
+                                const struct timespec*);
+  int (*sem_wait)(sem_t*);
+  int (*nanosleep)(const struct timespec*, struct timespec*);
+  int (*usleep)(useconds_t);
+  ssize_t (*read)(int, void*, size_t);
+  ssize_t (*write)(int, const void*, size_t);
+  int (*fsync)(int);
+  void (*SDL_Delay)(Uint32);
+  int (*SDL_LockMutex)(SDL_mutex*);
+  int (*SDL_SemWait)(SDL_sem*);
+  int (*SDL_UpdateWindowSurface)(SDL_Window*);
+} real;
+
+template <typename F>
+F Lookup(F* f, const char* name) {
+  if (*f == nullptr) {
+    *f = (F)dlsym(RTLD_NEXT, name);
+  }
+  return *f;
+}
+
+#define REAL(name) Lookup(&real.name, #name)
+
+// Tracks a wrapped call for as long as it lasts and reports it if it was
+// made from audio code.
+class Wrapped {
+ public:
+  explicit Wrapped(const char* name) {
+    if (++wrapped_depth == 1 && rt_depth > 0) {
+      Report(name);
+    }
+  }
+  ~Wrapped() { wrapped_depth--; }
+
+ private:
+  // Only write() and backtrace_symbols_fd(), which don't allocate.
+  static void Report(const char* name) {
+    int count = violations.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (count > MaxReports) {
+      return;
+    }
+    char line[128];
+    int n = snprintf(line, sizeof(line),
+                     "Realtime check: %s called from audio code\n", name);
+    if (REAL(write)(STDERR_FILENO, line, n) < 0) {
+      return;
+    }
+    void* trace[MaxTraceDepth];
+    int depth = backtrace(trace, MaxTraceDepth);
+    backtrace_symbols_fd(trace, depth, STDERR_FILENO);
+    if (count == MaxReports) {
+      const char last[] = "Realtime check: not tracing any more calls\n";
+      REAL(write)(STDERR_FILENO, last, sizeof(last) - 1);
+    }
+  }
+};
+
+}  // namespace
+
+RTScope::RTScope() {
+  rt_depth++;
+}
+
+RTScope::~RTScope() {
+  rt_depth--;
+}
+
+void RTCheckInit() {
+  REAL(pthread_mutex_lock);
+  REAL(pthread_cond_wait);
+  REAL(pthread_cond_timedwait);
+  REAL(sem_wait);
+  REAL(nanosleep);
+  REAL(usleep);
+  REAL(read);
+  REAL(write);
+  REAL(fsync);
+  REAL(SDL_Delay);
+  REAL(SDL_LockMutex);
+  REAL(SDL_SemWait);
+  REAL(SDL_UpdateWindowSurface);
+  // The first backtrace() loads the unwinder.
+  void* trace[1];
+  backtrace(trace, 1);
+  printf("Realtime check enabled\n");
+}
+
+int RTViolations() {
+  return violations.load(std::memory_order_relaxed);
+}
+
+extern "C" {
+
+void* malloc(size_t size) __THROW {
+  Wrapped wrapped("malloc");
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+  Wrapped wrapped("calloc");
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) __THROW {
+  Wrapped wrapped("realloc");
+  return __libc_realloc(p, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) __THROW {
+  Wrapped wrapped("posix_memalign");
+  *p = __libc_memalign(alignment, size);
+  return *p != nullptr || size == 0 ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) __THROW {
+  Wrapped wrapped("aligned_alloc");
+  return __libc_memalign(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) __THROW {
+  Wrapped wrapped("memalign");
+  return __libc_memalign(alignment, size);
+}
+
+void* valloc(size_t size) __THROW {
+  Wrapped wrapped("valloc");
+  return __libc_valloc(size);
+}
+
+void free(void* p) __THROW {
+  Wrapped wrapped("free");
+  __libc_free(p);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) __THROWNL {
+  Wrapped wrapped("pthread_mutex_lock");
+  return REAL(pthread_mutex_lock)(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+  Wrapped wrapped("pthread_cond_wait");
+  return REAL(pthread_cond_wait)(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                           const struct timespec* time) {
+  Wrapped wrapped("pthread_cond_timedwait");
+  return REAL(pthread_cond_timedwait)(cond, mutex, time);
+}
+
+int sem_wait(sem_t* sem) {
+  Wrapped wrapped("sem_wait");
+  return REAL(sem_wait)(sem);
+}
+
+int nanosleep(const struct timespec* time, struct timespec* left) {
+  Wrapped wrapped("nanosleep");
+  return REAL(nanosleep)(time, left);
+}
+
+int usleep(useconds_t usec) {
+  Wrapped wrapped("usleep");
+  return REAL(usleep)(usec);
+}
+
+ssize_t read(int fd, void* buffer, size_t count) {
+  Wrapped wrapped("read");
+  return REAL(read)(fd, buffer, count);
+}
+
+ssize_t write(int fd, const void* buffer, size_t count) {
+  Wrapped wrapped("write");
+  return REAL(write)(fd, buffer, count);
+}
+
+int fsync(int fd) {
+  Wrapped wrapped("fsync");
+  return REAL(fsync)(fd);
+}
+
+void SDL_Delay(Uint32 ms) {
+  Wrapped wrapped("SDL_Delay");
+  REAL(SDL_Delay)(ms);
+}
+
+int SDL_LockMutex(SDL_mutex* mutex) {
+  Wrapped wrapped("SDL_LockMutex");
+  return REAL(SDL_LockMutex)(mutex);
+}
+
+int SDL_SemWait(SDL_sem* sem) {
+  Wrapped wrapped("SDL_SemWait");
+  return REAL(SDL_SemWait)(sem);
+}
+
+int SDL_UpdateWindowSurface(SDL_Window* window) {
+  Wrapped wrapped("SDL_UpdateWindowSurface");
+  return REAL(SDL_UpdateWindowSurface)(window);
+}
+
+}  // extern "C"
+
+void* operator new(size_t size) {
+  Wrapped wrapped("operator new");
+  void* p = __libc_malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  Wrapped wrapped("operator new[]");
+  void* p = __libc_malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  Wrapped wrapped("operator delete");
+  __libc_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  Wrapped wrapped("operator delete[]");
+  __libc_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  Wrapped wrapped("operator delete");
+  __libc_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  Wrapped wrapped("operator delete[]");
+  __libc_free(p);
+}
+
+// The forms over-aligned types such as an alignas(64) EventQueue go through.
+void* operator new(size_t size, std::align_val_t alignment) {
+  Wrapped wrapped("operator new");
+  void* p = __libc_memalign((size_t)alignment, size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  Wrapped wrapped("operator new[]");
+  void* p = __libc_memalign((size_t)alignment, size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  Wrapped wrapped("operator delete");
+  __libc_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  Wrapped wrapped("operator delete[]");
+  __libc_free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  Wrapped wrapped("operator delete");
+  __libc_free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  Wrapped wrapped("operator delete[]");
+  __libc_free(p);
+}
+
+#endif  // SDL_DRUMS_RT_CHECK
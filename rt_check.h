@@ -0,0 +1,38 @@
+#ifndef RT_CHECK_H
+#define RT_CHECK_H
+
+// Debug check that the audio callbacks stay realtime safe. Built with
+// SDL_DRUMS_RT_CHECK (make RT_CHECK=1, glibc only), the program replaces
+// malloc and the rest of the C allocator, operator new and delete in all
+// their forms, aligned ones included, and the usual blocking calls (locks,
+// waits, sleeps, file I/O, presenting the window) with versions that report
+// every call made inside an RTScope, with a stack trace, before passing it
+// on. Otherwise RTScope is empty and costs nothing.
+#ifdef SDL_DRUMS_RT_CHECK
+
+// Marks the calling thread as running audio code while it exists.
+class RTScope {
+ public:
+  RTScope();
+  ~RTScope();
+};
+
+// Looks up the functions that are passed on to and warms up the stack
+// tracer, so neither needs to allocate later. First thing in main().
+void RTCheckInit();
+// Calls reported so far, from any thread.
+int RTViolations();
+
+#else
+
+class RTScope {
+ public:
+  RTScope() {}
+};
+
+inline void RTCheckInit() {}
+inline int RTViolations() { return 0; }
+
+#endif  // SDL_DRUMS_RT_CHECK
+
+#endif  // RT_CHECK_H
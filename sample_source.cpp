@@ -0,0 +1,314 @@
+#include "sample_source.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "resampler.h"
+
+namespace {
+
+const int WAVE_FORMAT_PCM = 0x0001;
+const int WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+const int WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+
+Uint16 ReadLE16(const Uint8* p) {
+  return (Uint16)(p[0] | (p[1] << 8));
+}
+
+Uint32 ReadLE32(const Uint8* p) {
+  return (Uint32)p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) |
+         ((Uint32)p[3] << 24);
+}
+
+// Keeps the top 16 bits of whatever the file stores.
+inline Sint16 ToS16(const Uint8* p, int bytes, bool is_float) {
+  switch (bytes) {
+    case 1: return (Sint16)((p[0] - 128) << 8);
+    case 2: return (Sint16)(p[0] | (p[1] << 8));
+    case 3: return (Sint16)(p[1] | (p[2] << 8));
+    case 4:
+      if (is_float) {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        if (f >= 1.0f) return 32767;
+        if (f <= -1.0f) return -32768;
+        return (Sint16)(f * 32767.0f);
+      }
+      return (Sint16)(p[2] | (p[3] << 8));
+  }
+  return 0;
+}
+
+}  // namespace
+
+SampleSource::SampleSource() {}
+
+SampleSource::~SampleSource() {
+  Close();
+}
+
+bool SampleSource::Open(const char* file, int sample_rate) {
+  Close();
+  if (MapFile(file)) {
+    if (ParseWav()) {
+      if (rate_ == sample_rate) {
+        head_frames_ = frames_ < SampleHeadFrames ? frames_ : SampleHeadFrames;
+        ConvertFrames(data_, head_, head_frames_);
+        return true;
+      }
+      // Resampled once here rather than on every hit.
+      std::vector<Sint16> decoded((size_t)frames_ * 2);
+      ConvertFrames(data_, decoded.data(), frames_);
+      UnmapFile();
+      ResampleStereo(decoded.data(), frames_, (double)rate_ / sample_rate,
+                     &frames_in_ram_);
+      frames_ = (int)frames_in_ram_.size() / 2;
+      return frames_ > 0;
+    }
+    UnmapFile();
+  }
+
+  // Not something we can stream, let SDL_mixer decode it into memory.
+  Mix_Chunk* chunk = Mix_LoadWAV(file);
+  if (chunk == NULL) {
+    return false;
+  }
+  bool converted = ConvertChunk(chunk, sample_rate);
+  Mix_FreeChunk(chunk);
+  return converted;
+}
+
+// SDL_mixer decodes to the device's format, which is S16 or F32 stereo.
+bool SampleSource::ConvertChunk(Mix_Chunk* chunk, int sample_rate) {
+  int rate = 0;
+  Uint16 format = 0;
+  int channels = 0;
+  if (!Mix_QuerySpec(&rate, &format, &channels) || channels != 2) {
+    return false;
+  }
+  std::vector<Sint16> decoded;
+  if (format == AUDIO_S16SYS) {
+    decoded.resize(chunk->alen / sizeof(Sint16));
+    memcpy(decoded.data(), chunk->abuf, decoded.size() * sizeof(Sint16));
+  } else if (format == AUDIO_F32SYS) {
+    decoded.resize(chunk->alen / sizeof(float));
+    const Uint8* src = chunk->abuf;
+    for (size_t i = 0; i < decoded.size(); i++) {
+      decoded[i] = ToS16(src + i * sizeof(float), sizeof(float), true);
+    }
+  } else {
+    printf("Can't convert samples from audio format 0x%x\n", format);
+    return false;
+  }
+  int frames = (int)decoded.size() / 2;
+  if (rate == sample_rate) {
+    frames_in_ram_.swap(decoded);
+  } else {
+    ResampleStereo(decoded.data(), frames, (double)rate / sample_rate,
+                   &frames_in_ram_);
+  }
+  frames_ = (int)frames_in_ram_.size() / 2;
+  return frames_ > 0;
+}
+
+void SampleSource::Close() {
+  UnmapFile();
+  std::vector<Sint16>().swap(frames_in_ram_);
+  frames_ = 0;
+  head_frames_ = 0;
+}
+
+int SampleSource::Read(int pos, Sint16* out, int frames) const {
+  if (pos >= frames_ || frames <= 0) {
+    return 0;
+  }
+  if (frames > frames_ - pos) {
+    frames = frames_ - pos;
+  }
+  if (!frames_in_ram_.empty()) {
+    memcpy(out, frames_in_ram_.data() + (size_t)pos * 2,
+           frames * 2 * sizeof(Sint16));
+    return frames;
+  }
+
+  int done = 0;
+  if (pos < head_frames_) {
+    done = head_frames_ - pos < frames ? head_frames_ - pos : frames;
+    memcpy(out, head_ + pos * 2, done * 2 * sizeof(Sint16));
+  }
+  if (done < frames) {
+    ConvertFrames(data_ + (size_t)(pos + done) * frame_bytes_,
+                  out + done * 2, frames - done);
+  }
+  return frames;
+}
+
+void SampleSource::ConvertFrames(const Uint8* src, Sint16* out,
+                                 int frames) const {
+  if (channels_ == 1) {
+    for (int i = 0; i < frames; i++) {
+      Sint16 s = ToS16(src, bytes_per_sample_, float_);
+      out[2 * i] = s;
+      out[2 * i + 1] = s;
+      src += frame_bytes_;
+    }
+  } else {
+    for (int i = 0; i < frames; i++) {
+      out[2 * i] = ToS16(src, bytes_per_sample_, float_);
+      out[2 * i + 1] = ToS16(src + bytes_per_sample_, bytes_per_sample_,
+                             float_);
+      src += frame_bytes_;
+    }
+  }
+}
+
+// Walks the RIFF chunks of the mapped file. Only formats ConvertFrames()
+// handles are accepted, at any rate.
+bool SampleSource::ParseWav() {
+  const Uint8* p = (const Uint8*)map_;
+  if (map_size_ < 12 || memcmp(p, "RIFF", 4) != 0 ||
+      memcmp(p + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool have_fmt = false;
+  int format = 0;
+  int rate = 0;
+  int bits = 0;
+  size_t offset = 12;
+  while (offset + 8 <= map_size_) {
+    const Uint8* chunk = p + offset;
+    Uint32 size = ReadLE32(chunk + 4);
+    size_t avail = map_size_ - offset - 8;
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && size <= avail) {
+      format = ReadLE16(chunk + 8);
+      channels_ = ReadLE16(chunk + 10);
+      rate = ReadLE32(chunk + 12);
+      bits = ReadLE16(chunk + 22);
+      if (format == WAVE_FORMAT_EXTENSIBLE && size >= 40) {
+        format = ReadLE16(chunk + 32);
+      }
+      have_fmt = true;
+    } else if (memcmp(chunk, "data", 4) == 0 && have_fmt) {
+      if (size > avail) {
+        size = (Uint32)avail;  // Truncated file, play what is there.
+      }
+      bool pcm = format == WAVE_FORMAT_PCM && bits >= 8 && bits <= 32 &&
+                 bits % 8 == 0;
+      bool fp = format == WAVE_FORMAT_IEEE_FLOAT && bits == 32;
+      if (!(pcm || fp) || channels_ < 1 || channels_ > 2 || rate <= 0) {
+        return false;
+      }
+      rate_ = rate;
+      float_ = fp;
+      bytes_per_sample_ = bits / 8;
+      frame_bytes_ = bytes_per_sample_ * channels_;
+      data_ = chunk + 8;
+      frames_ = size / frame_bytes_;
+      return frames_ > 0;
+    }
+    offset += 8 + size + (size & 1);
+  }
+  return false;
+}
+
+#ifdef _WIN32
+
+bool SampleSource::MapFile(const char* file) {
+  HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (f == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(f, &size) || size.QuadPart == 0) {
+    CloseHandle(f);
+    return false;
+  }
+  HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (m == NULL) {
+    CloseHandle(f);
+    return false;
+  }
+  map_ = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+  if (map_ == NULL) {
+    CloseHandle(m);
+    CloseHandle(f);
+    return false;
+  }
+  map_size_ = (size_t)size.QuadPart;
+  file_handle_ = f;
+  mapping_handle_ = m;
+  return true;
+}
+
+void SampleSource::UnmapFile() {
+  if (map_ != nullptr) {
+    UnmapViewOfFile(map_);
+    CloseHandle((HANDLE)mapping_handle_);
+    CloseHandle((HANDLE)file_handle_);
+  }
+  map_ = nullptr;
+  map_size_ = 0;
+  data_ = nullptr;
+}
+
+// Windows trims the working set of idle mappings on its own.
+void SampleSource::Prefetch() const {}
+void SampleSource::Release() const {}
+
+#else
+
+bool SampleSource::MapFile(const char* file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  map_ = map;
+  map_size_ = st.st_size;
+  return true;
+}
+
+void SampleSource::UnmapFile() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+  }
+  map_ = nullptr;
+  map_size_ = 0;
+  data_ = nullptr;
+}
+
+void SampleSource::Prefetch() const {
+  if (map_ != nullptr) {
+    madvise(map_, map_size_, MADV_WILLNEED);
+  }
+}
+
+void SampleSource::Release() const {
+  if (map_ != nullptr) {
+    madvise(map_, map_size_, MADV_DONTNEED);
+  }
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SAMPLE_SOURCE_H
+#define SAMPLE_SOURCE_H
+
+#include <SDL.h>
+#ifdef __linux__
+#include <SDL2/SDL_mixer.h>
+#elif _WIN32
+#include <SDL_mixer.h>
+#endif
+
+#include <vector>
+
+// Frames converted up front when a sample is opened. A trigger starts playing
+// from this copy, so the first ~46 ms never wait for the mapped file.
+const int SampleHeadFrames = 2048;
+
+// Where the frames of a sample come from. Uncompressed PCM WAV files at the
+// engine's rate are memory-mapped and converted to S16 stereo while they
+// play, so only the pages a voice is actually reading become resident.
+// Other rates are converted once when opened, with the windowed-sinc
+// resampler, and kept in RAM. Anything else (ADPCM...) is decoded by
+// SDL_mixer, which needs the audio device open, and also kept in RAM.
+class SampleSource {
+ public:
+  SampleSource();
+  ~SampleSource();
+
+  // Opens |file| to play at |sample_rate| frames per second.
+  bool Open(const char* file, int sample_rate);
+  void Close();
+
+  // Writes up to |frames| interleaved S16 stereo frames starting at frame
+  // |pos| into |out| and returns how many were written. Never allocates, so
+  // it is safe to call from the audio callback.
+  int Read(int pos, Sint16* out, int frames) const;
+
+  // Hints to the OS that the mapping is about to be read, or that its pages
+  // can be dropped again. Both are no-ops for decoded samples and should not
+  // be called from the audio callback.
+  void Prefetch() const;
+  void Release() const;
+
+  int Frames() const { return frames_; }
+  bool Streaming() const { return map_ != nullptr; }
+
+ private:
+  bool MapFile(const char* file);
+  void UnmapFile();
+  bool ParseWav();
+  void ConvertFrames(const Uint8* src, Sint16* out, int frames) const;
+  bool ConvertChunk(Mix_Chunk* chunk, int sample_rate);
+
+  int frames_ = 0;
+  int rate_ = 0;
+  int channels_ = 0;
+  int bytes_per_sample_ = 0;
+  bool float_ = false;
+
+  // PCM data inside the mapping
+  const Uint8* data_ = nullptr;
+  int frame_bytes_ = 0;
+
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+#ifdef _WIN32
+  void* file_handle_ = nullptr;
+  void* mapping_handle_ = nullptr;
+#endif
+
+  // All frames as S16 stereo, for samples that aren't streamed.
+  std::vector<Sint16> frames_in_ram_;
+
+  Sint16 head_[SampleHeadFrames * 2];
+  int head_frames_ = 0;
+};
+
+#endif  // SAMPLE_SOURCE_H
@@ -15,9 +15,17 @@
 #include <stdbool.h>
 #include <memory>
 #include <cmath>
+#include <algorithm>
+#include <filesystem>
 
 #include "sdl_drums.h"
+#include "batch_render.h"
+#include "control_server.h"
 #include "drum_loop.h"
+#include "golden_audio.h"
+#include "midi_file.h"
+#include "pattern_bank.h"
+#include "rt_check.h"
 #include "sound_data.h"
 #include "util.h"
 
@@ -38,22 +46,141 @@ SDL_Surface* screen = NULL;
 
 
 // Wasn't there supposed to be std::bind for this?
-SDLDrums* sdl_drums_obj;
+// Both hooks come in one version per output sample type, T is Sint16 or
+// float as negotiated in InitSDL(). The stream is always stereo.
+template <typename T>
 void GlobalMixFunc(void* udata, Uint8* stream, int len) {
-  sdl_drums_obj->MixFunc(udata, stream, len);
+  RTScope rt_scope;
+  ((SDLDrums*)udata)->MixFunc((T*)stream, len / (2 * (int)sizeof(T)));
+}
+
+// The drum voices are rendered through the music hook, so SDL_mixer hands us
+// a silent stream and runs the postmix (scope and delay) on the result.
+template <typename T>
+void GlobalMusicFunc(void* udata, Uint8* stream, int len) {
+  RTScope rt_scope;
+  ((SoundData*)udata)->Mix((T*)stream, len / (2 * (int)sizeof(T)));
 }
 
 SDL_Rect scope_rect = { 367, 175, 300, 200 };
-void SDLDrums::MixFunc(void* udata, Uint8* stream, int len) {
-  SDL_Surface* surface = (SDL_Surface*)udata;
+template <typename T>
+void SDLDrums::MixFunc(T* stream, int frames) {
+  sound_data.GetDelayEffect()->ApplyDelay(stream, frames);
+  snapshot_.Write(stream, frames);
+  sound_data.CallbackDone();
+}
 
-  SDL_Rect srcrect = { 0, 0, scope_rect.w, scope_rect.h };
-  SDL_FillRect(surface, &srcrect, SDL_MapRGB(screen->format, 0, 0, 0));
-  draw_sample(surface, stream, len, SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a));
-  SDL_BlitSurface(surface, nullptr, screen, &scope_rect);
-  SDL_UpdateWindowSurface(window);
+// Asks for 48 kHz float but takes the rate and format the device runs at,
+// so SDL doesn't have to convert every callback. Samples are converted to
+// that rate once when loaded. Formats the engine can't write are left to SDL
+// to convert from float. Once samples are loaded the device is only ever
+// reopened with a different buffer, at the same rate and format.
+bool SDLDrums::OpenAudio(bool negotiate) {
+  int frequency = negotiate ? 48000 : sound_data.GetSampleRate();
+  Uint16 format = negotiate || float_output_ ? AUDIO_F32SYS : AUDIO_S16SYS;
+  int changes = negotiate ? SDL_AUDIO_ALLOW_FREQUENCY_CHANGE |
+                            SDL_AUDIO_ALLOW_FORMAT_CHANGE : 0;
+  if (Mix_OpenAudioDevice(frequency, format, 2, buffer_frames_, NULL,
+                          changes) != 0) {
+    printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n",
+           Mix_GetError());
+    return false;
+  }
+  if (negotiate) {
+    int channels = 0;
+    Mix_QuerySpec(&frequency, &format, &channels);
+    if (format != AUDIO_S16SYS && format != AUDIO_F32SYS) {
+      Mix_CloseAudio();
+      if (Mix_OpenAudioDevice(frequency, AUDIO_F32SYS, 2, buffer_frames_,
+                              NULL, 0) != 0) {
+        printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n",
+               Mix_GetError());
+        return false;
+      }
+      Mix_QuerySpec(&frequency, &format, &channels);
+    }
+    float_output_ = format == AUDIO_F32SYS;
+    sound_data.SetSampleRate(frequency);
+  }
+  printf("Audio output: %i Hz, %s, %i frame buffer\n", frequency,
+         float_output_ ? "float" : "16 bit", buffer_frames_);
+
+  // Roughly what sits between the mixer and the speakers: SDL's buffer.
+  sound_data.SetOutputLatency(buffer_frames_);
+
+  if (Mix_AllocateChannels(32) < 0) {
+    fprintf(stderr, "Unable to allocate mixing channels: %s\n", SDL_GetError());
+    exit(-1);
+  }
+  return true;
+}
+
+void SDLDrums::InstallAudioHooks() {
+  if (float_output_) {
+    Mix_HookMusic(GlobalMusicFunc<float>, &sound_data);
+    Mix_SetPostMix(GlobalMixFunc<float>, this);
+  } else {
+    Mix_HookMusic(GlobalMusicFunc<Sint16>, &sound_data);
+    Mix_SetPostMix(GlobalMixFunc<Sint16>, this);
+  }
+}
 
-  sound_data.GetDelayEffect()->ApplyDelay(stream, len);
+bool SDLDrums::ReopenAudio(int buffer_frames) {
+  Mix_SetPostMix(nullptr, nullptr);
+  Mix_HookMusic(nullptr, nullptr);
+  Mix_CloseAudio();
+  sound_data.RestartMonitor();
+  int old_frames = buffer_frames_;
+  buffer_frames_ = buffer_frames;
+  bool opened = OpenAudio(false);
+  if (!opened) {
+    buffer_frames_ = old_frames;
+    if (!OpenAudio(false)) {
+      return false;
+    }
+  }
+  InstallAudioHooks();
+  return opened;
+}
+
+void SDLDrums::PrintAudioStats() {
+  AudioStats stats = sound_data.GetAudioStats();
+  printf("Audio: %u underruns, %u overloads in %u callbacks of %i frames, "
+         "load %.0f%% (max %.0f%%), jitter max %.1f ms\n", stats.underruns,
+         stats.overloads, stats.callbacks, stats.buffer_frames,
+         stats.mean_load * 100, stats.max_load * 100, stats.max_jitter_ms);
+}
+
+// Once a second: reports new underruns and overloads and, with an adaptive
+// buffer, doubles the buffer right after them. The buffer is halved again
+// only after a long quiet spell with the transport stopped, so playback is
+// never interrupted to try a smaller one, and never to a size that already
+// glitched.
+void SDLDrums::CheckAudio() {
+  Uint32 now = SDL_GetTicks();
+  if (now - audio_checked_ < AUDIO_CHECK_MS) {
+    return;
+  }
+  audio_checked_ = now;
+  AudioStats stats = sound_data.GetAudioStats();
+  Uint32 glitches = stats.underruns + stats.overloads;
+  if (glitches != audio_glitches_) {
+    PrintAudioStats();
+    audio_glitches_ = glitches;
+    audio_stable_since_ = now;
+    if (adaptive_buffer_ && buffer_frames_ < MAX_BUFFER_FRAMES) {
+      glitched_frames_ = std::max(glitched_frames_, buffer_frames_);
+      ReopenAudio(buffer_frames_ * 2);
+    }
+    return;
+  }
+  if (adaptive_buffer_ && !drum_loop->Running() &&
+      now - audio_stable_since_ >= BUFFER_STABLE_MS &&
+      buffer_frames_ > MIN_BUFFER_FRAMES &&
+      buffer_frames_ / 2 > glitched_frames_) {
+    ReopenAudio(buffer_frames_ / 2);
+    audio_stable_since_ = now;
+  }
 }
 
 bool SDLDrums::InitSDL() {
@@ -71,17 +198,10 @@ bool SDLDrums::InitSDL() {
     return false;
   }
 
-  if (Mix_OpenAudio(SampleRate, AUDIO_S16SYS, 2, 512) != 0) {
-    printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n",
-           Mix_GetError());
+  if (!OpenAudio(true)) {
     return false;
   }
 
-  if (Mix_AllocateChannels(32) < 0) {
-    fprintf(stderr, "Unable to allocate mixing channels: %s\n", SDL_GetError());
-    exit(-1);
-  }
-
   screen = SDL_GetWindowSurface(window);
   SDL_SetSurfaceBlendMode(screen, SDL_BLENDMODE_BLEND);
   SDL_FillRect(screen, NULL, SDL_MapRGB(screen->format, 0, 0, 0));
@@ -148,6 +268,12 @@ int SDLDrums::InitAllSurfaces(SDL_Surface* screen) {
     return INIT_FAILED;
   }
 
+  SDL_Color readout_color = { 255, 184, 42, 255 };
+  bpm_text_.Open(readout_font_files, READOUT_FONTS_TOTAL, BPM_FONT_SIZE,
+                 readout_color);
+  delay_text_.Open(readout_font_files, READOUT_FONTS_TOTAL, DELAY_FONT_SIZE,
+                   readout_color);
+
   undo_button_surface =
     load_surface(screen, undo_button_inactive_file);
   redo_button_surface =
@@ -179,7 +305,7 @@ int SDLDrums::InitAllSurfaces(SDL_Surface* screen) {
   if (!fx1_on || !fx1_off || !fx1_delay_area_surface ||
     !fx1_delay_right_inactive_surface || !fx1_delay_right_active_surface ||
     !fx1_delay_left_inactive_surface || !fx1_delay_left_active_surface ||
-    !fx1_delay_digits_surface) {
+    (!fx1_delay_digits_surface && !delay_text_.Ready())) {
     return INIT_FAILED;
   }
 }
@@ -254,13 +380,11 @@ bool SDLDrums::LoadDigits(SDL_Surface* screen) {
   return true;
 }
 
-// TODO: Repetition from update_trigs. 
-bool SDLDrums::UpdateTrigsFromPattern(DrumLoop::Pattern* p) {
+bool SDLDrums::UpdateTrigs() {
   bool screen_needs_update = false;
-  for (int i = 0; i < 9; i++) {
-    for (int j = 0; j < 32; j++) {
-      trig_buttons[i][j]->SetEnabled(p->tracks[i][j] == '1' ?
-                                     true : false, false);
+  shown_step_ = drum_loop->CurrentStep();
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    for (int j = 0; j < STEPS_TOTAL; j++) {
       screen_needs_update |=
           trig_buttons[i][j]->UpdateStep();
     }
@@ -268,43 +392,238 @@ bool SDLDrums::UpdateTrigsFromPattern(DrumLoop::Pattern* p) {
   return screen_needs_update;
 }
 
-bool SDLDrums::ClearAndUpdateTrigs() {
+// Redraws the cells whose trig was changed in the drum loop directly.
+bool SDLDrums::RefreshTrigs() {
   bool screen_needs_update = false;
-  for (int i = 0; i < 9; i++) {
-    for (int j = 0; j < 32; j++) {
-      trig_buttons[i][j]->SetEnabled(false, false);
-      screen_needs_update |=
-        trig_buttons[i][j]->UpdateStep();
+  for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
+    for (int j = 0; j < STEPS_TOTAL; j++) {
+      screen_needs_update |= trig_buttons[i][j]->Refresh();
     }
   }
   return screen_needs_update;
 }
 
-bool SDLDrums::UpdateTrigs() {
+// Bulk edits of the selected track, or of every track with Shift:
+//   Ctrl+C, Ctrl+V    copy and paste the track. With Shift, copy all tracks
+//                     from the current step on and paste them at it.
+//   Ctrl+Left/Right   rotate a step
+//   Ctrl+, and .      shift a step, dropping what falls off the end
+//   Ctrl+I            invert
+//   Ctrl+E            spread one more hit evenly over the track, one fewer
+//                     with Shift
+//   Ctrl+D            play the pattern twice, doubling its length
+//   Ctrl+Up/Down      tune the selected track a semitone up or down, 10
+//                     cents with Shift
+//   Ctrl+T            set the pattern's tempo at the current step to the
+//                     current BPM, ramping from the point before. With
+//                     Shift, clear the pattern's tempo automation
+//   Ctrl+L            end the selected track at the current step, so it
+//                     wraps on its own. With Shift, wrap with the pattern
+//   Ctrl+R            play the selected track's steps one pattern step
+//                     longer each, one shorter with Shift
+//   Ctrl+G            retrigger the selected track's current step one more
+//                     time, from once up to 8 times and around again. With
+//                     Shift, change its velocity ramp: flat, up or down
+//   Ctrl+P            pick the parameter Ctrl+[ and ] lock: volume, pitch,
+//                     pan, cutoff or delay send. Backwards with Shift
+//   Ctrl+[ and ]      lock the parameter of the selected track's current
+//                     step lower or higher by 8, by 1 with Shift. Pitch
+//                     moves a semitone at a time
+//   Ctrl+O            unlock it again
+bool SDLDrums::HandlePatternKeys(const SDL_Keysym& key) {
+  bool all = key.mod & KMOD_SHIFT;
+  int track = all ? DrumLoop::ALL_TRACKS : selected_track_;
+  int step = std::max(drum_loop->CurrentStep(), 0);
+  bool changed = false;
+  switch (key.sym) {
+    case SDLK_c:
+      if (all) {
+        drum_loop->Copy(DrumLoop::ALL_TRACKS, step,
+                        DrumLoop::MAX_STEPS - step);
+        printf("Copied all tracks from step %i\n", step + 1);
+      } else {
+        drum_loop->Copy(track, 0, DrumLoop::MAX_STEPS);
+        printf("Copied track %i\n", track + 1);
+      }
+      return false;
+    case SDLK_v:
+      changed = drum_loop->Paste(selected_track_, all ? step : 0);
+      break;
+    case SDLK_LEFT:
+      changed = drum_loop->Rotate(track, -1);
+      break;
+    case SDLK_RIGHT:
+      changed = drum_loop->Rotate(track, 1);
+      break;
+    case SDLK_COMMA:
+      changed = drum_loop->Shift(track, -1);
+      break;
+    case SDLK_PERIOD:
+      changed = drum_loop->Shift(track, 1);
+      break;
+    case SDLK_i:
+      changed = drum_loop->Invert(track);
+      break;
+    case SDLK_e:
+      changed = drum_loop->Euclid(selected_track_,
+        drum_loop->CountTrigs(selected_track_) + (all ? -1 : 1),
+        DrumLoop::TrackLength(drum_loop->GetPattern(), selected_track_));
+      break;
+    case SDLK_d:
+      changed = drum_loop->DoubleLength();
+      break;
+    case SDLK_UP:
+    case SDLK_DOWN: {
+      int cents = (all ? 10 : 100) * (key.sym == SDLK_UP ? 1 : -1);
+      cents += sound_data.GetTune(selected_track_);
+      if (sound_data.SetTune(selected_track_, cents)) {
+        cents = sound_data.GetTune(selected_track_);
+        printf("Track %i tuned %+.2f semitones\n", selected_track_ + 1,
+               cents / 100.0);
+      }
+      return false;
+    }
+    case SDLK_t:
+      if (all) {
+        if (drum_loop->ClearTempo()) {
+          printf("Cleared the pattern's tempo\n");
+        }
+      } else if (drum_loop->SetTempoPoint(step, drum_loop->GetBPM())) {
+        printf("Tempo %i BPM at step %i\n", drum_loop->GetBPM(), step + 1);
+      } else {
+        printf("The pattern has %i tempo points already\n",
+               MAX_TEMPO_POINTS);
+      }
+      return false;
+    case SDLK_l:
+      if (drum_loop->SetTrackLength(selected_track_, all ? 0 : step + 1)) {
+        printf("Track %i is %i steps long\n", selected_track_ + 1,
+               DrumLoop::TrackLength(drum_loop->GetPattern(),
+                                     selected_track_));
+      }
+      return false;
+    case SDLK_g: {
+      Uint8 ratchet = drum_loop->GetPattern()->ratchet[selected_track_][step];
+      int count = DrumLoop::RatchetCount(ratchet);
+      int ramp = DrumLoop::RatchetRamp(ratchet);
+      if (all) {
+        ramp = (ramp + 1) % DrumLoop::RAMP_TYPES;
+      } else {
+        count = count % DrumLoop::MAX_RATCHET + 1;
+      }
+      if (drum_loop->SetRatchet(selected_track_, step, count, ramp)) {
+        const char* ramps[] = { "flat", "up", "down" };
+        printf("Track %i step %i plays %i times, %s\n", selected_track_ + 1,
+               step + 1, count, ramps[ramp]);
+      }
+      return false;
+    }
+    case SDLK_p:
+      lock_param_ = (lock_param_ + (all ? DrumLoop::LOCK_PARAMS - 1 : 1)) %
+                    DrumLoop::LOCK_PARAMS;
+      printf("Locking %s\n", DrumLoop::LockParamName(lock_param_));
+      return false;
+    case SDLK_LEFTBRACKET:
+    case SDLK_RIGHTBRACKET: {
+      int value = DrumLoop::GetLock(drum_loop->GetPattern(), selected_track_,
+                                    step, lock_param_);
+      if (value == DrumLoop::NO_LOCK) {
+        // Start from what the step plays unlocked.
+        value = DrumLoop::MAX_LOCK_VALUE;
+        if (lock_param_ == DrumLoop::LockPitch ||
+            lock_param_ == DrumLoop::LockPan) {
+          value = DrumLoop::LOCK_CENTER;
+        } else if (lock_param_ == DrumLoop::LockSend &&
+                   !sound_data.GetDelayEffect()->ChannelEnabled(
+                       selected_track_)) {
+          value = 0;
+        }
+      }
+      int change = lock_param_ == DrumLoop::LockPitch || all ? 1 : 8;
+      value += key.sym == SDLK_RIGHTBRACKET ? change : -change;
+      value = std::max(0, std::min(value, DrumLoop::MAX_LOCK_VALUE));
+      if (drum_loop->SetParamLock(selected_track_, step, lock_param_,
+                                  value)) {
+        printf("Track %i step %i %s %i\n", selected_track_ + 1, step + 1,
+               DrumLoop::LockParamName(lock_param_),
+               DrumLoop::GetLock(drum_loop->GetPattern(), selected_track_,
+                                 step, lock_param_));
+      } else if (DrumLoop::GetLock(drum_loop->GetPattern(), selected_track_,
+                                   step, lock_param_) == DrumLoop::NO_LOCK) {
+        printf("The pattern has %i parameter locks already\n",
+               DrumLoop::MAX_LOCKS);
+      }
+      return false;
+    }
+    case SDLK_o:
+      if (drum_loop->SetParamLock(selected_track_, step, lock_param_,
+                                  DrumLoop::NO_LOCK)) {
+        printf("Track %i step %i %s unlocked\n", selected_track_ + 1,
+               step + 1, DrumLoop::LockParamName(lock_param_));
+      }
+      return false;
+    case SDLK_r: {
+      int divisor = drum_loop->GetPattern()->divisor[selected_track_];
+      if (drum_loop->SetTrackDivisor(selected_track_,
+                                     divisor + (all ? -1 : 1))) {
+        printf("Track %i steps every %i pattern steps\n",
+               selected_track_ + 1,
+               drum_loop->GetPattern()->divisor[selected_track_]);
+      }
+      return false;
+    }
+  }
+  return changed && RefreshTrigs();
+}
+
+// Moves the grid's playhead to |step| by redrawing just the column it
+// leaves and the one it enters, rather than sweeping the whole grid.
+bool SDLDrums::MovePlayhead(int step) {
   bool screen_needs_update = false;
   for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
-    for (int j = 0; j < STEPS_TOTAL; j++) {
-      screen_needs_update |=
-          trig_buttons[i][j]->UpdateStep();
+    if (shown_step_ >= 0 && shown_step_ < STEPS_TOTAL) {
+      screen_needs_update |= trig_buttons[i][shown_step_]->UpdateStep();
+    }
+    if (step >= 0 && step < STEPS_TOTAL) {
+      screen_needs_update |= trig_buttons[i][step]->UpdateStep();
     }
   }
+  shown_step_ = step;
   return screen_needs_update;
 }
 
+// Draws the marker under the grid where playback is heard right now. It
+// glides across each column instead of jumping a step at a time.
+bool SDLDrums::UpdatePlayhead() {
+  int x = -1;
+  double pos = drum_loop->HeardPosition(SDL_GetTicks());
+  if (pos >= 0) {
+    int step = std::min((int)pos, STEPS_TOTAL - 1);
+    int next = step + 1 < STEPS_TOTAL ? step_x_[step + 1]
+                                      : step_x_[step] + TRIG_PITCH;
+    x = step_x_[step] + (int)((pos - step) * (next - step_x_[step]));
+  }
+  if (x == playhead_rect_.x) {
+    return false;
+  }
+  if (playhead_rect_.x >= 0) {
+    SDL_FillRect(screen, &playhead_rect_, SDL_MapRGB(screen->format, 0, 0, 0));
+  }
+  playhead_rect_.x = x;
+  if (x >= 0) {
+    SDL_FillRect(screen, &playhead_rect_,
+                 SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a));
+  }
+  return true;
+}
+
 bool SDLDrums::HandleEditButtons(SDL_Event* e) {
   bool mousedown = false;
   bool clear_button_clicked = false;
   clear_button->HandleEventBase(e, &mousedown, &clear_button_clicked);
   if (clear_button_clicked) {
-    // Currently we just do this so that Clear will be added to the undo
-    // list. The SetEnabled's on the trigs will also zero ou the drum loop.
-    // Revisit this.
     drum_loop->ClearPattern();
-
-    for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
-      for (int j = 0; j < STEPS_TOTAL; j++)
-        trig_buttons[i][j]->SetEnabled(false, false);
-    }
+    RefreshTrigs();
     UpdateTrigs();
     return true;
   }
@@ -314,7 +633,7 @@ bool SDLDrums::HandleEditButtons(SDL_Event* e) {
     &undo_button_clicked);
   if (undo_button_clicked) {
     DrumLoop::UndoAction action = drum_loop->Undo();
-    ApplyUndoAction(action, true);
+    ApplyUndoAction(action);
     return true;
   }
 
@@ -322,46 +641,299 @@ bool SDLDrums::HandleEditButtons(SDL_Event* e) {
   redo_button->HandleEventBase(e, &mousedown, &redo_button_clicked);
   if (redo_button_clicked) {
     DrumLoop::UndoAction action = drum_loop->Redo();
-    ApplyUndoAction(action, false);
+    ApplyUndoAction(action);
     return true;
   }
 
   bool export_button_clicked = false;
   export_button->HandleEventBase(e, &mousedown, &export_button_clicked);
   if (export_button_clicked) {
-    if (export_button->Toggled()) {
-      export_button->SetToggled(false);
-    } else {
-      export_button->SetToggled(true);
-    }
+    ExportMidi();
   }
   return false;
 }
 
-// True for undo, false for redo. Maybe confusing? Should use enum despite the boolean
-// nature of this?
-void SDLDrums::ApplyUndoAction(DrumLoop::UndoAction action, bool undo) {
+void SDLDrums::InitMeters() {
+  meters_rect_.x = scope_rect.x + scope_rect.w + 20;
+  meters_rect_.y = scope_rect.y;
+  // One extra gap sets the master apart from the tracks.
+  meters_rect_.w = METER_COUNT * (METER_WIDTH + METER_GAP) + METER_GAP;
+  meters_rect_.h = METER_HEIGHT;
+  draw_border(screen, meters_rect_);
+  SDL_FillRect(screen, &meters_rect_, SDL_MapRGB(screen->format, 0, 0, 0));
+
+  for (int i = 0; i < METER_COUNT; i++) {
+    meter_level_[i] = METER_FLOOR_DB;
+    meter_hold_[i] = METER_FLOOR_DB;
+    meter_hold_until_[i] = 0;
+    meter_bar_px_[i] = 0;
+    meter_hold_px_[i] = 0;
+  }
+  meters_updated_ = SDL_GetTicks();
+}
+
+static float ToDb(float level) {
+  float db = level > 0.0f ? 20.0f * log10f(level) : METER_FLOOR_DB;
+  return db < METER_FLOOR_DB ? METER_FLOOR_DB : db;
+}
+
+static int DbToPixels(float db) {
+  return (int)((db - METER_FLOOR_DB) / -METER_FLOOR_DB * (METER_HEIGHT - 2));
+}
+
+// Reads the levels the audio thread published and redraws the meters that
+// moved. Bars fall back slowly, the peak line holds for a second first.
+bool SDLDrums::UpdateMeters() {
+  Uint32 now = SDL_GetTicks();
+  float fall = (now - meters_updated_) / 1000.0f * METER_FALL_DB_PER_SEC;
+  meters_updated_ = now;
+
+  Uint32 black = SDL_MapRGB(screen->format, 0, 0, 0);
+  Uint32 yellow = SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a);
+  Uint32 white = SDL_MapRGB(screen->format, 0xff, 0xff, 0xff);
+  bool changed = false;
+  meters_idle_ = true;
+
+  for (int i = 0; i < METER_COUNT; i++) {
+    const LevelMeter& meter = sound_data.Level(i);
+    float rms = ToDb(sqrtf(meter.mean_square.load(std::memory_order_relaxed)));
+    float peak = ToDb(meter.peak.load(std::memory_order_relaxed));
+
+    meter_level_[i] = std::max(rms, meter_level_[i] - fall);
+    if (peak >= meter_hold_[i]) {
+      meter_hold_[i] = peak;
+      meter_hold_until_[i] = now + METER_PEAK_HOLD_MS;
+    } else if ((Sint32)(now - meter_hold_until_[i]) > 0) {
+      meter_hold_[i] = std::max(peak, meter_hold_[i] - fall);
+    }
+
+    int bar = DbToPixels(meter_level_[i]);
+    int hold = DbToPixels(meter_hold_[i]);
+    if (bar > 0 || hold > 0) {
+      meters_idle_ = false;
+    }
+    if (bar == meter_bar_px_[i] && hold == meter_hold_px_[i]) {
+      continue;
+    }
+    meter_bar_px_[i] = bar;
+    meter_hold_px_[i] = hold;
+    changed = true;
+
+    int x = meters_rect_.x + METER_GAP + i * (METER_WIDTH + METER_GAP);
+    if (i == MasterLevel) {
+      x += METER_GAP;
+    }
+    int bottom = meters_rect_.y + METER_HEIGHT - 1;
+    SDL_Rect column = { x, meters_rect_.y + 1, METER_WIDTH, METER_HEIGHT - 2 };
+    SDL_FillRect(screen, &column, black);
+    SDL_Rect fill = { x, bottom - bar, METER_WIDTH, bar };
+    SDL_FillRect(screen, &fill, yellow);
+    if (hold > 0) {
+      SDL_Rect line = { x, bottom - hold, METER_WIDTH, 2 };
+      SDL_FillRect(screen, &line, white);
+    }
+  }
+  return changed;
+}
+
+// Splits the bins between SPECTRUM_MIN_HZ and SPECTRUM_MAX_HZ into bars of
+// equal width on a log frequency scale. Low bars narrower than a bin still
+// get one bin each.
+void SDLDrums::InitSpectrum() {
+  fft_.Init(SPECTRUM_FFT_SIZE);
+  spectrum_input_.resize(SPECTRUM_FFT_SIZE);
+  spectrum_power_.resize(SPECTRUM_FFT_SIZE / 2 + 1);
+
+  float bin_hz = (float)sound_data.GetSampleRate() / SPECTRUM_FFT_SIZE;
+  int last_bin = SPECTRUM_FFT_SIZE / 2;
+  float ratio = SPECTRUM_MAX_HZ / SPECTRUM_MIN_HZ;
+  int bin = 1;
+  for (int i = 0; i <= SPECTRUM_BARS; i++) {
+    float hz = SPECTRUM_MIN_HZ * powf(ratio, (float)i / SPECTRUM_BARS);
+    int edge = std::min((int)(hz / bin_hz + 0.5f), last_bin);
+    bin = i == 0 ? std::max(edge, 1) : std::max(edge, bin + 1);
+    spectrum_bins_[i] = std::min(bin, last_bin);
+  }
+  for (int i = 0; i < SPECTRUM_BARS; i++) {
+    spectrum_db_[i] = SPECTRUM_FLOOR_DB;
+  }
+}
+
+void SDLDrums::ToggleSpectrum() {
+  bool spectrum = !spectrum_mode_.load(std::memory_order_relaxed);
+  spectrum_mode_.store(spectrum, std::memory_order_relaxed);
+  spectrum_updated_ = 0;
+}
+
+// Plots the newest output frames, whenever the audio thread has written
+// more since the last time.
+bool SDLDrums::UpdateScope() {
+  if (spectrum_mode_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  Uint64 written = snapshot_.Written();
+  if (written == scope_written_ ||
+      !snapshot_.Read(scope_samples_, SCOPE_FRAMES)) {
+    return false;
+  }
+  scope_written_ = written;
+  SDL_FillRect(scope_, nullptr, SDL_MapRGB(screen->format, 0, 0, 0));
+  draw_sample(scope_, scope_samples_, SCOPE_FRAMES,
+              SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a));
+  SDL_BlitSurface(scope_, nullptr, screen, &scope_rect);
+  return true;
+}
+
+// Runs the FFT over the newest output frames and draws a bar per band,
+// at most every SPECTRUM_INTERVAL_MS. Bars fall back by SPECTRUM_FALL_DB
+// per redraw rather than flickering down to the floor.
+bool SDLDrums::UpdateSpectrum() {
+  if (!spectrum_mode_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  Uint32 now = SDL_GetTicks();
+  if (spectrum_updated_ != 0 &&
+      now - spectrum_updated_ < SPECTRUM_INTERVAL_MS) {
+    return false;
+  }
+  spectrum_updated_ = now;
+
+  if (!snapshot_.Read(spectrum_input_.data(), SPECTRUM_FFT_SIZE)) {
+    std::fill(spectrum_input_.begin(), spectrum_input_.end(), 0.0f);
+  }
+  fft_.PowerSpectrum(spectrum_input_.data(), spectrum_power_.data());
+
+  Uint32 black = SDL_MapRGB(screen->format, 0, 0, 0);
+  Uint32 yellow = SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a);
+  SDL_FillRect(screen, &scope_rect, black);
+
+  int bar_width = scope_rect.w / SPECTRUM_BARS;
+  int bottom = scope_rect.y + scope_rect.h;
+  for (int i = 0; i < SPECTRUM_BARS; i++) {
+    float power = 0.0f;
+    for (int k = spectrum_bins_[i]; k < spectrum_bins_[i + 1]; k++) {
+      power = std::max(power, spectrum_power_[k]);
+    }
+    if (spectrum_bins_[i] == spectrum_bins_[i + 1]) {
+      power = spectrum_power_[spectrum_bins_[i]];
+    }
+    float db = power > 0.0f ? 10.0f * log10f(power) : SPECTRUM_FLOOR_DB;
+    db = std::max(db, spectrum_db_[i] - SPECTRUM_FALL_DB);
+    db = std::max(std::min(db, 0.0f), SPECTRUM_FLOOR_DB);
+    spectrum_db_[i] = db;
+
+    int height = (int)((db - SPECTRUM_FLOOR_DB) / -SPECTRUM_FLOOR_DB *
+                       scope_rect.h);
+    SDL_Rect bar = { scope_rect.x + i * bar_width, bottom - height,
+                     bar_width - 1, height };
+    SDL_FillRect(screen, &bar, yellow);
+  }
+  return true;
+}
+
+// How long the main loop may wait for input before something on screen
+// needs redrawing.
+Uint32 SDLDrums::FrameInterval() {
+  if (drum_loop->Running() || !meters_idle_ ||
+      SDL_GetTicks() - input_time_ < IDLE_INTERVAL) {
+    return TICK_INTERVAL;
+  }
+  if (spectrum_mode_.load(std::memory_order_relaxed)) {
+    return SPECTRUM_INTERVAL_MS;
+  }
+  return IDLE_INTERVAL;
+}
+
+// Edits and transport commands from the control socket, applied the same
+// way as the matching buttons.
+bool SDLDrums::HandleControlCommands() {
+  bool screen_needs_update = false;
+  ControlMessage message;
+  while (control_server_.PopCommand(&message)) {
+    switch (message.op) {
+      case CONTROL_SET_TRIG:
+        screen_needs_update |=
+          trig_buttons[message.track][message.step]->SetEnabled(
+            message.value != 0, true);
+        break;
+      // The server already handed these to the drum loop, only the
+      // screen is left to catch up.
+      case CONTROL_SET_BPM:
+        DrawBPM(screen, bpm_indicator_rect_, drum_loop->GetBPM());
+        screen_needs_update = true;
+        break;
+      case CONTROL_TRANSPORT:
+        // Paused keeps play or record lit, like the pause button does.
+        if (!drum_loop->Paused()) {
+          bool rec = drum_loop->Running() && drum_loop->RecMode();
+          play_button->SetToggled(drum_loop->Running() && !rec);
+          rec_button->SetToggled(rec);
+        }
+        pause_button->SetToggled(drum_loop->Paused());
+        screen_needs_update |= UpdateTrigs();
+        break;
+    }
+  }
+  return screen_needs_update;
+}
+
+void SDLDrums::ExportMidi() {
+  SongPart part = { drum_loop->GetPattern(), 1 };
+  if (WriteMidiFile(midi_export_file, &part, 1, drum_loop->GetBPM(), 1)) {
+    printf("Exported pattern to %s\n", midi_export_file);
+  }
+}
+
+// Only the first two bars of a longer file make it into the pattern.
+bool SDLDrums::ImportMidi(const char* file) {
+  std::vector<DrumLoop::Pattern> patterns;
+  int bpm = drum_loop->GetBPM();
+  if (!ReadMidiFile(file, &patterns, &bpm)) {
+    return false;
+  }
+  if (patterns.size() > 1) {
+    printf("Imported the first of %i patterns in %s\n", (int)patterns.size(),
+           file);
+  }
+  drum_loop->LoadPattern(&patterns[0]);
+  drum_loop->SetBPM(bpm);
+  DrawBPM(screen, bpm_indicator_rect_, drum_loop->GetBPM());
+  RefreshTrigs();
+  UpdateTrigs();
+  return true;
+}
+
+// Brings the screen up to date with an undo or redo the drum loop has
+// already applied, either way round.
+void SDLDrums::ApplyUndoAction(DrumLoop::UndoAction action) {
   if (action.type == DrumLoop::TrigEdit) {
+    // The drum loop already put the step back, trig and micro offset.
     DrumLoop::TrigEntry* entry = ((DrumLoop::TrigEntry*)(action.data));
-    int track = entry->track;
-    int step = entry->step;
-    int data = entry->data;
-    // !undo of course means redo
-    bool value = (undo && data == '0') ||
-                 (!undo && data == '1') ? true : false;
-    trig_buttons[track][step]->SetEnabled(value, false);
+    trig_buttons[entry->track][entry->step]->Refresh();
     UpdateTrigs();
   } else if (action.type == DrumLoop::ClearAll) {
-    if (undo) {
-      DrumLoop::Pattern* p = (DrumLoop::Pattern*)(action.data);
-      UpdateTrigsFromPattern(p);
-    } else {
-      ClearAndUpdateTrigs();
-    }
+    // The drum loop already put the pattern back or cleared it again.
+    RefreshTrigs();
+    UpdateTrigs();
+  } else if (action.type == DrumLoop::LoadAll ||
+             action.type == DrumLoop::BulkEdit) {
+    // The drum loop already put the pattern back.
+    RefreshTrigs();
   }
 }
 
 void SDLDrums::DrawBPM(SDL_Surface* surface, SDL_Rect rect, int bpm) {
+  if (bpm_text_.Ready()) {
+    if (!bpm_readout_.Update(bpm_text_, bpm)) {
+      return;
+    }
+    SDL_Rect area = { rect.x, rect.y, 3 * digit_imgs[0]->w, digit_imgs[0]->h };
+    SDL_FillRect(surface, &area, SDL_MapRGB(surface->format, 0, 0, 0));
+    // Centred on the digit images' row, the font's line is taller.
+    bpm_text_.Draw(surface, rect.x, rect.y + (area.h - bpm_text_.Height()) / 2,
+                   bpm_readout_);
+    return;
+  }
   short d3 = bpm % 10; bpm /= 10;
   short d2 = bpm % 10; bpm /= 10;
   short d1 = bpm % 10;
@@ -454,16 +1026,22 @@ void SDLDrums::InitDrumTriggersArea() {
   trig_rect.y = SCREEN_HEIGHT - Y_MARGIN;
   trig_rect.w = empty_slot_surface->w;
   trig_rect.h = empty_slot_surface->h;
+  if (!trig_sprites_.Init(screen, empty_slot_surface,
+                          active_empty_slot_surface, trig_button_icons)) {
+    CloseProgram();
+  }
+  // Just below the bottom row.
+  playhead_rect_.x = -1;
+  playhead_rect_.y = trig_rect.y - TRIG_PITCH + trig_rect.h + 4;
+  playhead_rect_.w = PLAYHEAD_WIDTH;
+  playhead_rect_.h = PLAYHEAD_HEIGHT;
   for (int i = 0; i < SOUND_BUTTONS_TOTAL; i++) {
     trig_rect.x = X_MARGIN;
-    trig_rect.y -= 27;
+    trig_rect.y -= TRIG_PITCH;
     for (int j = 0; j < STEPS_TOTAL; j++) {
+      step_x_[j] = trig_rect.x;
       trig_buttons[i][j] = std::make_unique<TrigButton>(
-        screen, active_empty_slot_surface, empty_slot_surface,
-        trig_button_icons[i], trig_rect, drum_loop.get());
-
-      // TODO: A little counter-intuitive having to do this.
-      trig_buttons[i][j]->SetInactive();
+        screen, &trig_sprites_, trig_rect, drum_loop.get());
 
       if (drum_loop->GetTrig(i, j) != '0') {
         trig_buttons[i][j]->Enable();
@@ -472,7 +1050,7 @@ void SDLDrums::InitDrumTriggersArea() {
       trig_buttons[i][j]->SetStep(j);
       trig_buttons[i][j]->Draw();
 
-      trig_rect.x += 27;
+      trig_rect.x += TRIG_PITCH;
       if ((j + 1) % 4 == 0) {
         if ((j + 1) % 16 == 0) {
           trig_rect.x += 15;
@@ -552,6 +1130,18 @@ void SDLDrums::DrawDelayFXArea() {
 void SDLDrums::DrawDelayTimeValue() {
   int milliseconds = sound_data.GetDelayEffect()->GetMilliseconds();
 
+  if (delay_text_.Ready()) {
+    if (!delay_time_readout_.Update(delay_text_, milliseconds)) {
+      return;
+    }
+    SDL_Rect time_value_rect =
+    { delay_area_rect_.x + 97, delay_area_rect_.y + 55, 36, delay_text_.Height() };
+    SDL_FillRect(screen, &time_value_rect, SDL_MapRGB(screen->format, 0, 0, 0));
+    delay_text_.DrawRight(screen, time_value_rect.x + time_value_rect.w,
+                          time_value_rect.y, delay_time_readout_);
+    return;
+  }
+
   SDL_Rect time_value_rect =
   { delay_area_rect_.x + 97, delay_area_rect_.y + 55, 36, fx1_delay_digits_surface->h };
   SDL_FillRect(screen, &time_value_rect, SDL_MapRGB(screen->format, 0, 0, 0));
@@ -575,12 +1165,23 @@ void SDLDrums::DrawDelayTimeValue() {
 void SDLDrums::DrawDelayFeedbackValue() {
   double feedback = sound_data.GetDelayEffect()->GetFeedback();
 
+  if (delay_text_.Ready()) {
+    if (!delay_feedback_readout_.Update(delay_text_, std::min(feedback, 1.0))) {
+      return;
+    }
+    SDL_Rect feedback_value_rect =
+    { delay_area_rect_.x + 102, delay_area_rect_.y + 36, 36, delay_text_.Height() };
+    SDL_FillRect(screen, &feedback_value_rect, SDL_MapRGB(screen->format, 0, 0, 0));
+    delay_text_.Draw(screen, feedback_value_rect.x, feedback_value_rect.y,
+                     delay_feedback_readout_);
+    return;
+  }
+
   SDL_Rect time_value_rect =
   { delay_area_rect_.x + 102, delay_area_rect_.y + 36, 36, fx1_delay_digits_surface->h };
   SDL_FillRect(screen, &time_value_rect, SDL_MapRGB(screen->format, 0, 0, 0));
 
-  // Unnecessarily complicated? Maybe. Would be smart to eventually just make a function
-  // that prints numbers-as-strings... or use SDL_ttf.
+  // Without a font, the same "0.x" or "1.0" from the digit strip.
   if (feedback < 1.0) {
     int digit = (int)(std::round(feedback * 10));
     SDL_Rect feedback_value_dst_rect = { 0, 0, 9, fx1_delay_digits_surface->h };
@@ -646,7 +1247,33 @@ bool SDLDrums::HandleDelay(SDL_Event* e) {
   return screen_needs_update;
 }
 
-SDLDrums::SDLDrums() {
+void SDLDrums::FindKits() {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  for (const fs::directory_entry& entry : fs::directory_iterator(kits_dir, ec)) {
+    if (entry.is_directory(ec) || entry.path().extension() == ".txt") {
+      kit_paths_.push_back(entry.path().string());
+    }
+  }
+  std::sort(kit_paths_.begin(), kit_paths_.end());
+}
+
+// Cycles through the kits in kits_dir. Loading happens in the background, the
+// pattern keeps playing on the old kit until the new one is ready.
+void SDLDrums::NextKit() {
+  if (kit_paths_.empty()) {
+    printf("No kits found in %s\n", kits_dir);
+    return;
+  }
+  int next = (current_kit_ + 1) % kit_paths_.size();
+  if (sound_data.LoadKitAsync(kit_paths_[next].c_str())) {
+    printf("Loading kit %s...\n", kit_paths_[next].c_str());
+    current_kit_ = next;
+  }
+}
+
+SDLDrums::SDLDrums(int buffer_frames, bool adaptive_buffer)
+    : buffer_frames_(buffer_frames), adaptive_buffer_(adaptive_buffer) {
   if (!InitSDL()) {
     CloseProgram();
   }
@@ -654,7 +1281,7 @@ SDLDrums::SDLDrums() {
   const Uint32 black = SDL_MapRGB(screen->format, 0, 0, 0);
   Uint32 yellow = SDL_MapRGB(screen->format, 0xff, 0xb8, 0x2a);
 
-  SDL_Surface* scope = SDL_CreateRGBSurface(SDL_SWSURFACE, 300, 200,
+  scope_ = SDL_CreateRGBSurface(SDL_SWSURFACE, 300, 200,
     screen->format->BitsPerPixel,
     screen->format->Rmask, screen->format->Gmask, screen->format->Bmask,
     screen->format->Amask);
@@ -663,6 +1290,7 @@ SDLDrums::SDLDrums() {
   if (!sound_data.LoadSamples(samples_files)) {
     CloseProgram();
   }
+  FindKits();
 
   // Init drum loop and create sequencer
   drum_loop = std::make_unique<DrumLoop>(&sound_data);
@@ -757,9 +1385,16 @@ SDLDrums::SDLDrums() {
   export_button->Draw();
 
   DrawDelayFXArea();
+  InitMeters();
+  InitSpectrum();
 
   SDL_UpdateWindowSurface(window);
-  Mix_SetPostMix(GlobalMixFunc, scope);
+  InstallAudioHooks();
+
+  if (control_server_.Start(control_socket_file, &sound_data,
+                            drum_loop.get())) {
+    printf("Listening for commands on %s\n", control_socket_file);
+  }
 }
 
 SDLDrums::~SDLDrums() {
@@ -771,31 +1406,47 @@ int SDLDrums::Run() {
   // Main event loop
   SDL_Event e;
   bool quit = false;
-  next_time = SDL_GetTicks() + TICK_INTERVAL;
-  int current_step = -1;
   bool screen_needs_update;
 
+  // Nothing follows the pointer, buttons only look at clicks. Dropping
+  // motion events keeps mouse movement from waking the loop at all.
+  SDL_EventState(SDL_MOUSEMOTION, SDL_IGNORE);
+
   while (quit == false) {
+    Uint32 frame_start = SDL_GetTicks();
     screen_needs_update = false;
     if (drum_loop->Running()) {
       int step = drum_loop->CurrentStep();
-      if (step != current_step) {
-        screen_needs_update = UpdateTrigs();
-        current_step = step;
+      if (step != shown_step_) {
+        screen_needs_update = MovePlayhead(step);
       }
     }
+    screen_needs_update |= UpdatePlayhead();
 
     while (SDL_PollEvent(&e)) {
+      input_time_ = frame_start;
       if (e.type == SDL_QUIT) {
         quit = true;
       }
 
-      if (e.type == SDL_MOUSEMOTION) {
-        next_time += TICK_INTERVAL;
-        SDL_Delay(time_left());
+      // Ctrl chords are pattern edits. They are kept away from the pads and
+      // buttons, which would react to the same keys.
+      if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) &&
+          (e.key.keysym.mod & KMOD_CTRL)) {
+        if (e.type == SDL_KEYDOWN) {
+          screen_needs_update |= HandlePatternKeys(e.key.keysym);
+        }
         continue;
       }
 
+      if (e.type == SDL_DROPFILE) {
+        const char* ext = strrchr(e.drop.file, '.');
+        if (ext && (strcmp(ext, ".mid") == 0 || strcmp(ext, ".midi") == 0)) {
+          screen_needs_update |= ImportMidi(e.drop.file);
+        }
+        SDL_free(e.drop.file);
+      }
+
       ////////////////////////////////
       //   REFACTOR CTRL BUTTONS?   //
       ////////////////////////////////
@@ -899,18 +1550,30 @@ int SDLDrums::Run() {
         bool clicked = false;
         screen_needs_update |=
           sound_buttons[i]->HandleEvent(&e, &clicked);
+        if (clicked) {
+          selected_track_ = i;
+        }
         if (clicked && (drum_loop->Recording() || drum_loop->Paused())) {
           // TODO: Oh, boy is this a mess...
           int step = drum_loop->CurrentStep();
+          signed char micro = 0;
+          if (drum_loop->Recording()) {
+            // Place the hit by when it happened rather than by the step
+            // that happens to be showing now.
+            DrumLoop::RecordedHit hit =
+              drum_loop->QuantizeHit(i, e.common.timestamp);
+            step = hit.step;
+            micro = hit.micro;
+          }
           bool erase = SDL_GetModState() & KMOD_SHIFT;
           if (erase) {
             trig_buttons[i][step]->SetEnabled(false, true);
-            trig_buttons[i][step]->UpdateStep();
           }
           else {
-            trig_buttons[i][step]->SetActive();
-            trig_buttons[i][step]->SetEnabled(true, true);
-            trig_buttons[i][step]->Draw();
+            // One undoable edit with its micro offset, also over a trig
+            // that is already there.
+            drum_loop->SetTrig(i, step, '1', true, micro);
+            trig_buttons[i][step]->Refresh();
           }
         }
       }
@@ -1003,23 +1666,376 @@ int SDLDrums::Run() {
           break;
         case SDLK_b:
           printf("%i\n", drum_loop->CurrentStep());
+          if (blit_stats_.frames > 0) {
+            printf("%.1f button blits per frame (max %i) over %i frames\n",
+                   (float)blit_stats_.blits / blit_stats_.frames,
+                   blit_stats_.max, blit_stats_.frames);
+          }
+          PrintAudioStats();
+          break;
+        case SDLK_k:
+          NextKit();
+          break;
+        case SDLK_v:
+          ToggleSpectrum();
+          break;
+        case SDLK_LEFTBRACKET:
+          drum_loop->SetQuantizeStrength(
+            drum_loop->GetQuantizeStrength() - 0.25f);
+          printf("Quantize: %i%%\n",
+                 (int)(drum_loop->GetQuantizeStrength() * 100));
+          break;
+        case SDLK_RIGHTBRACKET:
+          drum_loop->SetQuantizeStrength(
+            drum_loop->GetQuantizeStrength() + 0.25f);
+          printf("Quantize: %i%%\n",
+                 (int)(drum_loop->GetQuantizeStrength() * 100));
           break;
         }
       }
     }
+    screen_needs_update |= HandleControlCommands();
+    screen_needs_update |= UpdateMeters();
+    screen_needs_update |= UpdateScope();
+    screen_needs_update |= UpdateSpectrum();
+    blit_stats_.pending += Button::TakeBlitCount();
     if (screen_needs_update) {
       SDL_UpdateWindowSurface(window);
       screen_needs_update = false;
+      blit_stats_.frames++;
+      blit_stats_.blits += blit_stats_.pending;
+      blit_stats_.max = std::max(blit_stats_.max, blit_stats_.pending);
+      blit_stats_.pending = 0;
     }
-    next_time += TICK_INTERVAL;
-    SDL_Delay(time_left());
+    sound_data.Update();
+    CheckAudio();
+
+    // Sleep until there is input or the next redraw is due. Whatever
+    // arrives in the meantime is drained in one go on the next pass.
+    next_time = frame_start + FrameInterval();
+    SDL_WaitEventTimeout(nullptr, time_left());
   }
+  control_server_.Stop();
   Mix_SetPostMix(nullptr, nullptr);
+  Mix_HookMusic(nullptr, nullptr);
   return 0;
 }
 
+// sdl_drums --export-midi <out.mid> [--type 0|1] [--bpm N] <pattern>[*N]...
+// Writes the patterns one after another, each repeated N times. A bank
+// stands for all of its patterns.
+static int ExportMidiCommand(int argc, char* argv[]) {
+  const char* out = argv[2];
+  int format = 1;
+  int bpm = 120;
+  std::vector<DrumLoop::Pattern> patterns;
+  std::vector<int> repeats;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+      format = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bpm") == 0 && i + 1 < argc) {
+      bpm = atoi(argv[++i]);
+    } else {
+      std::string file = argv[i];
+      int times = 1;
+      size_t star = file.rfind('*');
+      if (star != std::string::npos) {
+        times = atoi(file.c_str() + star + 1);
+        file.resize(star);
+      }
+      std::vector<DrumLoop::Pattern> read;
+      DrumLoop::Pattern p;
+      if (IsBankFile(file.c_str())) {
+        ReadPatternBank(file.c_str(), &read);
+      } else if (DrumLoop::ReadPatternFile(file.c_str(), &p)) {
+        read.push_back(p);
+      }
+      if (times < 1 || read.empty()) {
+        printf("Couldn't read pattern %s\n", argv[i]);
+        return 1;
+      }
+      patterns.insert(patterns.end(), read.begin(), read.end());
+      repeats.insert(repeats.end(), read.size(), times);
+    }
+  }
+  if (patterns.empty()) {
+    printf("No patterns to export\n");
+    return 1;
+  }
+  // Filled in after |patterns| is done growing.
+  std::vector<SongPart> parts;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    parts.push_back({ &patterns[i], repeats[i] });
+  }
+  Uint32 start = SDL_GetTicks();
+  if (!WriteMidiFile(out, parts.data(), (int)parts.size(), bpm, format)) {
+    return 1;
+  }
+  printf("Wrote %s in %u ms\n", out, SDL_GetTicks() - start);
+  return 0;
+}
+
+// sdl_drums --import-midi <in.mid> <pattern or bank>
+// Into a pattern file, a song longer than one pattern is split into
+// <pattern>_1, <pattern>_2...
+static int ImportMidiCommand(char* argv[]) {
+  std::vector<DrumLoop::Pattern> patterns;
+  int bpm = 120;
+  if (!ReadMidiFile(argv[2], &patterns, &bpm)) {
+    return 1;
+  }
+  if (IsBankFile(argv[3])) {
+    if (!WritePatternBank(argv[3], patterns)) {
+      return 1;
+    }
+    printf("Wrote %i pattern(s) at %i BPM\n", (int)patterns.size(), bpm);
+    return 0;
+  }
+  std::string out = argv[3];
+  std::string ext;
+  size_t dot = out.rfind('.');
+  if (dot != std::string::npos && out.find('/', dot) == std::string::npos) {
+    ext = out.substr(dot);
+    out.resize(dot);
+  }
+  for (size_t i = 0; i < patterns.size(); i++) {
+    std::string file = patterns.size() == 1 ? out + ext :
+                       out + "_" + std::to_string(i + 1) + ext;
+    if (!DrumLoop::WritePatternFile(file.c_str(), &patterns[i])) {
+      printf("Couldn't write %s\n", file.c_str());
+      return 1;
+    }
+  }
+  printf("Wrote %i pattern(s) at %i BPM\n", (int)patterns.size(), bpm);
+  return 0;
+}
+
+// sdl_drums --render <out dir> [--bpm 90,120,...] [--loops N] [--jobs N]
+//           [--kit path] [--tempo step:bpm,...] [pattern, bank or
+//           directory...]
+// Bounces patterns to WAV without opening a window or an audio device. With
+// no inputs everything in ./patterns is rendered. --tempo automates the
+// tempo over all the loops, by steps from the start, ramping from each
+// point to the next.
+static int RenderCommand(int argc, char* argv[]) {
+  RenderOptions options;
+  options.out_dir = argv[2];
+  const char* kit_path = nullptr;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--bpm") == 0 && i + 1 < argc) {
+      for (const char* p = argv[++i]; *p; p++) {
+        int bpm = atoi(p);
+        if (bpm < MIN_BPM || bpm > MAX_BPM) {
+          printf("Bad tempo list %s\n", argv[i]);
+          return 1;
+        }
+        options.bpms.push_back(bpm);
+        p = strchr(p, ',');
+        if (p == nullptr) {
+          break;
+        }
+      }
+    } else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+      options.loops = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      options.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--kit") == 0 && i + 1 < argc) {
+      kit_path = argv[++i];
+    } else if (strcmp(argv[i], "--tempo") == 0 && i + 1 < argc) {
+      for (const char* p = argv[++i]; *p; p++) {
+        int step;
+        float bpm;
+        if (sscanf(p, "%i:%f", &step, &bpm) != 2 || step < 0 ||
+            !AddTempoPoint(&options.tempo, step, bpm)) {
+          printf("Bad tempo automation %s\n", argv[i]);
+          return 1;
+        }
+        p = strchr(p, ',');
+        if (p == nullptr) {
+          break;
+        }
+      }
+    } else {
+      options.inputs.push_back(argv[i]);
+    }
+  }
+  if (options.bpms.empty()) {
+    options.bpms.push_back(120);
+  }
+  if (options.inputs.empty()) {
+    options.inputs.push_back("./patterns");
+  }
+
+  std::vector<std::string> files(samples_files, samples_files + 9);
+  KitSettings settings;
+  if (kit_path != nullptr) {
+    files.clear();
+    if (!SoundData::ListKitFiles(kit_path, &files, &settings)) {
+      printf("Kit %s doesn't have 9 samples\n", kit_path);
+      return 1;
+    }
+  }
+  std::unique_ptr<Kit> kit(SoundData::LoadKit(files, DefaultSampleRate));
+  if (!kit) {
+    return 1;
+  }
+  SetKitSettings(kit.get(), settings, DefaultSampleRate);
+  return BatchRender(options, kit.get()) ? 0 : 1;
+}
+
+// sdl_drums --verify-golden [--update] [--patterns dir] [--golden file]
+// Renders the fixture patterns in golden/patterns offline from the built-in
+// samples and compares them with the golden renders, see VerifyGolden().
+// --update writes the golden file from the current renders instead, after a
+// change that was meant to alter the sound.
+static int VerifyGoldenCommand(int argc, char* argv[]) {
+  bool update = false;
+  const char* pattern_dir = GOLDEN_PATTERN_DIR;
+  const char* golden_file = GOLDEN_FILE;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--update") == 0) {
+      update = true;
+    } else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+      pattern_dir = argv[++i];
+    } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+      golden_file = argv[++i];
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  std::vector<std::string> files(samples_files, samples_files + 9);
+  std::unique_ptr<Kit> kit(SoundData::LoadKit(files, DefaultSampleRate));
+  if (!kit) {
+    return 1;
+  }
+  return VerifyGolden(pattern_dir, golden_file, kit.get(), update) ? 0 : 1;
+}
+
+// One audio callback of the realtime check, what the hooks do minus the
+// parts that need a device.
+template <typename T>
+static void RTCheckCallback(SoundData* sound_data, SnapshotRing<8192>* snapshot,
+                            T* buffer, int frames) {
+  RTScope rt_scope;
+  sound_data->Mix(buffer, frames);
+  sound_data->GetDelayEffect()->ApplyDelay(buffer, frames);
+  snapshot->Write(buffer, frames);
+  sound_data->CallbackDone();
+}
+
+// sdl_drums --rt-check
+// Runs the engine on the built-in samples without a device, in both output
+// formats, while doing what the UI thread does between callbacks: playing,
+// recording, editing the pattern, retuning and changing the delay. Fails if
+// any callback allocated or blocked. Needs a build with RT_CHECK=1 to check
+// anything.
+static int RTCheckCommand() {
+#ifndef SDL_DRUMS_RT_CHECK
+  printf("Built without RT_CHECK, nothing to check\n");
+#endif
+  const int frames = 512;
+  const int callbacks_per_action = 20;
+  std::unique_ptr<SoundData> sound_data = std::make_unique<SoundData>();
+  if (!sound_data->LoadSamples(samples_files)) {
+    return 1;
+  }
+  std::unique_ptr<SnapshotRing<8192>> snapshot =
+    std::make_unique<SnapshotRing<8192>>();
+  DrumLoop drum_loop(sound_data.get(), nullptr);
+  drum_loop.SetBPM(160);
+  DelayEffect* delay = sound_data->GetDelayEffect();
+
+  std::vector<std::function<void()>> actions = {
+    [&] { drum_loop.Euclid(0, 4, 16); },
+    [&] { drum_loop.Euclid(2, 3, 8); },
+    [&] { drum_loop.Start(); },
+    [&] { delay->EnableChannel(0, true); },
+    [&] { drum_loop.SetTrig(4, 6, '1'); },
+    [&] { delay->IncreaseTime(-150); },
+    [&] { sound_data->SetTune(2, 700); },
+    [&] { drum_loop.Rotate(0, 1); },
+    [&] { drum_loop.StartWithRec(); },
+    [&] {
+      sound_data->PlaySample(5);
+      DrumLoop::RecordedHit hit = drum_loop.QuantizeHit(5, SDL_GetTicks());
+      // The same single undoable edit as recording a pad hit.
+      drum_loop.SetTrig(5, hit.step, '1', true, hit.micro);
+    },
+    [&] { delay->IncreaseFeedback(-0.3); },
+    [&] { drum_loop.Undo(); },
+    [&] { drum_loop.Redo(); },
+    [&] { drum_loop.Pause(); },
+    [&] { delay->EnableChannel(0, false); },
+    [&] { drum_loop.Start(); },
+    [&] { sound_data->SetTune(2, 0); },
+    [&] { drum_loop.ClearPattern(); },
+    [&] { drum_loop.Stop(); },
+  };
+
+  int callbacks = 0;
+  for (int format = 0; format < 2; format++) {
+    std::vector<Sint16> s16(frames * 2);
+    std::vector<float> f32(frames * 2);
+    for (const std::function<void()>& action : actions) {
+      action();
+      sound_data->Update();
+      for (int i = 0; i < callbacks_per_action; i++) {
+        if (format == 0) {
+          RTCheckCallback(sound_data.get(), snapshot.get(), s16.data(),
+                          frames);
+        } else {
+          RTCheckCallback(sound_data.get(), snapshot.get(), f32.data(),
+                          frames);
+        }
+        callbacks++;
+      }
+    }
+  }
+  printf("%i callbacks, %i realtime violations\n", callbacks,
+         RTViolations());
+  return RTViolations() == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
-  SDLDrums app;
-  sdl_drums_obj = &app;
+  RTCheckInit();
+  if (argc == 2 && strcmp(argv[1], "--rt-check") == 0) {
+    return RTCheckCommand();
+  }
+  if (argc >= 2 && strcmp(argv[1], "--verify-golden") == 0) {
+    return VerifyGoldenCommand(argc, argv);
+  }
+  if (argc >= 3 && strcmp(argv[1], "--render") == 0) {
+    return RenderCommand(argc, argv);
+  }
+  if (argc >= 3 && strcmp(argv[1], "--export-midi") == 0) {
+    return ExportMidiCommand(argc, argv);
+  }
+  if (argc >= 4 && strcmp(argv[1], "--import-midi") == 0) {
+    return ImportMidiCommand(argv);
+  }
+
+  // sdl_drums [--buffer N] [--adaptive-buffer]
+  int buffer_frames = DEFAULT_BUFFER_FRAMES;
+  bool adaptive_buffer = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+      buffer_frames = atoi(argv[++i]);
+      if (buffer_frames < MIN_BUFFER_FRAMES ||
+          buffer_frames > MAX_BUFFER_FRAMES ||
+          (buffer_frames & (buffer_frames - 1)) != 0) {
+        printf("Buffer must be a power of two from %i to %i frames\n",
+               MIN_BUFFER_FRAMES, MAX_BUFFER_FRAMES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--adaptive-buffer") == 0) {
+      adaptive_buffer = true;
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  SDLDrums app(buffer_frames, adaptive_buffer);
   return app.Run();
 }
@@ -2,12 +2,19 @@
 #define SDL_DRUMS_H
 
 #include <SDL.h>
+#include <atomic>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "sound_button.h"
 #include "control_button.h"
+#include "control_server.h"
+#include "fft.h"
+#include "snapshot_ring.h"
 #include "trig_button.h"
 #include "step_button.h"
+#include "text_renderer.h"
 
 // State of drum machine
 
@@ -19,6 +26,9 @@ const int SOUND_BUTTONS_TOTAL = 9;
 const int STEP_BUTTONS_TOTAL = 8;
 const int STEPS_TOTAL = 32;
 const int TICK_INTERVAL = 10;
+// How long the main loop sleeps when nothing on screen is moving. It only
+// wakes for housekeeping such as finishing a kit switch.
+const int IDLE_INTERVAL = 100;
 
 const int SOUND_BUTTON_WIDTH = 82;
 const int SOUND_BUTTON_HEIGHT = 82;
@@ -29,9 +39,44 @@ const int CONTROL_BUTTON_HEIGHT = 82;
 const int X_MARGIN = 40;
 const int Y_MARGIN = 30;
 
+const int TRIG_PITCH = 27;
+const int PLAYHEAD_WIDTH = 4;
+const int PLAYHEAD_HEIGHT = 3;
+
+// Level meters, one per track plus the master, right of the scope.
+const int METER_COUNT = 10;
+const int METER_WIDTH = 8;
+const int METER_GAP = 4;
+const int METER_HEIGHT = 140;
+const float METER_FLOOR_DB = -48.0f;
+const float METER_FALL_DB_PER_SEC = 24.0f;
+const Uint32 METER_PEAK_HOLD_MS = 1000;
+
+// Spectrum analyzer, shown in the scope area instead of the waveform.
+const int SCOPE_FRAMES = 512;
+const int SPECTRUM_FFT_SIZE = 2048;
+const int SPECTRUM_BARS = 60;
+const float SPECTRUM_MIN_HZ = 30.0f;
+const float SPECTRUM_MAX_HZ = 20000.0f;
+const float SPECTRUM_FLOOR_DB = -90.0f;
+const float SPECTRUM_FALL_DB = 3.0f;
+const Uint32 SPECTRUM_INTERVAL_MS = 33;
+
+// Audio device buffer in frames. The adaptive buffer stays within the
+// bounds, goes up right after a glitch and tries going down again after
+// BUFFER_STABLE_MS without one.
+const int DEFAULT_BUFFER_FRAMES = 512;
+const int MIN_BUFFER_FRAMES = 128;
+const int MAX_BUFFER_FRAMES = 4096;
+const Uint32 AUDIO_CHECK_MS = 1000;
+const Uint32 BUFFER_STABLE_MS = 30000;
+
 class SDLDrums {
  public:
-  SDLDrums();
+  // |adaptive_buffer| lets the buffer grow when the audio glitches and
+  // shrink back when it doesn't.
+  SDLDrums(int buffer_frames = DEFAULT_BUFFER_FRAMES,
+           bool adaptive_buffer = false);
   ~SDLDrums();
   int Run();
 
@@ -39,6 +84,13 @@ class SDLDrums {
   const int INIT_FAILED = 1;
 
   bool InitSDL();
+  bool OpenAudio(bool negotiate);
+  void InstallAudioHooks();
+  // Closes the device and opens it again with |buffer_frames|, or the old
+  // buffer if that fails. Only the UI thread.
+  bool ReopenAudio(int buffer_frames);
+  void CheckAudio();
+  void PrintAudioStats();
   int InitAllSurfaces(SDL_Surface* screen);
   void CloseProgram();
 
@@ -46,24 +98,46 @@ class SDLDrums {
   bool LoadTrigButtonImgs(SDL_Surface* screen);
   bool LoadStepButtonImgs(SDL_Surface* screen);
   bool LoadDigits(SDL_Surface* screen);
-  bool UpdateTrigsFromPattern(DrumLoop::Pattern* p);
-  bool ClearAndUpdateTrigs();
   bool UpdateTrigs();
+  bool RefreshTrigs();
+  bool HandlePatternKeys(const SDL_Keysym& key);
+  bool MovePlayhead(int step);
+  bool UpdatePlayhead();
 
   void DrawBPM(SDL_Surface* surface, SDL_Rect rect, int bpm);
   void InitBPMButtons();
   bool HandleBPM(SDL_Event* e);
 
   bool HandleEditButtons(SDL_Event* e);
-  void ApplyUndoAction(DrumLoop::UndoAction action, bool undo);
+  void ApplyUndoAction(DrumLoop::UndoAction action);
 
-  void MixFunc(void* udata, Uint8* stream, int len);
+  // Postmix on the audio thread: delay and the snapshot the scope and the
+  // spectrum are drawn from.
+  template <typename T>
+  void MixFunc(T* stream, int frames);
   void InitDrumTriggersArea();
   void DrawDelayFXArea();
   bool HandleDelay(SDL_Event* e);
   void DrawDelayTimeValue();
   void DrawDelayFeedbackValue();
 
+  void FindKits();
+  void NextKit();
+
+  void ExportMidi();
+  bool ImportMidi(const char* file);
+
+  bool HandleControlCommands();
+
+  void InitMeters();
+  bool UpdateMeters();
+  Uint32 FrameInterval();
+
+  bool UpdateScope();
+  void InitSpectrum();
+  void ToggleSpectrum();
+  bool UpdateSpectrum();
+
  private:
   SDL_Keycode sound_button_keys[SOUND_BUTTONS_TOTAL] = {
     SDLK_z, SDLK_x, SDLK_c,
@@ -71,11 +145,76 @@ class SDLDrums {
     SDLK_q, SDLK_w, SDLK_e
   };
   SoundData sound_data;
+  // The device takes float samples, otherwise S16.
+  bool float_output_ = false;
+  int buffer_frames_;
+  bool adaptive_buffer_;
+  SDL_Surface* scope_ = nullptr;
+  Uint32 audio_checked_ = 0;
+  // Underruns plus overloads as of the last check.
+  Uint32 audio_glitches_ = 0;
+  Uint32 audio_stable_since_ = 0;
+  // Largest buffer that glitched, the adaptive buffer stays above it.
+  int glitched_frames_ = 0;
   std::unique_ptr<DrumLoop> drum_loop;
+  ControlServer control_server_;
   SDL_Rect bpm_indicator_rect_;
   SDL_Rect delay_area_rect_;
 
+  SDL_Rect meters_rect_;
+  Uint32 meters_updated_ = 0;
+  // All meters are down at the floor.
+  bool meters_idle_ = true;
+  // When the last event came in. Input usually leads to sound, so the loop
+  // keeps its full frame rate for a while after it, until the meters move.
+  Uint32 input_time_ = 0;
+
+  // Button blits per presented frame, printed with the 'b' key.
+  struct BlitStats {
+    int frames = 0;
+    int blits = 0;
+    int max = 0;
+    // Blits since the last presented frame.
+    int pending = 0;
+  } blit_stats_;
+  // In dB, RMS for the bar and the held peak
+  float meter_level_[METER_COUNT];
+  float meter_hold_[METER_COUNT];
+  Uint32 meter_hold_until_[METER_COUNT];
+  // What is on screen, in pixels
+  int meter_bar_px_[METER_COUNT];
+  int meter_hold_px_[METER_COUNT];
+
+  // Written by MixFunc, read by UpdateScope and UpdateSpectrum.
+  SnapshotRing<8192> snapshot_;
+  float scope_samples_[SCOPE_FRAMES];
+  // Frames written to the snapshot when the scope was last drawn.
+  Uint64 scope_written_ = 0;
+  std::atomic<bool> spectrum_mode_{false};
+  Uint32 spectrum_updated_ = 0;
+  RealFFT fft_;
+  std::vector<float> spectrum_input_;
+  std::vector<float> spectrum_power_;
+  // FFT bins [spectrum_bins_[i], spectrum_bins_[i + 1]) make up bar i.
+  int spectrum_bins_[SPECTRUM_BARS + 1];
+  float spectrum_db_[SPECTRUM_BARS];
+
+  std::vector<std::string> kit_paths_;
+  // Index into kit_paths_, -1 while playing the built-in samples_files.
+  int current_kit_ = -1;
+
   std::unique_ptr<SoundButton> sound_buttons[SOUND_BUTTONS_TOTAL];
+  TrigSprites trig_sprites_;
+  // Track of the last pad played, what bulk pattern edits work on.
+  int selected_track_ = 0;
+  // DrumLoop::LockParam the parameter lock keys edit.
+  int lock_param_ = DrumLoop::LockVolume;
+  // Column the trig grid currently shows the playhead on.
+  int shown_step_ = DrumLoop::STOPPED;
+  // Left edge of each step's column, and the marker under the grid that
+  // follows the heard position between steps.
+  int step_x_[STEPS_TOTAL];
+  SDL_Rect playhead_rect_;
   std::unique_ptr<TrigButton> trig_buttons[SOUND_BUTTONS_TOTAL][STEPS_TOTAL];
   std::unique_ptr<StepButton> step_buttons[STEP_BUTTONS_TOTAL];
 
@@ -105,6 +244,14 @@ class SDLDrums {
   SDL_Surface* trig_button_icons[SOUND_BUTTONS_TOTAL];
   SDL_Surface* step_button_icons[STEP_BUTTONS_TOTAL];
   SDL_Surface* digit_imgs[10];
+  // Readouts are drawn with these when a font could be opened, otherwise
+  // with digit_imgs and fx1_delay_digits_surface.
+  TextRenderer bpm_text_;
+  TextRenderer delay_text_;
+  // What each readout shows now, redrawing the same value is skipped.
+  NumberReadout bpm_readout_{0, 3};
+  NumberReadout delay_time_readout_;
+  NumberReadout delay_feedback_readout_{1};
 
   SDL_Surface* play_button_inactive_surface;
   SDL_Surface* play_button_active_surface;
@@ -156,6 +303,9 @@ const char* samples_files[] = {
   "./samples/Handclap_Viscount_04.wav"
 };
 
+// Each entry is a kit manifest or a directory of WAV files
+const char* kits_dir = "./kits";
+
 const char* sound_buttons_active_files[] = {
   "./images/sound_buttons/button01_active_c.png",
   "./images/sound_buttons/button02_active_c.png",
@@ -216,6 +366,22 @@ const char* digit_files[] = {
   "./images/digits/9.png",
 };
 
+// Tried in order for the readouts, the first one found is used.
+const char* readout_font_files[] = {
+  "./fonts/readout.ttf",
+#ifdef _WIN32
+  "C:\\Windows\\Fonts\\consolab.ttf",
+#else
+  "/usr/share/fonts/truetype/dejavu/DejaVuSansMono-Bold.ttf",
+  "/usr/share/fonts/TTF/DejaVuSansMono-Bold.ttf",
+#endif
+};
+const int READOUT_FONTS_TOTAL =
+  sizeof(readout_font_files) / sizeof(readout_font_files[0]);
+// Sizes that match the height of the digit images.
+const int BPM_FONT_SIZE = 44;
+const int DELAY_FONT_SIZE = 14;
+
 const char* fx1_on_file = "./images/icons_25/fx1_on.png";
 const char* fx1_off_file = "./images/icons_25/fx1_off.png";
 
@@ -241,6 +407,8 @@ const char* redo_button_inactive_file = "./images/edit_buttons/redo_button5_inac
 const char* clear_button_inactive_file = "./images/edit_buttons/clear_button5_inactive.png";
 const char* export_button_inactive_file = "./images/edit_buttons/export_button5_inactive.png";
 const char* export_button_toggled_file = "./images/edit_buttons/export_button5_toggled.png";
+const char* midi_export_file = "./patterns/main.mid";
+const char* control_socket_file = CONTROL_SOCKET_FILE;
 
 const char* bpm_up_10_inactive_file = "./images/bpm/bpm_up_10_inactive.png";
 const char* bpm_up_10_active_file = "./images/bpm/bpm_up_10_active.png";
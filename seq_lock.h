@@ -0,0 +1,37 @@
+#ifndef SEQ_LOCK_H
+#define SEQ_LOCK_H
+
+#include <atomic>
+
+// Publishes a small struct from one writer thread (usually the audio thread)
+// to any number of readers. The writer never waits; readers retry if they
+// raced with a write.
+template <typename T>
+class SeqLock {
+ public:
+  void Store(const T& value) {
+    unsigned seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    value_ = value;
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  T Load() const {
+    T value;
+    unsigned before, after;
+    do {
+      before = seq_.load(std::memory_order_acquire);
+      value = value_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq_.load(std::memory_order_relaxed);
+    } while (before != after || (before & 1));
+    return value;
+  }
+
+ private:
+  std::atomic<unsigned> seq_{0};
+  T value_{};
+};
+
+#endif  // SEQ_LOCK_H
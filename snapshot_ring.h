@@ -0,0 +1,64 @@
+#ifndef SNAPSHOT_RING_H
+#define SNAPSHOT_RING_H
+
+#include <SDL.h>
+
+#include <atomic>
+
+// The last |N| frames of the output as mono floats, for views that analyse
+// the audio on the UI thread. The audio thread appends every callback and
+// never waits. Readers copy the newest frames and retry if the writer went
+// round the ring over them in the meantime, like SeqLock does.
+// |N| must be a power of two.
+template <int N>
+class SnapshotRing {
+ public:
+  // Audio thread only. |stereo| holds |frames| interleaved S16 or float
+  // frames.
+  template <typename T>
+  void Write(const T* stereo, int frames) {
+    Uint64 pos = written_.load(std::memory_order_relaxed);
+    for (int i = 0; i < frames; i++) {
+      samples_[(pos + i) & (N - 1)] =
+        (stereo[2 * i] + stereo[2 * i + 1]) * (0.5f * Scale(stereo));
+    }
+    written_.store(pos + frames, std::memory_order_release);
+  }
+
+  // Frames written so far.
+  Uint64 Written() const { return written_.load(std::memory_order_acquire); }
+
+  // Copies the newest |count| frames to |out|, oldest first. False until
+  // that many have been written.
+  bool Read(float* out, int count) const {
+    if (count > N) {
+      return false;
+    }
+    for (;;) {
+      Uint64 end = written_.load(std::memory_order_acquire);
+      if (end < (Uint64)count) {
+        return false;
+      }
+      Uint64 start = end - count;
+      for (int i = 0; i < count; i++) {
+        out[i] = samples_[(start + i) & (N - 1)];
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (written_.load(std::memory_order_relaxed) - start <= (Uint64)N) {
+        return true;
+      }
+    }
+  }
+
+ private:
+  static_assert((N & (N - 1)) == 0, "SnapshotRing size must be a power of two");
+
+  // Full scale of each sample type.
+  static constexpr float Scale(const Sint16*) { return 1.0f / 32768.0f; }
+  static constexpr float Scale(const float*) { return 1.0f; }
+
+  float samples_[N] = {};
+  std::atomic<Uint64> written_{0};
+};
+
+#endif  // SNAPSHOT_RING_H
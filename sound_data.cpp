@@ -1,107 +1,111 @@
 #include "sound_data.h"
 
 #include <stdio.h>
+#include <string.h>
 
-DelayEffect::DelayEffect() {
-  for (int i = 0; i < 9; i++) {
-    channel_enabled_[i] = false;
-  }
-  for (int i = 0; i < MaxBufferLength; i++) {
-    delay_buffer_[i] = 0;
-  }
-  DelayLength = (4 * SampleRate * milliseconds_) / 1000;
-}
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 
-DelayEffect::~DelayEffect() {
-  printf("~DelayEffect\n");
-}
+#include "resampler.h"
+namespace {
 
-void DelayEffect::AddToBuffer(Mix_Chunk* chunk) {
-  int nsamples = (2*SampleRate * milliseconds_) / 1000;
-  Sint16* chunk16 = (Sint16*)chunk->abuf;
-  Sint16* delay16 = (Sint16*)delay_buffer_;
-  int idx = buffer_index_;
+// The delay comes back in at 90% of full volume.
+const int DelayMixVolume = SDL_MIX_MAXVOLUME * 9 / 10;
 
-  if (chunk->alen < 2) {
-    return;
-  }
-
-  Uint16 format;
-  int channels;
-  Mix_QuerySpec(NULL, &format, &channels);
-
-  Uint8* tmp_delay = chunk->alen > sizeof(Uint8) * nsamples * 4 ?
-        (Uint8*)malloc(chunk->alen) :
-        (Uint8*)malloc(sizeof(Uint8)* nsamples*4);
-
-  for (int i = 0; i < nsamples*2; i++) {
-    tmp_delay[i] = *(delay_buffer_ + ((buffer_index_ + nsamples * 4 + i) % (DelayLength)));
-  }
+// Output sample conversions, one overload per device format so the
+// templates below never branch on it. |s| is already clamped to S16 range.
+inline void StoreSample(Sint16* out, Sint32 s) {
+  *out = (Sint16)s;
+}
 
-  SDL_MixAudioFormat(tmp_delay, chunk->abuf, format, chunk->alen, SDL_MIX_MAXVOLUME*0.9);
+inline void StoreSample(float* out, Sint32 s) {
+  *out = s * (1.0f / 32768.0f);
+}
 
-  for (int i = 0; i < nsamples*2; i++) {
-    *(delay_buffer_ + ((buffer_index_ + nsamples * 4 + i) % (DelayLength))) = tmp_delay[i];
-  }
+// Adds a delay line sample |d| like SDL_MixAudioFormat at DelayMixVolume.
+inline void AddDelay(Sint16* out, Sint32 d) {
+  Sint32 s = *out + d * DelayMixVolume / SDL_MIX_MAXVOLUME;
+  *out = s > 32767 ? 32767 : (s < -32768 ? -32768 : (Sint16)s);
+}
 
-  free(tmp_delay);
+inline void AddDelay(float* out, Sint32 d) {
+  float s = *out + d * (DelayMixVolume / (SDL_MIX_MAXVOLUME * 32768.0f));
+  *out = s > 1.0f ? 1.0f : (s < -1.0f ? -1.0f : s);
 }
 
-void DelayEffect::ApplyDelay(Uint8* stream, int len) {
-  Sint16* stream16 = (Sint16*)stream;
-  Sint16* delay16 = (Sint16*)delay_buffer_;
-  int idx = buffer_index_;
+}  // namespace
 
-  if (len < 2) {
-    return;
+DelayEffect::DelayEffect() {
+  for (int i = 0; i < 9; i++) {
+    channel_enabled_[i] = false;
   }
+  Init(DefaultSampleRate);
+}
 
-  Uint16 format;
-  int channels;
-  Mix_QuerySpec(NULL, &format, &channels);
-  Uint8* delay_tmp = (Uint8*)malloc(sizeof(Uint8)*len);
+void DelayEffect::Init(int sample_rate) {
+  sample_rate_ = sample_rate;
+  buffer_.assign((size_t)sample_rate * MaxDelayMs / 1000 * 2, 0);
+  length_ = sample_rate_ * milliseconds_ / 1000;
+  index_ = 0;
+}
 
-  for (int i = 0; i < len-1; i+=2) {
-    delay_tmp[i] = *(delay_buffer_ + ((buffer_index_ + i) % DelayLength));
-    delay_tmp[i+1] = *(delay_buffer_ + ((buffer_index_ + i+1) % DelayLength));
-    ((Sint16*)delay_tmp)[i/2] *= feedback_;
-    ((Sint16*)delay_tmp)[i/2+1] *= feedback_;
+void DelayEffect::Send(const Sint32* frames, int count, int offset) {
+  int length = length_.load(std::memory_order_relaxed);
+  int idx = (index_ + offset) % length * 2;
+  for (int i = 0; i < count * 2; i++) {
+    Sint32 s = buffer_[idx] + (Sint32)(frames[i] * 0.9f);
+    buffer_[idx] = s > 32767 ? 32767 : (s < -32768 ? -32768 : (Sint16)s);
+    if (++idx >= length * 2) {
+      idx = 0;
+    }
   }
+}
 
-  SDL_MixAudioFormat(stream, delay_tmp, format, len, SDL_MIX_MAXVOLUME*0.9);
-
-  for (int i = 0; i < len; i++) {
-    *(delay_buffer_ + ((buffer_index_ + i) % DelayLength)) = delay_tmp[i];
+// Each pass through the line scales it by the feedback.
+template <typename T>
+void DelayEffect::ApplyDelay(T* stream, int frames) {
+  int length = length_.load(std::memory_order_relaxed);
+  float feedback = feedback_.load(std::memory_order_relaxed);
+  index_ %= length;
+  int idx = index_ * 2;
+  for (int i = 0; i < frames * 2; i++) {
+    Sint16 d = (Sint16)(buffer_[idx] * feedback);
+    AddDelay(&stream[i], d);
+    buffer_[idx] = d;
+    if (++idx >= length * 2) {
+      idx = 0;
+    }
   }
-
-  AdvanceBuffer(len);
-  free(delay_tmp);
+  index_ = (index_ + frames) % length;
 }
 
-void DelayEffect::AdvanceBuffer(int len) {
-  buffer_index_ += len;
-  buffer_index_ %= DelayLength;
+template void DelayEffect::ApplyDelay<Sint16>(Sint16* stream, int frames);
+template void DelayEffect::ApplyDelay<float>(float* stream, int frames);
+
+void DelayEffect::AdvanceBuffer(int frames) {
+  index_ = (index_ + frames) % length_.load(std::memory_order_relaxed);
 }
 
 void DelayEffect::IncreaseTime(int milliseconds) {
-  if (milliseconds_ + milliseconds > 1000)
-     milliseconds_ = 1000;
+  if (milliseconds_ + milliseconds > MaxDelayMs)
+     milliseconds_ = MaxDelayMs;
   else if (milliseconds_ + milliseconds < 20) {
     milliseconds_ = 20;
   } else {
     milliseconds_ += milliseconds;
   }
-  DelayLength = (4 * SampleRate * milliseconds_) / 1000;
+  length_ = sample_rate_ * milliseconds_ / 1000;
 }
 
 void DelayEffect::IncreaseFeedback(double amount) {
-  if (feedback_ + amount > 1.0) {
-    feedback_ = 1.0;
-  } else if (feedback_ + amount <= 0) {
-    feedback_ = 0.0;
-  } else {
-    feedback_ += amount;
+  double feedback = feedback_.load(std::memory_order_relaxed) + amount;
+  if (feedback > 1.0) {
+    feedback = 1.0;
+  } else if (feedback <= 0) {
+    feedback = 0.0;
   }
+  feedback_.store((float)feedback, std::memory_order_relaxed);
 }
 
 void DelayEffect::EnableChannel(int ch, bool enabled) {
@@ -114,32 +118,416 @@ bool DelayEffect::ChannelEnabled(int channel) {
 
 SoundData::SoundData() {
   delay_effect_ = std::make_unique<DelayEffect>();
+  for (int i = 0; i < 9; i++) {
+    idle_[i] = false;
+  }
 }
 
 SoundData::~SoundData() {
-  for (unsigned i = 0; i < 9; i++) {
-    Mix_FreeChunk(samples_[i]);
+  if (loader_thread_ != nullptr) {
+    SDL_WaitThread(loader_thread_, NULL);
   }
+  delete loaded_kit_.load();
+  if (!shared_kit_) {
+    delete kit_.load();
+  }
+  for (Kit* kit : retired_kits_) {
+    delete kit;
+  }
+  for (TunedSample* tuned : retired_tuned_) {
+    delete tuned;
+  }
+}
+
+static int StaticKitLoaderFunc(void* sound_data_object) {
+  return ((SoundData*)sound_data_object)->KitLoaderFunc();
+}
+
+void SoundData::SetSampleRate(int sample_rate) {
+  sample_rate_ = sample_rate;
+  voice_pool_.SetSampleRate(sample_rate);
+  delay_effect_->Init(sample_rate);
 }
 
 bool SoundData::LoadSamples(const char** files) {
+  std::vector<std::string> list(files, files + 9);
+  Kit* kit = LoadKit(list, sample_rate_);
+  if (kit == nullptr) {
+    return false;
+  }
+  kit->name = "default";
+  PublishKit(kit);
+  return true;
+}
+
+void SoundData::SetSharedKit(Kit* kit) {
+  kit_ = kit;
+  shared_kit_ = true;
+}
+
+Kit* SoundData::LoadKit(const std::vector<std::string>& files,
+                        int sample_rate) {
+  if (files.size() < 9) {
+    printf("A kit needs 9 samples, got %i\n", (int)files.size());
+    return nullptr;
+  }
+  Kit* kit = new Kit;
   for (unsigned i = 0; i < 9; i++) {
-    samples_[i] = Mix_LoadWAV(files[i]);
-    if (samples_[i] == NULL) {
-      printf("Failed to load sound %s: %s\n", files[i], Mix_GetError());
-      return false;
+    if (!kit->samples[i].Open(files[i].c_str(), sample_rate)) {
+      printf("Failed to load sound %s: %s\n", files[i].c_str(),
+             Mix_GetError());
+      delete kit;
+      return nullptr;
+    }
+    // Starts readahead of the mapped file without making it resident.
+    kit->samples[i].Prefetch();
+  }
+  return kit;
+}
+
+bool SoundData::ListKitFiles(const char* path,
+                             std::vector<std::string>* files,
+                             KitSettings* settings) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+
+  if (fs::is_directory(path, ec)) {
+    for (const fs::directory_entry& entry : fs::directory_iterator(path, ec)) {
+      std::string ext = entry.path().extension().string();
+      if (entry.is_regular_file(ec) && (ext == ".wav" || ext == ".WAV")) {
+        files->push_back(entry.path().string());
+      }
+    }
+    std::sort(files->begin(), files->end());
+    return files->size() >= 9;
+  }
+
+  std::fstream stream;
+  stream.open(path, std::ios_base::in);
+  if (!stream.is_open()) {
+    printf("Couldn't open kit %s\n", path);
+    return false;
+  }
+  // Paths in a manifest are relative to the manifest itself.
+  fs::path dir = fs::path(path).parent_path();
+  std::string line;
+  while (std::getline(stream, line)) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
     }
+    if (line.compare(0, 6, "steal=") == 0) {
+      settings->steal_policy = line.compare(6, std::string::npos, "quietest") == 0
+                                   ? StealQuietest : StealOldest;
+      continue;
+    }
+
+    // Trailing key=value options apply to this line's track.
+    int track = (int)files->size();
+    size_t space;
+    while ((space = line.find_last_of(' ')) != std::string::npos &&
+           line.find('=', space) != std::string::npos) {
+      std::string option = line.substr(space + 1);
+      int value = atoi(option.c_str() + option.find('=') + 1);
+      if (track < 9 && option.compare(0, 5, "poly=") == 0) {
+        settings->polyphony[track] = value < 1 ? 1 : value;
+      } else if (track < 9 && option.compare(0, 6, "choke=") == 0) {
+        settings->choke_group[track] = value;
+      } else if (track < 9 && option.compare(0, 6, "start=") == 0) {
+        settings->start_ms[track] = value;
+      } else if (track < 9 && option.compare(0, 4, "end=") == 0) {
+        settings->end_ms[track] = value;
+      } else if (track < 9 && option.compare(0, 8, "reverse=") == 0) {
+        settings->reverse[track] = value != 0;
+      } else if (track < 9 && option.compare(0, 7, "attack=") == 0) {
+        settings->attack_ms[track] = value;
+      } else if (track < 9 && option.compare(0, 5, "hold=") == 0) {
+        settings->hold_ms[track] = value;
+      } else if (track < 9 && option.compare(0, 6, "decay=") == 0) {
+        settings->decay_ms[track] = value;
+      }
+      line.erase(space);
+      while (!line.empty() && line.back() == ' ') {
+        line.pop_back();
+      }
+    }
+    fs::path file(line);
+    files->push_back(file.is_absolute() ? line : (dir / file).string());
+  }
+  return files->size() >= 9;
+}
+
+bool SoundData::LoadKitAsync(const char* path) {
+  if (loading_) {
+    return false;
+  }
+  if (loader_thread_ != nullptr) {
+    SDL_WaitThread(loader_thread_, NULL);
+  }
+  loading_ = true;
+  loader_path_ = path;
+  loader_thread_ = SDL_CreateThread(StaticKitLoaderFunc, "KitLoader", this);
+  if (loader_thread_ == nullptr) {
+    loading_ = false;
+    return false;
   }
   return true;
 }
 
-void SoundData::PlaySample(int n) {
-  if (delay_effect_->ChannelEnabled(n)) {
-    delay_effect_->AddToBuffer(samples_[n]);
+int SoundData::KitLoaderFunc() {
+  std::vector<std::string> files;
+  KitSettings settings;
+  Kit* kit = nullptr;
+  if (ListKitFiles(loader_path_.c_str(), &files, &settings)) {
+    kit = LoadKit(files, sample_rate_);
+  } else {
+    printf("Kit %s doesn't have 9 samples\n", loader_path_.c_str());
+  }
+  if (kit != nullptr) {
+    kit->name = loader_path_;
+    SetKitSettings(kit, settings, sample_rate_);
+    loaded_kit_ = kit;
+  }
+  loading_ = false;
+  return 0;
+}
+
+const char* SoundData::KitName() {
+  Kit* kit = kit_.load();
+  return kit != nullptr ? kit->name.c_str() : "";
+}
+
+void SoundData::PublishKit(Kit* kit) {
+  Kit* old = kit_.exchange(kit, std::memory_order_acq_rel);
+  if (old != nullptr) {
+    old->retired_at = mix_count_.load(std::memory_order_acquire);
+    retired_kits_.push_back(old);
+  }
+}
+
+// A retired kit can go once the audio thread has finished the callback that
+// might still have been reading the old pointer, and no voice plays from it.
+void SoundData::CollectRetiredKits() {
+  Uint32 mixed = mix_count_.load(std::memory_order_acquire);
+  for (size_t i = 0; i < retired_kits_.size();) {
+    Kit* kit = retired_kits_[i];
+    if (mixed != kit->retired_at &&
+        kit->voices.load(std::memory_order_acquire) == 0) {
+      delete kit;
+      retired_kits_[i] = retired_kits_.back();
+      retired_kits_.pop_back();
+    } else {
+      i++;
+    }
+  }
+  for (size_t i = 0; i < retired_tuned_.size();) {
+    TunedSample* tuned = retired_tuned_[i];
+    if (mixed != tuned->retired_at &&
+        tuned->voices.load(std::memory_order_acquire) == 0) {
+      delete tuned;
+      retired_tuned_[i] = retired_tuned_.back();
+      retired_tuned_.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
+bool SoundData::SetTune(int track, int cents) {
+  if (cents > MaxTuneCents) {
+    cents = MaxTuneCents;
+  } else if (cents < -MaxTuneCents) {
+    cents = -MaxTuneCents;
+  }
+  if (cents == tune_[track]) {
+    return false;
+  }
+  tune_[track] = cents;
+  Kit* kit = kit_.load(std::memory_order_acquire);
+  if (kit != nullptr && !shared_kit_) {
+    RetuneTrack(kit, track);
+  }
+  return true;
+}
+
+// Swaps in |track|'s sample at its current tune. Voices already playing
+// finish on the copy they started with.
+void SoundData::RetuneTrack(Kit* kit, int track) {
+  TunedSample* tuned = nullptr;
+  if (tune_[track] != 0) {
+    tuned = new TunedSample;
+    TuneSample(kit->samples[track], tune_[track], &tuned->frames);
+  }
+  TunedSample* old = kit->tuned[track].exchange(tuned,
+                                                std::memory_order_acq_rel);
+  if (old != nullptr) {
+    old->retired_at = mix_count_.load(std::memory_order_acquire);
+    retired_tuned_.push_back(old);
+  }
+}
+
+void SoundData::Update() {
+  Kit* loaded = loaded_kit_.exchange(nullptr);
+  if (loaded != nullptr) {
+    // Tuned before the audio thread can start a voice on it.
+    for (int i = 0; i < 9; i++) {
+      if (tune_[i] != 0) {
+        RetuneTrack(loaded, i);
+      }
+    }
+    PublishKit(loaded);
+    printf("Switched to kit %s\n", loaded->name.c_str());
+  }
+  CollectRetiredKits();
+
+  Kit* kit = kit_.load(std::memory_order_acquire);
+  if (kit == nullptr) {
+    return;
+  }
+  for (int i = 0; i < 9; i++) {
+    if (idle_[i].exchange(false) && kit->samples[i].Streaming()) {
+      kit->samples[i].Release();
+    }
+  }
+}
+
+bool SoundData::PlaySample(int n) {
+  if (!triggers_.Push(n)) {
+    printf("Trigger queue full, dropping hit on track %i\n", n);
+    return false;
+  }
+  return true;
+}
+
+void SoundData::SetSequencer(SequencerFunc func, void* data) {
+  sequencer_ = func;
+  sequencer_data_ = data;
+}
+
+Sint64 SoundData::FrameAtTicks(Uint32 ticks) {
+  ClockAnchor anchor = clock_anchor_.Load();
+  Sint32 ms = (Sint32)(ticks - anchor.ticks);
+  return (Sint64)anchor.frame - latency_frames_ +
+         (Sint64)ms * sample_rate_ / 1000;
+}
+
+template <typename T>
+void SoundData::Mix(T* out, int frames) {
+  monitor_.CallbackStart(frames, sample_rate_);
+  Kit* kit = kit_.load(std::memory_order_acquire);
+  clock_anchor_.Store({ frame_clock_, SDL_GetTicks() });
+
+  int trigger;
+  while (triggers_.Pop(&trigger)) {
+    voice_pool_.Start(kit, trigger);
+  }
+
+  bool send[9];
+  for (int i = 0; i < 9; i++) {
+    send[i] = delay_effect_->ChannelEnabled(i);
   }
-  Mix_PlayChannel(n, samples_[n], 0);
+
+  int offset = 0;
+
+  TrackLevels levels;
+  memset(&levels, 0, sizeof(levels));
+  Sint32 master_peak = 0;
+  Sint64 master_energy = 0;
+
+  while (offset < frames) {
+    int block = frames - offset < MixBlockFrames ? frames - offset
+                                                 : MixBlockFrames;
+    memset(mix_buffer_, 0, sizeof(Sint32) * block * 2);
+    memset(send_buffer_, 0, sizeof(Sint32) * block * 2);
+
+    int nhits = 0;
+    if (sequencer_ != nullptr) {
+      nhits = sequencer_(sequencer_data_, frame_clock_, block, hits_,
+                         MaxBlockHits);
+      // Few hits per block, insertion sort by offset.
+      for (int i = 1; i < nhits; i++) {
+        Hit hit = hits_[i];
+        int j = i - 1;
+        for (; j >= 0 && hits_[j].offset > hit.offset; j--) {
+          hits_[j + 1] = hits_[j];
+        }
+        hits_[j + 1] = hit;
+      }
+    }
+
+    // Render up to each hit, then start its voice, so hits and the chokes
+    // they cause land on the exact frame.
+    int finished = 0;
+    int start = 0;
+    for (int h = 0; h <= nhits; h++) {
+      int end = h < nhits ? hits_[h].offset : block;
+      if (end > start) {
+        finished |= voice_pool_.Render(mix_buffer_ + start * 2,
+                                       send_buffer_ + start * 2, send,
+                                       &levels, end - start);
+        start = end;
+      }
+      if (h < nhits) {
+        voice_pool_.Start(kit, hits_[h].track, hits_[h].params);
+      }
+    }
+    for (int i = 0; i < 9; i++) {
+      if (finished & (1 << i)) {
+        idle_[i] = true;
+      }
+    }
+
+    delay_effect_->Send(send_buffer_, block, offset);
+    // The master peak is taken before clamping, so a clipped block reads as
+    // full scale.
+    Sint32 high = 0;
+    Sint32 low = 0;
+    for (int j = 0; j < block * 2; j++) {
+      Sint32 s = mix_buffer_[j];
+      high = s > high ? s : high;
+      low = s < low ? s : low;
+      s = s > 32767 ? 32767 : (s < -32768 ? -32768 : s);
+      mix_buffer_[j] = s;
+      StoreSample(&out[j], s);
+    }
+    high = high > -low ? high : -low;
+    master_peak = high > master_peak ? high : master_peak;
+    // Strided like the tracks in VoicePool::Render.
+    Sint32 energy = 0;
+    for (int j = 0; j < block * 2; j += LevelStride * 2) {
+      Sint32 l = mix_buffer_[j] >> LevelShift;
+      Sint32 r = mix_buffer_[j + 1] >> LevelShift;
+      energy += l * l + r * r;
+    }
+    master_energy += energy;
+    out += block * 2;
+    offset += block;
+    frame_clock_ += block;
+  }
+
+  const float scale = 1.0f / 32768.0f;
+  // Both sides of one frame in LevelStride were summed, so one sample in
+  // LevelStride.
+  const float energy_scale = frames > 0 ? scale * scale * LevelStride *
+                             (1 << (2 * LevelShift)) / (frames * 2) : 0.0f;
+  for (int i = 0; i < 9; i++) {
+    levels_[i].peak.store(levels.peak[i] * scale, std::memory_order_relaxed);
+    levels_[i].mean_square.store(levels.energy[i] * energy_scale,
+                                 std::memory_order_relaxed);
+  }
+  master_peak = master_peak < 32768 ? master_peak : 32768;
+  levels_[MasterLevel].peak.store(master_peak * scale,
+                                  std::memory_order_relaxed);
+  levels_[MasterLevel].mean_square.store(master_energy * energy_scale,
+                                         std::memory_order_relaxed);
+  mix_count_.fetch_add(1, std::memory_order_release);
 }
 
+template void SoundData::Mix<Sint16>(Sint16* out, int frames);
+template void SoundData::Mix<float>(float* out, int frames);
+
 void SoundData::PlaySampleFromKeycode(SDL_Keycode key) {
   int n = 0;
   switch (key) {
@@ -156,6 +544,6 @@ void SoundData::PlaySampleFromKeycode(SDL_Keycode key) {
   PlaySample(n);
 }
 
-void SoundData::AdvanceDelayBuffer(int len) {
-  delay_effect_->AdvanceBuffer(len);
+void SoundData::AdvanceDelayBuffer(int frames) {
+  delay_effect_->AdvanceBuffer(frames);
 }
@@ -8,33 +8,82 @@
 #include <SDL_mixer.h>
 #endif
 
+#include <atomic>
 #include <memory>
+#include <string>
+#include <vector>
 
-const int SampleRate = 44100;
-const int MaxBufferLength = 8*SampleRate;
+#include "audio_monitor.h"
+#include "event_queue.h"
+#include "sample_source.h"
+#include "seq_lock.h"
+#include "voice_pool.h"
+
+// Rate of the engine when there's no device to ask, e.g. batch rendering.
+// The app runs at whatever rate the device was opened with.
+const int DefaultSampleRate = 44100;
+const int MaxDelayMs = 1000;
+// Frames mixed per pass of the voice loop, whatever the device buffer size.
+const int MixBlockFrames = 256;
+
+// A sequencer hit, |offset| frames into the block being rendered.
+struct Hit {
+  int track;
+  int offset;
+  // Velocity and parameter locks of the step.
+  HitParams params;
+};
+const int MaxBlockHits = 64;
+
+// Called on the audio thread before each block of at most MixBlockFrames
+// frames, starting at frame |frame| of the audio clock. Fills |hits| with the
+// hits that fall inside the block and returns how many there are.
+typedef int (*SequencerFunc)(void* data, Uint64 frame, int frames, Hit* hits,
+                             int max_hits);
+
+// Level of one track or the master output over the last audio callback,
+// 1.0 being full scale. Written by the audio thread with relaxed stores and
+// readable from any thread; the two values may come from different
+// callbacks.
+struct LevelMeter {
+  std::atomic<float> peak{0.0f};
+  std::atomic<float> mean_square{0.0f};
+};
+// Index of the master output in SoundData::Level(), after the 9 tracks.
+const int MasterLevel = 9;
 
 class DelayEffect {
  public:
   DelayEffect();
-  ~DelayEffect();
-  void AddToBuffer(Mix_Chunk* chunk);
-  void ApplyDelay(Uint8* stream, int len);
-  void AdvanceBuffer(int len);
+  // Sizes the delay line for |sample_rate|. Not while audio is running.
+  void Init(int sample_rate);
+  // Mixes |count| frames of voice output into the delay line, starting
+  // |offset| frames into the current callback.
+  void Send(const Sint32* frames, int count, int offset);
+  // Adds the delay line to |frames| stereo frames of output and moves on by
+  // as much. Instantiated for Sint16 and float output.
+  template <typename T>
+  void ApplyDelay(T* stream, int frames);
+  void AdvanceBuffer(int frames);
   void EnableChannel(int ch, bool enabled);
   bool ChannelEnabled(int channel);
 
   int GetMilliseconds() { return milliseconds_; }
-  double GetFeedback() { return feedback_; }
+  double GetFeedback() { return feedback_.load(std::memory_order_relaxed); }
 
   void IncreaseTime(int milliseconds);
   void IncreaseFeedback(double value);
 
  private:
-  int DelayLength = 2*SampleRate;
-  Uint8 delay_buffer_[MaxBufferLength];
-  int buffer_index_ = 0;
+  int sample_rate_ = DefaultSampleRate;
+  // S16 stereo, room for MaxDelayMs. Only the first |length_| frames are used.
+  std::vector<Sint16> buffer_;
+  // Set by the UI thread while the audio thread runs the line, which reads
+  // it once per call so a change can't move it past the end.
+  std::atomic<int> length_{0};
+  int index_ = 0;
   int milliseconds_ = 400;
-  float feedback_ = 0.8f;
+  std::atomic<float> feedback_{0.8f};
   bool channel_enabled_[9];
 };
 
@@ -43,15 +92,115 @@ class SoundData {
   SoundData();
   ~SoundData();
 
-  void PlaySample(int n);
+  // Can be called from any thread, the voice is started by the next Mix().
+  // False if the hit had to be dropped.
+  bool PlaySample(int n);
   void PlaySampleFromKeycode(SDL_Keycode key);
+  // Rate everything is rendered and samples are converted at, normally the
+  // device's. Set before loading samples or starting audio.
+  void SetSampleRate(int sample_rate);
+  int GetSampleRate() const { return sample_rate_; }
   bool LoadSamples(const char** files);
-  void AdvanceDelayBuffer(int len);
+  // Plays |kit| without taking ownership, so several instances can render
+  // from the same samples. The kit has to outlive this SoundData.
+  void SetSharedKit(Kit* kit);
+  void AdvanceDelayBuffer(int frames);
   DelayEffect* GetDelayEffect() { return delay_effect_.get(); }
 
+  // Starts loading a kit from |path| on a background thread. |path| is either
+  // a manifest listing one WAV file per line or a directory, in which case
+  // its first nine WAV files in name order are used. A manifest line can end
+  // in poly=N, choke=G, start=MS, end=MS, reverse=1, attack=MS, hold=MS and
+  // decay=MS options for its track (see KitSettings), and a steal=oldest or
+  // steal=quietest line picks the voice stealing policy. The kit replaces
+  // the current one on a later call to Update(). Returns false if a load is
+  // already in progress.
+  bool LoadKitAsync(const char* path);
+  bool LoadingKit() { return loading_; }
+  const char* KitName();
+
+  // Periodic work off the audio thread: publishes a freshly loaded kit,
+  // deletes kits that no voice uses anymore and lets the OS drop the mapped
+  // pages of streamed samples that stopped playing. Called from the UI
+  // thread.
+  void Update();
+
+  int KitLoaderFunc();
+
+  // Renders |frames| stereo frames of all playing voices into |out|. Runs
+  // on the audio thread as the SDL_mixer music hook. Instantiated for the
+  // Sint16 and float device formats, the one to use is picked once when
+  // the hook is installed.
+  template <typename T>
+  void Mix(T* out, int frames);
+
+  const LevelMeter& Level(int channel) { return levels_[channel]; }
+
+  // Plays |track| |cents| higher or lower, up to MaxTuneCents either way.
+  // The sample is resampled right away on the calling thread (the UI's) and
+  // kits loaded later get the same tune. False if it didn't change.
+  bool SetTune(int track, int cents);
+  int GetTune(int track) { return tune_[track]; }
+
+  // Must be set before audio starts.
+  void SetSequencer(SequencerFunc func, void* data);
+  // Frames between rendering audio and hearing it, roughly the device buffer.
+  void SetOutputLatency(int frames) { latency_frames_ = frames; }
+  // Timing of the audio callback. Mix() starts measuring a callback and the
+  // end of the postmix calls CallbackDone(). RestartMonitor() after the
+  // device was reopened, while it is closed.
+  void CallbackDone() { monitor_.CallbackEnd(); }
+  void RestartMonitor() { monitor_.Restart(); }
+  AudioStats GetAudioStats() const { return monitor_.GetStats(); }
+  // Frame of the audio clock that was being heard at SDL tick |ticks|, e.g.
+  // an SDL_Event timestamp. Can be called from any thread.
+  Sint64 FrameAtTicks(Uint32 ticks);
+
+  // Samples at other rates are resampled to |sample_rate| while loading.
+  static Kit* LoadKit(const std::vector<std::string>& files, int sample_rate);
+  static bool ListKitFiles(const char* path, std::vector<std::string>* files,
+                           KitSettings* settings);
+
  private:
-   Mix_Chunk* samples_[9];
-   std::unique_ptr<DelayEffect> delay_effect_;
+  void PublishKit(Kit* kit);
+  void CollectRetiredKits();
+  void RetuneTrack(Kit* kit, int track);
+
+  int sample_rate_ = DefaultSampleRate;
+  std::atomic<Kit*> kit_{nullptr};
+  bool shared_kit_ = false;
+  std::atomic<Kit*> loaded_kit_{nullptr};
+  std::vector<Kit*> retired_kits_;
+  std::vector<TunedSample*> retired_tuned_;
+  // In cents, UI thread only.
+  int tune_[9] = {};
+  std::atomic<Uint32> mix_count_{0};
+
+  struct ClockAnchor {
+    Uint64 frame;
+    Uint32 ticks;
+  };
+  // Audio clock: frames rendered so far, and when the last callback began.
+  Uint64 frame_clock_ = 0;
+  SeqLock<ClockAnchor> clock_anchor_;
+  int latency_frames_ = 0;
+  AudioMonitor monitor_;
+
+  SequencerFunc sequencer_ = nullptr;
+  void* sequencer_data_ = nullptr;
+  Hit hits_[MaxBlockHits];
+
+  SDL_Thread* loader_thread_ = nullptr;
+  std::atomic<bool> loading_{false};
+  std::string loader_path_;
+
+  VoicePool voice_pool_;
+  std::atomic<bool> idle_[9];
+  EventQueue<int, 256> triggers_;
+  LevelMeter levels_[10];
+  Sint32 mix_buffer_[MixBlockFrames * 2];
+  Sint32 send_buffer_[MixBlockFrames * 2];
+  std::unique_ptr<DelayEffect> delay_effect_;
 };
 
 #endif  // SOUND_DATA_H
@@ -0,0 +1,156 @@
+#include "tempo_lane.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+const double Forever = 1e300;
+
+double StepFrames(double bpm, int sample_rate) {
+  return sample_rate * 60.0 / (bpm * 4.0);
+}
+
+// Over a stretch where the rate r, in steps per frame, changes by |slope|
+// per step, dp/dt = r0 + slope * (p - p0). So the frames to cover |steps|
+// are log(1 + slope * steps / r0) / slope, and the steps covered in
+// |frames| are r0 * (exp(slope * frames) - 1) / slope.
+double FramesForSteps(double frames_per_step, double slope, double steps) {
+  if (slope == 0.0) {
+    return steps * frames_per_step;
+  }
+  return log1p(slope * steps * frames_per_step) / slope;
+}
+
+double StepsForFrames(double frames_per_step, double slope, double frames) {
+  if (slope == 0.0) {
+    return frames / frames_per_step;
+  }
+  return expm1(slope * frames) / (slope * frames_per_step);
+}
+
+}  // namespace
+
+void ClearTempoLane(TempoLane* lane) {
+  memset(lane, 0, sizeof(TempoLane));
+}
+
+bool AddTempoPoint(TempoLane* lane, int step, float bpm) {
+  if (bpm < MIN_BPM) {
+    bpm = MIN_BPM;
+  } else if (bpm > MAX_BPM) {
+    bpm = MAX_BPM;
+  }
+  int i = 0;
+  while (i < lane->count && lane->points[i].step < step) {
+    i++;
+  }
+  if (i < lane->count && lane->points[i].step == step) {
+    lane->points[i].bpm = bpm;
+    return true;
+  }
+  if (lane->count == MAX_TEMPO_POINTS) {
+    return false;
+  }
+  memmove(&lane->points[i + 1], &lane->points[i],
+          (lane->count - i) * sizeof(TempoPoint));
+  lane->points[i].step = step;
+  lane->points[i].bpm = bpm;
+  lane->count++;
+  return true;
+}
+
+bool SameTempoLane(const TempoLane& a, const TempoLane& b) {
+  return a.count == b.count &&
+         memcmp(a.points, b.points, a.count * sizeof(TempoPoint)) == 0;
+}
+
+TempoMap::TempoMap(const TempoLane& lane, int loop_length, int bpm,
+                   int sample_rate) {
+  lane_ = lane;
+  loop_length_ = loop_length;
+  bpm_ = bpm;
+  sample_rate_ = sample_rate;
+  // Points past the end of a loop are kept in the pattern but not played,
+  // like its trigs.
+  if (loop_length_ > 0) {
+    while (lane_.count > 0 &&
+           lane_.points[lane_.count - 1].step >= loop_length_) {
+      lane_.count--;
+    }
+  }
+}
+
+void TempoMap::Piece(double pos, double* frames_per_step, double* slope,
+                     double* end) const {
+  *slope = 0.0;
+  if (lane_.count == 0) {
+    *frames_per_step = StepFrames(bpm_, sample_rate_);
+    *end = Forever;
+    return;
+  }
+  double base = 0.0;
+  if (loop_length_ > 0) {
+    base = floor(pos / loop_length_) * loop_length_;
+    if (pos - base >= loop_length_) {
+      base += loop_length_;
+    }
+  }
+  double x = pos - base;
+  const TempoPoint* points = lane_.points;
+  int i = 0;
+  while (i < lane_.count && points[i].step <= x) {
+    i++;
+  }
+  double bpm;
+  if (i == 0) {
+    bpm = points[0].bpm;
+    *end = base + points[0].step;
+  } else if (i == lane_.count) {
+    bpm = points[i - 1].bpm;
+    *end = loop_length_ > 0 ? base + loop_length_ : Forever;
+  } else {
+    const TempoPoint& from = points[i - 1];
+    const TempoPoint& to = points[i];
+    double bpm_per_step = (to.bpm - from.bpm) / (to.step - from.step);
+    bpm = from.bpm + bpm_per_step * (x - from.step);
+    *slope = bpm_per_step * 4.0 / (60.0 * sample_rate_);
+    *end = base + to.step;
+  }
+  *frames_per_step = StepFrames(bpm, sample_rate_);
+}
+
+double TempoMap::FramesPerStep(double pos) const {
+  double frames_per_step, slope, end;
+  Piece(pos, &frames_per_step, &slope, &end);
+  return frames_per_step;
+}
+
+double TempoMap::Advance(double pos, double frames) const {
+  for (;;) {
+    double frames_per_step, slope, end;
+    Piece(pos, &frames_per_step, &slope, &end);
+    if (end >= Forever || end <= pos) {
+      return pos + StepsForFrames(frames_per_step, slope, frames);
+    }
+    double needed = FramesForSteps(frames_per_step, slope, end - pos);
+    if (frames < needed) {
+      return pos + StepsForFrames(frames_per_step, slope, frames);
+    }
+    frames -= needed;
+    pos = end;
+  }
+}
+
+double TempoMap::Frames(double from, double to) const {
+  double frames = 0.0;
+  double pos = from;
+  while (pos < to) {
+    double frames_per_step, slope, end;
+    Piece(pos, &frames_per_step, &slope, &end);
+    double stop = end < to && end > pos ? end : to;
+    frames += FramesForSteps(frames_per_step, slope, stop - pos);
+    pos = stop;
+  }
+  return frames;
+}
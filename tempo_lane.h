@@ -0,0 +1,61 @@
+#ifndef TEMPO_LANE_H
+#define TEMPO_LANE_H
+
+// Range of the tempo controls and of tempo lanes.
+#define MIN_BPM 20
+#define MAX_BPM 300
+
+#define MAX_TEMPO_POINTS 8
+
+struct TempoPoint {
+  int step;
+  float bpm;
+};
+
+// Tempo automation. The tempo ramps in a straight line from each point to
+// the next, by step, and holds before the first point and after the last.
+// Points are sorted by step, at most one per step. A lane without points
+// leaves the tempo to the BPM controls.
+struct TempoLane {
+  int count;
+  TempoPoint points[MAX_TEMPO_POINTS];
+};
+
+void ClearTempoLane(TempoLane* lane);
+// Sets the tempo at |step| to |bpm|, clamped to MIN_BPM..MAX_BPM, adding a
+// point or moving the one already there. False if the lane is full.
+bool AddTempoPoint(TempoLane* lane, int step, float bpm);
+bool SameTempoLane(const TempoLane& a, const TempoLane& b);
+
+// Tempo as a function of position, in steps, for placing steps on the
+// sample clock. The time between two positions is the integral of frames
+// per step over them, which on a ramp has a closed form, so a step lands on
+// the same frame however the audio is cut into blocks.
+class TempoMap {
+ public:
+  // |lane| repeats every |loop_length| steps, or with a loop length of 0
+  // runs once from position 0 and holds its last tempo. An empty lane plays
+  // at |bpm|.
+  TempoMap(const TempoLane& lane, int loop_length, int bpm, int sample_rate);
+
+  // Frames per step at |pos|.
+  double FramesPerStep(double pos) const;
+  // Position |frames| frames after |pos|.
+  double Advance(double pos, double frames) const;
+  // Frames from |from| to |to|, which is at or after it.
+  double Frames(double from, double to) const;
+
+ private:
+  // The stretch of the lane holding |pos|: frames per step at |pos|, how
+  // fast the tempo changes there in steps per frame per step, and the
+  // position where the stretch ends.
+  void Piece(double pos, double* frames_per_step, double* slope,
+             double* end) const;
+
+  TempoLane lane_;
+  int loop_length_;
+  int bpm_;
+  int sample_rate_;
+};
+
+#endif  // TEMPO_LANE_H
@@ -0,0 +1,182 @@
+#include "text_renderer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const int GlyphCount = LastGlyph - FirstGlyph + 1;
+
+}  // namespace
+
+TextRenderer::~TextRenderer() {
+  SDL_FreeSurface(atlas_);
+}
+
+bool TextRenderer::Open(const char* const* files, int count, int point_size,
+                        SDL_Color color) {
+  // Only shut SDL_ttf down again if it wasn't already up, another renderer
+  // may be opening its font.
+  bool init = !TTF_WasInit();
+  if (init && TTF_Init() < 0) {
+    printf("Unable to initialize SDL_ttf: %s\n", TTF_GetError());
+    return false;
+  }
+  TTF_Font* font = nullptr;
+  for (int i = 0; i < count && font == nullptr; i++) {
+    font = TTF_OpenFont(files[i], point_size);
+  }
+  if (font == nullptr) {
+    printf("Unable to open a font, drawing text with images instead.\n");
+    if (init) {
+      TTF_Quit();
+    }
+    return false;
+  }
+
+  // Render every glyph, then lay them out in rows and copy them in.
+  SDL_Surface* rendered[GlyphCount] = {};
+  int x = 0;
+  int y = 0;
+  int row_height = 0;
+  for (int i = 0; i < GlyphCount; i++) {
+    Uint16 c = (Uint16)(FirstGlyph + i);
+    Glyph* glyph = &glyphs_[i];
+    glyph->rect = { 0, 0, 0, 0 };
+    glyph->advance = 0;
+    int min_x, max_x, min_y, max_y;
+    if (!TTF_GlyphIsProvided(font, c) ||
+        TTF_GlyphMetrics(font, c, &min_x, &max_x, &min_y, &max_y,
+                         &glyph->advance) < 0) {
+      continue;
+    }
+    rendered[i] = TTF_RenderGlyph_Blended(font, c, color);
+    if (rendered[i] == nullptr) {
+      continue;
+    }
+    if (x + rendered[i]->w > AtlasWidth) {
+      x = 0;
+      y += row_height;
+      row_height = 0;
+    }
+    glyph->rect = { x, y, rendered[i]->w, rendered[i]->h };
+    x += rendered[i]->w;
+    if (rendered[i]->h > row_height) {
+      row_height = rendered[i]->h;
+    }
+  }
+  height_ = TTF_FontHeight(font);
+  TTF_CloseFont(font);
+  if (init) {
+    TTF_Quit();
+  }
+
+  SDL_FreeSurface(atlas_);
+  atlas_ = SDL_CreateRGBSurfaceWithFormat(0, AtlasWidth, y + row_height, 32,
+                                          SDL_PIXELFORMAT_ARGB8888);
+  if (atlas_ == nullptr) {
+    printf("Unable to create the glyph atlas: %s\n", SDL_GetError());
+  }
+  for (int i = 0; i < GlyphCount; i++) {
+    if (rendered[i] == nullptr) {
+      continue;
+    }
+    if (atlas_ != nullptr) {
+      // Copy the glyph's alpha as it is rather than blending it onto the
+      // empty atlas.
+      SDL_SetSurfaceBlendMode(rendered[i], SDL_BLENDMODE_NONE);
+      SDL_Rect dst = glyphs_[i].rect;
+      SDL_BlitSurface(rendered[i], nullptr, atlas_, &dst);
+    }
+    SDL_FreeSurface(rendered[i]);
+  }
+  if (atlas_ == nullptr) {
+    return false;
+  }
+  SDL_SetSurfaceBlendMode(atlas_, SDL_BLENDMODE_BLEND);
+  return true;
+}
+
+int TextRenderer::Width(const char* text) const {
+  int width = 0;
+  for (const char* c = text; *c; c++) {
+    if (*c >= FirstGlyph && *c <= LastGlyph) {
+      width += glyphs_[*c - FirstGlyph].advance;
+    }
+  }
+  return width;
+}
+
+int TextRenderer::Draw(SDL_Surface* surface, int x, int y,
+                       const char* text) const {
+  if (atlas_ == nullptr) {
+    return x;
+  }
+  for (const char* c = text; *c; c++) {
+    if (*c < FirstGlyph || *c > LastGlyph) {
+      continue;
+    }
+    const Glyph& glyph = glyphs_[*c - FirstGlyph];
+    if (glyph.rect.w > 0) {
+      SDL_Rect src = glyph.rect;
+      SDL_Rect dst = { x, y, glyph.rect.w, glyph.rect.h };
+      SDL_BlitSurface(atlas_, &src, surface, &dst);
+    }
+    x += glyph.advance;
+  }
+  return x;
+}
+
+int TextRenderer::DrawRight(SDL_Surface* surface, int right, int y,
+                            const char* text) const {
+  return Draw(surface, right - Width(text), y, text);
+}
+
+int TextRenderer::DrawNumber(SDL_Surface* surface, int x, int y,
+                             double value, int decimals, int digits) const {
+  char text[NumberChars];
+  FormatNumber(text, sizeof(text), value, decimals, digits);
+  return Draw(surface, x, y, text);
+}
+
+int TextRenderer::DrawNumberRight(SDL_Surface* surface, int right, int y,
+                                  double value, int decimals,
+                                  int digits) const {
+  char text[NumberChars];
+  FormatNumber(text, sizeof(text), value, decimals, digits);
+  return DrawRight(surface, right, y, text);
+}
+
+int TextRenderer::Draw(SDL_Surface* surface, int x, int y,
+                       const NumberReadout& readout) const {
+  return Draw(surface, x, y, readout.text());
+}
+
+int TextRenderer::DrawRight(SDL_Surface* surface, int right, int y,
+                            const NumberReadout& readout) const {
+  return Draw(surface, right - readout.width(), y, readout.text());
+}
+
+void TextRenderer::FormatNumber(char* out, int size, double value,
+                                int decimals, int digits) {
+  // The width counts the point and the decimals as well.
+  int width = decimals > 0 ? digits + 1 + decimals : digits;
+  snprintf(out, size, "%0*.*f", width, decimals, value);
+}
+
+bool NumberReadout::Update(const TextRenderer& renderer, double value) {
+  if (valid_ && value == value_) {
+    return false;
+  }
+  value_ = value;
+  char text[NumberChars];
+  TextRenderer::FormatNumber(text, sizeof(text), value, decimals_, digits_);
+  // A different value can still round to the same text.
+  if (valid_ && strcmp(text, text_) == 0) {
+    return false;
+  }
+  valid_ = true;
+  memcpy(text_, text, sizeof(text_));
+  width_ = renderer.Width(text_);
+  return true;
+}
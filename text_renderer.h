@@ -0,0 +1,104 @@
+#ifndef TEXT_RENDERER_H
+#define TEXT_RENDERER_H
+
+#include <SDL.h>
+
+#ifdef __linux__
+#include <SDL2/SDL_ttf.h>
+#elif _WIN32
+#include <SDL_ttf.h>
+#endif
+
+// Printable ASCII, the only characters a TextRenderer draws. Anything else
+// is skipped.
+const int FirstGlyph = 32;
+const int LastGlyph = 126;
+// Widest atlas row before glyphs wrap onto the next one.
+const int AtlasWidth = 512;
+// Enough for any number a readout shows.
+const int NumberChars = 32;
+
+class NumberReadout;
+
+// Draws text in one font, size and colour. The font is rasterized once when
+// it's opened: every glyph is rendered into a single atlas surface and its
+// place in the atlas and advance are kept, so drawing a string is a blit per
+// character and never creates a surface. Cheap enough to redraw readouts
+// every frame.
+class TextRenderer {
+ public:
+  ~TextRenderer();
+
+  // Opens the first of the |count| font |files| that loads, at |point_size|
+  // in |color|, builds the atlas and closes the font again. False if none
+  // of them could be opened, the renderer then stays not Ready().
+  bool Open(const char* const* files, int count, int point_size,
+            SDL_Color color);
+  bool Ready() const { return atlas_ != nullptr; }
+
+  int Height() const { return height_; }
+  // Width |text| takes when drawn.
+  int Width(const char* text) const;
+
+  // Blends |text| onto |surface| with its top left at |x|, |y|. Returns
+  // the x just past the end of it.
+  int Draw(SDL_Surface* surface, int x, int y, const char* text) const;
+  // Same, but with |text| ending at |right|.
+  int DrawRight(SDL_Surface* surface, int right, int y,
+                const char* text) const;
+  // |value| with |decimals| digits after the point, padded with zeros to at
+  // least |digits| before it.
+  int DrawNumber(SDL_Surface* surface, int x, int y, double value,
+                 int decimals = 0, int digits = 1) const;
+  int DrawNumberRight(SDL_Surface* surface, int right, int y, double value,
+                      int decimals = 0, int digits = 1) const;
+  // The text |readout| last formatted, placed from the width it measured.
+  int Draw(SDL_Surface* surface, int x, int y,
+           const NumberReadout& readout) const;
+  int DrawRight(SDL_Surface* surface, int right, int y,
+                const NumberReadout& readout) const;
+
+ private:
+  friend class NumberReadout;
+
+  struct Glyph {
+    // Where the glyph is in the atlas, empty if the font doesn't have it.
+    SDL_Rect rect;
+    int advance;
+  };
+
+  static void FormatNumber(char* out, int size, double value, int decimals,
+                           int digits);
+
+  SDL_Surface* atlas_ = nullptr;
+  Glyph glyphs_[LastGlyph - FirstGlyph + 1] = {};
+  int height_ = 0;
+};
+
+// A number shown in one place on a surface that keeps what's drawn on it.
+// Holds the text it last formatted and that text's width, so a readout that
+// is redrawn with the value it already shows is neither formatted, measured
+// nor blitted again.
+class NumberReadout {
+ public:
+  // Formatted like TextRenderer::DrawNumber().
+  explicit NumberReadout(int decimals = 0, int digits = 1)
+      : decimals_(decimals), digits_(digits) {}
+
+  // Formats |value| and measures it with |renderer| if it isn't what the
+  // readout holds already. True if the text changed and needs drawing.
+  bool Update(const TextRenderer& renderer, double value);
+
+  const char* text() const { return text_; }
+  int width() const { return width_; }
+
+ private:
+  int decimals_;
+  int digits_;
+  bool valid_ = false;
+  double value_ = 0;
+  char text_[NumberChars] = {};
+  int width_ = 0;
+};
+
+#endif  // TEXT_RENDERER_H
@@ -1,77 +1,95 @@
 #include "trig_button.h"
 #include <stdio.h>
 
-TrigButton::TrigButton(SDL_Surface *screen, SDL_Surface *active_empty_slot,
-                       SDL_Surface *empty_slot, SDL_Surface *toggled,
+TrigSprites::TrigSprites() {
+  for (int i = 0; i < TrigSpriteTracks; i++) {
+    for (int j = 0; j < 4; j++) {
+      sprites_[i][j / 2][j % 2] = nullptr;
+    }
+  }
+}
+
+TrigSprites::~TrigSprites() {
+  for (int i = 0; i < TrigSpriteTracks; i++) {
+    for (int j = 0; j < 4; j++) {
+      SDL_FreeSurface(sprites_[i][j / 2][j % 2]);
+    }
+  }
+}
+
+bool TrigSprites::Init(SDL_Surface* screen, SDL_Surface* empty_slot,
+                       SDL_Surface* active_empty_slot,
+                       SDL_Surface* const* icons) {
+  SDL_PixelFormat* format = screen->format;
+  for (int i = 0; i < TrigSpriteTracks; i++) {
+    for (int playhead = 0; playhead < 2; playhead++) {
+      for (int enabled = 0; enabled < 2; enabled++) {
+        SDL_Surface* sprite = SDL_CreateRGBSurface(0,
+          empty_slot->w, empty_slot->h, format->BitsPerPixel,
+          format->Rmask, format->Gmask, format->Bmask, format->Amask);
+        if (sprite == nullptr) {
+          printf("Couldn't create trig sprite: %s\n", SDL_GetError());
+          return false;
+        }
+        SDL_BlitSurface(playhead ? active_empty_slot : empty_slot, NULL,
+                        sprite, NULL);
+        if (enabled) {
+          SDL_BlitSurface(icons[i], NULL, sprite, NULL);
+        }
+        // Opaque, so drawing it is a plain copy.
+        SDL_SetSurfaceBlendMode(sprite, SDL_BLENDMODE_NONE);
+        sprites_[i][playhead][enabled] = sprite;
+      }
+    }
+  }
+  return true;
+}
+
+TrigButton::TrigButton(SDL_Surface *screen, const TrigSprites *sprites,
                        SDL_Rect rect, DrumLoop *drum_loop)
-    : Button(screen, active_empty_slot, empty_slot, toggled, rect, SDLK_UNKNOWN,
+    : Button(screen, nullptr, nullptr, nullptr, rect, SDLK_UNKNOWN,
              SDLK_UNKNOWN) {
+  sprites_ = sprites;
   drum_loop_ = drum_loop;
 }
 
 void TrigButton::Draw() {
-  if (toggled_) {
-    SetToggled(true);
-  } else {
-    SetInactive();
-  }
+  Blit(sprites_->Get(track_, active_step_, toggled_));
 }
 
 bool TrigButton::UpdateStep() {
-  bool stepped = false;
-  int current_step = drum_loop_->CurrentStep();
-
-  /*if (!drum_loop_->Running()) {
+  bool active_step = step_ == drum_loop_->CurrentStep();
+  if (active_step == active_step_) {
     return false;
-  }*/
-
-  if (step_ == current_step) {
-    if (!active_step_) {
-      SetActive();
-      active_step_ = true;
-      stepped = true;
-      if (toggled_) {
-        SetToggled(true);
-      }
-    }
-  } else {
-    if (active_step_) {
-      SetInactive();
-      active_step_ = false;
-      stepped = true;
-      if (toggled_) {
-        SetToggled(true);
-      }
-    }
   }
-  return stepped;
+  active_step_ = active_step;
+  Draw();
+  return true;
 }
 
 bool TrigButton::HandleClick() {
-  if (toggled_) {
-    toggled_ = false;
-    Draw();
-    drum_loop_->SetTrig(track_, step_, '0');
-    return true;
-  } else {
-    toggled_ = true;
-    Draw();
-    drum_loop_->SetTrig(track_, step_, '1');
-    return true;
-  }
+  SetEnabled(!toggled_, true);
+  return true;
 }
 
-void TrigButton::SetEnabled(bool enabled, bool undoable) {
-  SetToggled(enabled);
+bool TrigButton::SetEnabled(bool enabled, bool undoable) {
+  if (enabled == toggled_) {
+    return false;
+  }
+  drum_loop_->SetTrig(track_, step_, enabled ? '1' : '0', undoable);
   toggled_ = enabled;
-  active_step_ = enabled;
-  if (enabled) {
-    SetActive();
-    drum_loop_->SetTrig(track_, step_, '1', undoable);
-  } else {
-    SetInactive();
-    drum_loop_->SetTrig(track_, step_, '0', undoable);
+  Draw();
+  return true;
+}
+
+bool TrigButton::Refresh() {
+  bool enabled = drum_loop_->GetTrig(track_, step_) != '0';
+  if (enabled == toggled_) {
+    return false;
   }
+  toggled_ = enabled;
+  Draw();
+  return true;
 }
 
 bool TrigButton::HandleEvent(SDL_Event* e) {
@@ -6,11 +6,32 @@
 #include "button.h"
 #include "drum_loop.h"
 
+const int TrigSpriteTracks = 9;
+
+// Every look a trig cell can have: per track, with or without the playhead
+// on it and with the trig on or off. The slot and the track's icon are
+// composed once at startup into surfaces in the screen's format, so drawing
+// a cell is a single blit without blending or conversion.
+class TrigSprites {
+ public:
+  TrigSprites();
+  ~TrigSprites();
+
+  bool Init(SDL_Surface* screen, SDL_Surface* empty_slot,
+            SDL_Surface* active_empty_slot, SDL_Surface* const* icons);
+
+  SDL_Surface* Get(int track, bool playhead, bool enabled) const {
+    return sprites_[track][playhead][enabled];
+  }
+
+ private:
+  SDL_Surface* sprites_[TrigSpriteTracks][2][2];
+};
+
 class TrigButton : public Button
 {
  public:
-   TrigButton(SDL_Surface *screen, SDL_Surface *active_empty_slot,
-              SDL_Surface *empty_slot, SDL_Surface *toggled, SDL_Rect rect,
+   TrigButton(SDL_Surface *screen, const TrigSprites *sprites, SDL_Rect rect,
               DrumLoop *drum_loop);
 
    bool HandleEvent(SDL_Event *e);
@@ -18,13 +39,18 @@ class TrigButton : public Button
 
    bool UpdateStep();
    bool HandleClick();
-   void SetEnabled(bool enabled, bool undoable);
+   // Writes the trig to the drum loop if it changes. Returns whether the
+   // cell had to be redrawn.
+   bool SetEnabled(bool enabled, bool undoable);
+   // Picks up the trig from the drum loop after it was changed there.
+   bool Refresh();
 
    void SetTrack(int track) { track_ = track; }
    void SetStep(int step) { step_ = step; }
    void Enable() { toggled_ = true; }
 
  private:
+   const TrigSprites *sprites_;
    DrumLoop *drum_loop_;
    bool toggled_ = false;
    bool active_step_ = false;
@@ -101,48 +101,11 @@ void draw_border(SDL_Surface* surface, SDL_Rect rect)
 }
 
 
-void draw_sample(SDL_Surface* screen, Uint8* abuf, int len, Uint32 color) {
-  Uint16 format;
-  int channels, incr;
-  Sint16* buffer16;
-  Sint32* buffer32;
-
-  Mix_QuerySpec(NULL, &format, &channels);
-  incr = (format & 0xFF) * channels;
-
-  unsigned long int i;
-  unsigned long int length = len / 2;
-  switch (format & 0xFF) {
-  case 16:
-    buffer16 = reinterpret_cast<Sint16*>(abuf);
-    for (i = 0; i < length; i += 2) {
-      Sint16 current_l = *(buffer16);
-      Sint16 current_r = *(buffer16 + 1);
-      int x = i * screen->w / length;
-      int y = screen->h / 2 + ((current_l + current_r) / 2 * (screen->h)) / (2 << 16);
-      putpixel(screen, i * screen->w / length,
-        screen->h / 2 +
-        ((current_l + current_r) / 2 * (screen->h)) / (2 << 16),
-        color);
-      buffer16 += 2;
-    }
-    break;
-  case 32:
-    buffer32 = reinterpret_cast<Sint32*>(abuf);
-    for (i = 0; i < length; i += 4) {
-      Sint32 current_l = *(buffer32);
-      Sint32 current_r = *(buffer32 + 1);
-      putpixel(screen, i * screen->w / length,
-        screen->h / 2ll + 100ll +
-        ((current_l) * (screen->h / 2ll)) / (2ll << 32ll),
-        color);
-      putpixel(screen, i * screen->w / length,
-        screen->h / 2ll - 100ll +
-        ((current_r) * (screen->h / 2ll)) / (2ll << 32ll),
-        color);
-      buffer32 += 2;
-    }
-    break;
+void draw_sample(SDL_Surface* screen, const float* samples, int count,
+                 Uint32 color) {
+  for (int i = 0; i < count; i++) {
+    putpixel(screen, i * screen->w / count,
+             screen->h / 2 + (int)(samples[i] * screen->h / 4), color);
   }
 }
 
@@ -162,16 +125,16 @@ void apply_delay(int chan, void* abuf, int len, void* data) {
 
   Sint16* delayBuffer16 = (Sint16*)delayBuffer;
   Sint16* abuf16 = (Sint16*)abuf;
-  int nsamples = SampleRate / 1000.0 * milliseconds;
+  int nsamples = DefaultSampleRate / 1000.0 * milliseconds;
 
   for (int i = 0; i < len / 2; i += 2) {
     delayBuffer16[db_idx] = abuf16[i];
     delayBuffer16[db_idx + 1] = abuf16[i + 1];
 
     abuf16[i] = abuf16[i + 1] * 0.5 +
-                delayBuffer16[((db_idx + 1 - nsamples) + SampleRate) % SampleRate] * 0.5;
+                delayBuffer16[((db_idx + 1 - nsamples) + DefaultSampleRate) % DefaultSampleRate] * 0.5;
     abuf16[i + 1] = abuf16[i] * 0.5 +
-                    delayBuffer16[((db_idx - nsamples) + SampleRate) % SampleRate] * 0.5;
+                    delayBuffer16[((db_idx - nsamples) + DefaultSampleRate) % DefaultSampleRate] * 0.5;
 
     db_idx += 2;
 
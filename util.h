@@ -8,7 +8,9 @@ SDL_Surface* load_surface(SDL_Surface* screen, const char* path,
   bool optimize = true);
 void putpixel(SDL_Surface* surface, int x, int y, Uint32 pixel);
 void draw_border(SDL_Surface* surface, SDL_Rect rect);
-void draw_sample(SDL_Surface* screen, Uint8* abuf, int len, Uint32 color);
+// Plots |count| mono samples across the width of |screen|.
+void draw_sample(SDL_Surface* screen, const float* samples, int count,
+                 Uint32 color);
 
 void apply_delay(int chan, void* abuf, int len, void* data);
 void apply_delay_post(int chan, void* data);
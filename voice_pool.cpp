@@ -0,0 +1,378 @@
+#include "voice_pool.h"
+
+#include <math.h>
+
+#include "sound_data.h"
+
+namespace {
+
+// Playback rate of an unpitched voice, one frame read per frame played.
+const int RateUnity = 1 << 16;
+// Cutoffs run from LowestCutoffHz up this many times higher.
+const double LowestCutoffHz = 20.0;
+const double CutoffRange = 1000.0;
+
+int MsToFrames(int ms, int sample_rate) {
+  return ms <= 0 ? 0 : (int)((Sint64)ms * sample_rate / 1000);
+}
+
+// Scales |n| frames of |buffer|, played |pos| frames into a voice, by
+// |gain| and the envelope |env|.
+void ApplyGain(Sint16* buffer, int n, int pos, int gain,
+               const TrackEnvelope& env) {
+  if (env.curve.empty()) {
+    for (int j = 0; j < n * 2; j++) {
+      buffer[j] = (Sint16)(buffer[j] * gain / UnityGain);
+    }
+    return;
+  }
+  // Past |held| the decay part of the curve applies. Voices end with it, so
+  // it never runs out.
+  int held = env.decay > 0 ? env.attack + env.hold : pos + n;
+  for (int j = 0; j < n; j++) {
+    int frame = pos + j;
+    int level;
+    if (frame < env.attack) {
+      level = env.curve[frame];
+    } else if (frame < held) {
+      level = EnvelopeUnity;
+    } else {
+      level = env.curve[env.attack + frame - held];
+    }
+    level = level * gain / UnityGain;
+    buffer[2 * j] = (Sint16)(buffer[2 * j] * level / EnvelopeUnity);
+    buffer[2 * j + 1] = (Sint16)(buffer[2 * j + 1] * level / EnvelopeUnity);
+  }
+}
+
+}  // namespace
+
+void SetKitSettings(Kit* kit, const KitSettings& settings, int sample_rate) {
+  kit->settings = settings;
+  for (int i = 0; i < 9; i++) {
+    TrackEnvelope* env = &kit->envelope[i];
+    env->start = MsToFrames(settings.start_ms[i], sample_rate);
+    env->end = MsToFrames(settings.end_ms[i], sample_rate);
+    env->reverse = settings.reverse[i];
+    env->attack = MsToFrames(settings.attack_ms[i], sample_rate);
+    env->decay = MsToFrames(settings.decay_ms[i], sample_rate);
+    env->hold = env->decay > 0 ? MsToFrames(settings.hold_ms[i], sample_rate)
+                               : 0;
+    env->curve.clear();
+    // The attack rises in a straight line. The decay falls off as the cube
+    // of the time left, quickly at first and then with a long quiet tail,
+    // down to exactly 0 at its last frame.
+    for (int f = 0; f < env->attack; f++) {
+      env->curve.push_back((Uint16)((Sint64)f * EnvelopeUnity / env->attack));
+    }
+    for (int f = 1; f <= env->decay; f++) {
+      double left = 1.0 - (double)f / env->decay;
+      env->curve.push_back((Uint16)(left * left * left * EnvelopeUnity));
+    }
+  }
+}
+
+VoicePool::VoicePool() {
+  sample_rate_ = DefaultSampleRate;
+}
+
+VoicePool::~VoicePool() {}
+
+void VoicePool::Start(Kit* kit, int track, const HitParams& params) {
+  if (kit == nullptr) {
+    return;
+  }
+  const KitSettings& settings = kit->settings;
+
+  int group = settings.choke_group[track];
+  int track_voices = 0;
+  int playing = 0;
+  for (int i = 0; i < count_; i++) {
+    Voice* v = &voices_[i];
+    if (v->fade >= 0) {
+      continue;
+    }
+    if (group != 0 && v->kit->settings.choke_group[v->track] == group) {
+      v->fade = FadeFrames;
+      continue;
+    }
+    playing++;
+    if (v->track == track) {
+      track_voices++;
+    }
+  }
+
+  if (track_voices >= settings.polyphony[track]) {
+    int victim = FindVictim(track, StealOldest);
+    if (victim >= 0) {
+      voices_[victim].fade = FadeFrames;
+      playing--;
+    }
+  }
+  if (playing >= MaxVoices) {
+    int victim = FindVictim(-1, settings.steal_policy);
+    if (victim >= 0) {
+      voices_[victim].fade = FadeFrames;
+    }
+  }
+
+  // Every slot is busy with fades, cut the one closest to done.
+  if (count_ == MaxVoices + FadeReserve) {
+    int shortest = 0;
+    for (int i = 1; i < count_; i++) {
+      if (voices_[i].fade >= 0 && (voices_[shortest].fade < 0 ||
+                                   voices_[i].fade < voices_[shortest].fade)) {
+        shortest = i;
+      }
+    }
+    Remove(shortest);
+  }
+
+  Voice* v = &voices_[count_++];
+  v->kit = kit;
+  v->tuned = kit->tuned[track].load(std::memory_order_acquire);
+  if (v->tuned != nullptr) {
+    v->tuned->voices.fetch_add(1, std::memory_order_relaxed);
+  }
+  // Start and end are points in the sample, so they scale with the tune
+  // along with it. The envelope is in time and doesn't.
+  const TrackEnvelope& env = kit->envelope[track];
+  int frames = kit->samples[track].Frames();
+  int start = env.start < frames ? env.start : frames;
+  int end = env.end > 0 && env.end < frames ? env.end : frames;
+  if (end < start) {
+    end = start;
+  }
+  if (v->tuned != nullptr && frames > 0) {
+    start = (int)((Sint64)start * v->tuned->Frames() / frames);
+    end = (int)((Sint64)end * v->tuned->Frames() / frames);
+  }
+  v->pos = 0;
+  v->start = start;
+  v->length = end - start;
+  v->age = 0;
+  v->frac = 0;
+  v->rate = RateUnity;
+  if (params.pitch != 0) {
+    int pitch = params.pitch;
+    if (pitch < -MaxPitchSemitones) {
+      pitch = -MaxPitchSemitones;
+    } else if (pitch > MaxPitchSemitones) {
+      pitch = MaxPitchSemitones;
+    }
+    v->rate = (int)lround(RateUnity * exp2(pitch / 12.0));
+  }
+  v->left = params.pan > 0 ? EnvelopeUnity * (63 - params.pan) / 63
+                           : EnvelopeUnity;
+  v->right = params.pan < 0 ? EnvelopeUnity * (64 + params.pan) / 64
+                            : EnvelopeUnity;
+  v->lowpass = 0;
+  if (params.cutoff < OpenCutoff) {
+    int cutoff = params.cutoff > 0 ? params.cutoff : 0;
+    const double pi = 3.14159265358979323846;
+    double hz = LowestCutoffHz * pow(CutoffRange, cutoff / (double)OpenCutoff);
+    v->lowpass = (int)(EnvelopeUnity *
+                       (1.0 - exp(-2.0 * pi * hz / sample_rate_)));
+    if (v->lowpass < 1) {
+      v->lowpass = 1;
+    }
+  }
+  v->lowpass_state[0] = 0;
+  v->lowpass_state[1] = 0;
+  v->send = params.send;
+  v->serial = serial_++;
+  v->level = 0;
+  v->track = track;
+  v->fade = -1;
+  v->gain = params.gain;
+  kit->voices.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Picks a voice that isn't already fading, on |track| or on any track if
+// |track| is -1.
+int VoicePool::FindVictim(int track, StealPolicy policy) {
+  int victim = -1;
+  for (int i = 0; i < count_; i++) {
+    const Voice* v = &voices_[i];
+    if (v->fade >= 0 || (track >= 0 && v->track != track)) {
+      continue;
+    }
+    if (victim < 0) {
+      victim = i;
+      continue;
+    }
+    const Voice* best = &voices_[victim];
+    bool older = (Sint32)(v->serial - best->serial) < 0;
+    if (policy == StealQuietest) {
+      if (v->level < best->level || (v->level == best->level && older)) {
+        victim = i;
+      }
+    } else if (older) {
+      victim = i;
+    }
+  }
+  return victim;
+}
+
+// Reads |frames| frames from |pos| frames into |v|'s part of the sample,
+// or as many as are left, in the order they play.
+int VoicePool::ReadSource(const Voice* v, bool reverse, int pos, Sint16* out,
+                          int frames) {
+  if (frames > v->length - pos) {
+    frames = v->length - pos;
+  }
+  if (frames <= 0) {
+    return 0;
+  }
+  // Reversed, the frames are read in order and then flipped around.
+  int from = reverse ? v->start + v->length - pos - frames : v->start + pos;
+  int n = v->tuned != nullptr ?
+          v->tuned->Read(from, out, frames) :
+          v->kit->samples[v->track].Read(from, out, frames);
+  if (reverse) {
+    for (int a = 0, b = n - 1; a < b; a++, b--) {
+      Sint16 left = out[2 * a];
+      Sint16 right = out[2 * a + 1];
+      out[2 * a] = out[2 * b];
+      out[2 * a + 1] = out[2 * b + 1];
+      out[2 * b] = left;
+      out[2 * b + 1] = right;
+    }
+  }
+  return n;
+}
+
+// Writes up to |frames| frames of |v| at its rate into |out| and moves it
+// on. Returns how many, fewer once its sample runs out. A pitched voice
+// reads the frames around the ones it plays and interpolates between them.
+int VoicePool::Read(Voice* v, bool reverse, Sint16* out, int frames) {
+  if (v->rate == RateUnity) {
+    int n = ReadSource(v, reverse, v->pos, out, frames);
+    v->pos += n;
+    return n;
+  }
+  // Up to an octave up reads twice as many frames, plus the one after the
+  // last for interpolating.
+  Sint16 source[(MixBlockFrames * 2 + 2) * 2];
+  int needed = (int)(((Sint64)v->frac + (Sint64)(frames - 1) * v->rate) >>
+                     16) + 2;
+  int read = ReadSource(v, reverse, v->pos, source, needed);
+  int at = v->frac;
+  int n = 0;
+  for (; n < frames; n++) {
+    int i = at >> 16;
+    if (i >= read) {
+      break;
+    }
+    int weight = (at & 0xffff) >> 1;
+    for (int c = 0; c < 2; c++) {
+      int a = source[2 * i + c];
+      int b = i + 1 < read ? source[2 * (i + 1) + c] : 0;
+      out[2 * n + c] = (Sint16)(a + (b - a) * weight / (1 << 15));
+    }
+    at += v->rate;
+  }
+  v->pos += at >> 16;
+  v->frac = at & 0xffff;
+  return n;
+}
+
+void VoicePool::Remove(int index) {
+  if (voices_[index].tuned != nullptr) {
+    voices_[index].tuned->voices.fetch_sub(1, std::memory_order_release);
+  }
+  voices_[index].kit->voices.fetch_sub(1, std::memory_order_release);
+  voices_[index] = voices_[--count_];
+}
+
+int VoicePool::Render(Sint32* mix, Sint32* send_mix, const bool* send,
+                      TrackLevels* levels, int frames) {
+  Sint16 buffer[MixBlockFrames * 2];
+  int finished = 0;
+
+  for (int i = 0; i < count_;) {
+    Voice* v = &voices_[i];
+    const TrackEnvelope& env = v->kit->envelope[v->track];
+    // A decay ends the voice when it reaches silence.
+    int n = frames;
+    if (env.decay > 0 && env.attack + env.hold + env.decay - v->age < n) {
+      n = env.attack + env.hold + env.decay - v->age;
+    }
+    n = Read(v, env.reverse, buffer, n);
+    bool done = n < frames;
+
+    if (v->gain != UnityGain || !env.curve.empty()) {
+      ApplyGain(buffer, n, v->age, v->gain, env);
+    }
+    v->age += n;
+    if (v->lowpass != 0) {
+      for (int j = 0; j < n * 2; j++) {
+        Sint32* state = &v->lowpass_state[j & 1];
+        *state += (Sint32)((Sint64)(buffer[j] * 256 - *state) * v->lowpass /
+                           EnvelopeUnity);
+        buffer[j] = (Sint16)(*state >> 8);
+      }
+    }
+    if (v->left != EnvelopeUnity || v->right != EnvelopeUnity) {
+      for (int j = 0; j < n; j++) {
+        buffer[2 * j] = (Sint16)(buffer[2 * j] * v->left / EnvelopeUnity);
+        buffer[2 * j + 1] =
+            (Sint16)(buffer[2 * j + 1] * v->right / EnvelopeUnity);
+      }
+    }
+    if (v->fade >= 0) {
+      if (n > v->fade) {
+        n = v->fade;
+      }
+      for (int j = 0; j < n; j++) {
+        int gain = v->fade - j;
+        buffer[2 * j] = (Sint16)(buffer[2 * j] * gain / FadeFrames);
+        buffer[2 * j + 1] = (Sint16)(buffer[2 * j + 1] * gain / FadeFrames);
+      }
+      v->fade -= n;
+      done = done || v->fade == 0;
+    }
+
+    Sint32 peak = 0;
+    for (int j = 0; j < n * 2; j++) {
+      Sint32 s = buffer[j];
+      mix[j] += s;
+      s = s < 0 ? -s : s;
+      peak = s > peak ? s : peak;
+    }
+    // Both sides of every LevelStride'th frame are enough for a meter's
+    // RMS.
+    Sint32 energy = 0;
+    for (int j = 0; j < n * 2; j += LevelStride * 2) {
+      Sint32 l = buffer[j] >> LevelShift;
+      Sint32 r = buffer[j + 1] >> LevelShift;
+      energy += l * l + r * r;
+    }
+    if (v->send > 0) {
+      for (int j = 0; j < n * 2; j++) {
+        send_mix[j] += buffer[j] * v->send / MaxSend;
+      }
+    } else if (v->send < 0 && send[v->track]) {
+      for (int j = 0; j < n * 2; j++) {
+        send_mix[j] += buffer[j];
+      }
+    }
+    v->level = peak;
+    if (peak > levels->peak[v->track]) {
+      levels->peak[v->track] = peak;
+    }
+    levels->energy[v->track] += energy;
+
+    if (done) {
+      finished |= 1 << v->track;
+      Remove(i);
+    } else {
+      i++;
+    }
+  }
+  // Only report tracks that went completely quiet.
+  for (int i = 0; i < count_; i++) {
+    finished &= ~(1 << voices_[i].track);
+  }
+  return finished;
+}
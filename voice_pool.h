@@ -0,0 +1,229 @@
+#ifndef VOICE_POOL_H
+#define VOICE_POOL_H
+
+#include <SDL.h>
+
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "sample_source.h"
+
+// Voices that can sound at once, not counting ones that are fading out.
+const int MaxVoices = 32;
+// Extra slots so a stolen or choked voice can finish its fade while the
+// voice that replaced it is already playing.
+const int FadeReserve = 16;
+// ~3 ms, long enough to avoid a click when a voice is cut short.
+const int FadeFrames = 128;
+const int DefaultPolyphony = 4;
+// Voice gain of a hit at full velocity, a fixed point 1.
+const int UnityGain = 256;
+// Full level in envelope gain tables.
+const int EnvelopeUnity = 1 << 15;
+
+const int MaxPitchSemitones = 12;
+const int OpenCutoff = 127;
+const int MaxSend = 127;
+
+// How a single hit plays on top of its track's settings, e.g. from the
+// parameter locks of its step. The defaults play the sample as it is.
+struct HitParams {
+  int gain = UnityGain;
+  // Semitones up or down, up to MaxPitchSemitones.
+  int pitch = 0;
+  // -64 hard left to 63 hard right
+  int pan = 0;
+  // Low pass cutoff from 0, about 20 Hz, up to OpenCutoff for no filter.
+  int cutoff = OpenCutoff;
+  // Delay send level up to MaxSend, or -1 to follow the track's send.
+  int send = -1;
+};
+
+enum StealPolicy {
+  StealOldest = 0,
+  StealQuietest,
+};
+
+// Per track voice settings of a kit. A choke group of 0 means none, every
+// voice started in a group fades out the others in it (e.g. a closed hat
+// choking the open hat).
+//
+// Each track can also play only part of its sample, from |start_ms| up to
+// |end_ms| (0 for the end of the sample), backwards if |reverse| is set.
+// Its level rises over |attack_ms|, and with a |decay_ms| it stays at full
+// level for |hold_ms| and then decays to silence, which ends the voice
+// there rather than at the end of the sample.
+struct KitSettings {
+  int polyphony[9];
+  int choke_group[9];
+  StealPolicy steal_policy = StealOldest;
+  int start_ms[9];
+  int end_ms[9];
+  bool reverse[9];
+  int attack_ms[9];
+  int hold_ms[9];
+  int decay_ms[9];
+
+  KitSettings() {
+    for (int i = 0; i < 9; i++) {
+      polyphony[i] = DefaultPolyphony;
+      choke_group[i] = 0;
+      start_ms[i] = 0;
+      end_ms[i] = 0;
+      reverse[i] = false;
+      attack_ms[i] = 0;
+      hold_ms[i] = 0;
+      decay_ms[i] = 0;
+    }
+  }
+};
+
+// KitSettings of one track in frames, with its envelope turned into a gain
+// table up front so the mix loop only has to look gains up.
+struct TrackEnvelope {
+  int start = 0;
+  // 0 for up to the end of the sample
+  int end = 0;
+  bool reverse = false;
+  int attack = 0;
+  int hold = 0;
+  // 0 for none, the voice then plays to the end at full level.
+  int decay = 0;
+  // Gains of the |attack| frames of the attack and then of the |decay|
+  // frames of the decay, EnvelopeUnity being full level. Empty with
+  // neither.
+  std::vector<Uint16> curve;
+};
+
+// Peak and summed squares of each track's voices over some span of frames.
+// Peaks are in sample units. Squares are of both sides of every
+// LevelStride'th frame, shifted right by LevelShift first. Voices of one track are measured
+// separately, so two overlapping hits add up their energy rather than their
+// waveforms.
+const int LevelStride = 8;
+const int LevelShift = 5;
+struct TrackLevels {
+  Sint32 peak[9];
+  Sint64 energy[9];
+};
+
+// A track's sample resampled to its tune, kept in RAM. Replaced whole when
+// the tune changes and deleted like a kit, once no voice plays from it.
+struct TunedSample {
+  std::vector<Sint16> frames;
+  std::atomic<int> voices{0};
+  Uint32 retired_at = 0;
+
+  int Frames() const { return (int)frames.size() / 2; }
+  // Same as SampleSource::Read.
+  int Read(int pos, Sint16* out, int count) const {
+    if (pos >= Frames() || count <= 0) {
+      return 0;
+    }
+    if (count > Frames() - pos) {
+      count = Frames() - pos;
+    }
+    memcpy(out, frames.data() + pos * 2, count * 2 * sizeof(Sint16));
+    return count;
+  }
+};
+
+// One sample per track. Kits are built off the audio thread and handed to it
+// whole. Voices keep playing from the kit they started on, so an old kit is
+// only deleted once none of its voices are left. Tracks with a tune play
+// from |tuned| instead of |samples|.
+struct Kit {
+  SampleSource samples[9];
+  std::atomic<TunedSample*> tuned[9] = {};
+  KitSettings settings;
+  TrackEnvelope envelope[9];
+  std::string name;
+  std::atomic<int> voices{0};
+  Uint32 retired_at = 0;
+
+  ~Kit() {
+    for (int i = 0; i < 9; i++) {
+      delete tuned[i].load();
+    }
+  }
+};
+
+// Gives |kit| |settings| and builds its envelopes, for playing at
+// |sample_rate|. Before the kit is handed to the audio thread.
+void SetKitSettings(Kit* kit, const KitSettings& settings, int sample_rate);
+
+// Fixed set of voices, only ever touched by the audio thread. Playing voices
+// are kept packed at the front of the array so rendering walks a dense run
+// of small structs.
+class VoicePool {
+ public:
+  VoicePool();
+  ~VoicePool();
+
+  // Rate of the filters. Not while audio is running.
+  void SetSampleRate(int sample_rate) { sample_rate_ = sample_rate; }
+
+  // Starts |track| of |kit| with |params|, taking a voice from another one
+  // if the track or the pool is at its polyphony limit.
+  void Start(Kit* kit, int track, const HitParams& params = HitParams());
+
+  // Adds |frames| (at most MixBlockFrames) frames of every voice to |mix|.
+  // Voices of tracks with |send[track]| set are also added to |send_mix|.
+  // Their levels are accumulated into |levels|. Returns a bitmask of the
+  // tracks whose last voice finished.
+  int Render(Sint32* mix, Sint32* send_mix, const bool* send,
+             TrackLevels* levels, int frames);
+
+  int ActiveVoices() { return count_; }
+
+ private:
+  struct Voice {
+    Kit* kit;
+    // The kit's tuned copy of the sample when the voice started, if any.
+    TunedSample* tuned;
+    // Frames read so far, of the |length| from |start| of the sample (or
+    // tuned sample) the track plays.
+    int pos;
+    int start;
+    int length;
+    // Frames read per frame played in 1/65536ths, and how far past |pos|
+    // playback is in those.
+    int rate;
+    int frac;
+    // Frames played so far, for the envelope.
+    int age;
+    // Start order, for oldest first stealing
+    Uint32 serial;
+    // Peak of the last rendered block, for quietest first stealing
+    Sint32 level;
+    Sint16 track;
+    // Frames left of the fade out, -1 while playing normally
+    Sint16 fade;
+    // Velocity of the hit, applied before the fade
+    int gain;
+    // Balance of the hit, each side out of EnvelopeUnity.
+    int left;
+    int right;
+    // One pole low pass coefficient out of EnvelopeUnity, 0 for none, and
+    // the output of each side so far, in 1/256ths of a sample unit.
+    int lowpass;
+    Sint32 lowpass_state[2];
+    int send;
+  };
+
+  int FindVictim(int track, StealPolicy policy);
+  void Remove(int index);
+  int Read(Voice* v, bool reverse, Sint16* out, int frames);
+  int ReadSource(const Voice* v, bool reverse, int pos, Sint16* out,
+                 int frames);
+
+  int sample_rate_;
+  Voice voices_[MaxVoices + FadeReserve];
+  int count_ = 0;
+  Uint32 serial_ = 0;
+};
+
+#endif  // VOICE_POOL_H